@@ -0,0 +1,324 @@
+/*
+ * Benchmarks for libftxprog: the eeprom codec, the CRC and programming
+ * simulated devices end to end through the library alone.
+ *
+ * Build and run with `make bench`. Results are written as a json
+ * object to bench.json, or to the file named on the command line, so
+ * that runs can be compared with each other. The dumps and `--all`
+ * itself are measured by `ftx_prog --bench`.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ftxprog.h"
+
+#define BENCH_SECONDS	1.0	/* minimum run time of each micro benchmark */
+#define BENCH_UNITS	64	/* simulated devices programmed end to end */
+#define BENCH_LATENCY	1000	/* us per transfer, about a 1ms USB frame */
+#define BENCH_JOBS	8	/* devices programmed at once, as --jobs */
+#define BENCH_QUEUE_DEPTH	16	/* as --queue-depth */
+#define BENCH_FIXTURE	28	/* devices on four 7-port hubs */
+#define BENCH_CONTENTION	2	/* rounds a fixture hub carries at once */
+
+static struct ee_options options = {
+  .transport = &ee_sim_transport,
+  .queue_depth = BENCH_QUEUE_DEPTH,
+  .verify_retries = 3,
+  .retries = 3,
+  .retry_backoff_us = 10000,
+};
+
+static double now_secs (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keeps the compiler from optimising away results */
+static volatile unsigned long bench_sink;
+
+/* ------------ Micro Benchmarks ------------ */
+
+static struct eeprom_fields bench_fields (void)
+{
+  struct eeprom_fields ee;
+
+  memset(&ee, 0, sizeof(ee));
+  ee.usb_vid = 0x0403;
+  ee.usb_pid = 0x6015;
+  ee.max_power = 45;
+  ee.load_vcp = 1;
+  ee.serial_number_avail = 1;
+  ee.manufacturer_string = "FTDI";
+  ee.product_string = "FT230X Basic UART";
+  ee.serial_string = "DN00ABCD";
+  ee.cbus[0] = cbus_txden;
+  ee.cbus[1] = cbus_rxled;
+
+  return ee;
+}
+/**
+ * Encodes an image, decodes it again and frees the strings. Returns
+ * round trips per second.
+ */
+static double bench_codec (void)
+{
+  struct eeprom_fields in = bench_fields(), out;
+  unsigned char eeprom[0x100];
+  double start = now_secs(), elapsed;
+  unsigned long n = 0;
+
+  do {
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+      ee_encode(&options, eeprom, sizeof(eeprom), &in);
+      memset(&out, 0, sizeof(out));
+      ee_decode(&options, eeprom, sizeof(eeprom), &out);
+      bench_sink += out.usb_pid;
+      free(out.manufacturer_string);
+      free(out.product_string);
+      free(out.serial_string);
+    }
+    n += i;
+  } while ((elapsed = now_secs() - start) < BENCH_SECONDS);
+
+  return n / elapsed;
+}
+/**
+ * Compares two images that differ in their product string and max
+ * power, field by field. Returns ee_diff() calls per second.
+ */
+static double bench_diff (void)
+{
+  struct eeprom_fields ee = bench_fields();
+  const struct ee_field *changed[64];
+  unsigned char a[0x100], b[0x100];
+  double start = now_secs(), elapsed;
+  unsigned long n = 0;
+
+  ee_encode(&options, a, sizeof(a), &ee);
+  ee.product_string = "FT231X USB UART";
+  ee.max_power = 50;
+  ee_encode(&options, b, sizeof(b), &ee);
+  do {
+    int i;
+
+    for (i = 0; i < 100000; i++) {
+      bench_sink += ee_diff(a, b, changed, 64);
+    }
+    n += i;
+  } while ((elapsed = now_secs() - start) < BENCH_SECONDS);
+
+  return n / elapsed;
+}
+/**
+ * Returns calc_crc_ftx() calls per second
+ */
+static double bench_crc (void)
+{
+  struct eeprom_fields ee = bench_fields();
+  unsigned char eeprom[0x100];
+  double start = now_secs(), elapsed;
+  unsigned long n = 0;
+
+  ee_encode(&options, eeprom, sizeof(eeprom), &ee);
+  do {
+    int i;
+
+    for (i = 0; i < 100000; i++) {
+      eeprom[0x24] = i;		/* user memory, so the CRC changes */
+      bench_sink += calc_crc_ftx(eeprom);
+    }
+    n += i;
+  } while ((elapsed = now_secs() - start) < BENCH_SECONDS);
+
+  return n / elapsed;
+}
+
+/* ------------ End to End ------------ */
+
+static struct ee_path *bench_paths;
+static int bench_count, bench_next, bench_failed;
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Reads a device, gives it a new product string, writes the words
+ * that changed, reads them back and resets it, which is what
+ * programming a unit costs on the bus. Returns 0 or a negative errno.
+ */
+static int bench_program_device (const char *path)
+{
+  struct ee_device dev;
+  struct ee_write_result wr;
+  struct eeprom_fields ee;
+  unsigned char old[0x100], new[0x100];
+  int ret;
+
+  if ((ret = ee_open(&dev, &options, path)) < 0)
+    return ret;
+  if ((ret = ee_read(&dev, old, sizeof(old))) == 0) {
+    memset(&ee, 0, sizeof(ee));
+    ee_decode(&options, old, sizeof(old), &ee);
+    free(ee.product_string);
+    ee.product_string = "Bench Widget";
+    ee_encode(&options, new, sizeof(new), &ee);
+    ee.product_string = NULL;
+    free(ee.manufacturer_string);
+    free(ee.serial_string);
+
+    if ((ret = ee_write(&dev, old, new, sizeof(new), &wr)) == 0 &&
+        (ret = ee_verify(&dev, new, sizeof(new))) == 0)
+      ret = ee_reset(&dev);
+  }
+  ee_close(&dev);
+
+  return ret;
+}
+static void *bench_worker (void *arg)
+{
+  for (;;) {
+    int i;
+
+    pthread_mutex_lock(&bench_lock);
+    i = bench_next < bench_count ? bench_next++ : -1;
+    pthread_mutex_unlock(&bench_lock);
+    if (i < 0)
+      break;
+
+    if (bench_program_device(bench_paths[i].path) < 0) {
+      pthread_mutex_lock(&bench_lock);
+      bench_failed++;
+      pthread_mutex_unlock(&bench_lock);
+    }
+  }
+
+  return NULL;
+}
+/**
+ * Programs units simulated devices on jobs threads, with hubs that
+ * slow down past contention rounds at once (0 for never). Returns
+ * units per minute.
+ */
+static double bench_program (int units, int latency_us, int jobs,
+                             int contention)
+{
+  struct eeprom_fields ee;
+  pthread_t threads[256];
+  double start, rate = 0;
+  int i;
+
+  if (!(options.sim = ee_sim_new(units, latency_us)))
+    return 0;
+  ee_sim_set_contention(options.sim, contention);
+
+  memset(&ee, 0, sizeof(ee));
+  ee.old_vid = 0x0403;
+  ee.old_pid = 0x6015;
+
+  start = now_secs();
+  bench_count = ee_find(&options, &ee, &bench_paths);
+  bench_next = bench_failed = 0;
+  if (bench_count < 0) {
+    fprintf(stderr, "bench: %s\n", strerror(-bench_count));
+    ee_sim_free(options.sim);
+    return 0;
+  }
+  for (i = 0; i < jobs - 1 && i < 256; i++) {
+    if (pthread_create(&threads[i], NULL, bench_worker, NULL))
+      break;
+  }
+  jobs = i;
+  bench_worker(NULL);	/* and help out */
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  if (bench_failed || bench_count != units) {
+    fprintf(stderr, "bench: %d of %d units failed\n", bench_failed,
+            bench_count);
+  } else {
+    rate = bench_count * 60 / (now_secs() - start);
+  }
+  free(bench_paths);
+  ee_sim_free(options.sim);
+  options.sim = NULL;
+
+  return rate;
+}
+
+/* ------------ Main ------------ */
+
+struct bench_result {
+  const char *key;		/* stable name in the results file */
+  const char *unit;
+  double value;
+};
+
+int main (int argc, char *argv[])
+{
+  const char *path = argc > 1 ? argv[1] : "bench.json";
+  struct bench_result results[] = {
+    { "codec_round_trips_per_sec", "round trips/s" },
+    { "diff_per_sec", "diffs/s" },
+    { "crc_per_sec", "CRCs/s" },
+    { "crc_mb_per_sec", "MB/s" },
+    { "program_units_per_min", "units/min" },
+    { "fixture_units_per_min", "units/min" },
+  };
+  FILE *f;
+  int i;
+
+  results[0].value = bench_codec();
+  results[1].value = bench_diff();
+  results[2].value = bench_crc();
+  results[3].value = results[2].value * 0x100 / 1e6;
+  results[4].value = bench_program(BENCH_UNITS, BENCH_LATENCY, BENCH_JOBS, 0);
+  /* A job for every port, so the hubs are as busy as they get */
+  results[5].value = bench_program(BENCH_FIXTURE, BENCH_LATENCY,
+                                   BENCH_FIXTURE, BENCH_CONTENTION);
+
+  if (!(f = fopen(path, "w"))) {
+    perror(path);
+    return errno;
+  }
+  fprintf(f, "{\n");
+  for (i = 0; i < sizeof(results)/sizeof(results[0]); i++) {
+    fprintf(f, "  \"%s\": %.1f,\n", results[i].key, results[i].value);
+    printf("%-28s %14.1f %s\n", results[i].key, results[i].value,
+           results[i].unit);
+  }
+  fprintf(f, "  \"program_units\": %d,\n", BENCH_UNITS);
+  fprintf(f, "  \"program_latency_us\": %d,\n", BENCH_LATENCY);
+  fprintf(f, "  \"program_jobs\": %d,\n", BENCH_JOBS);
+  fprintf(f, "  \"program_queue_depth\": %d,\n", BENCH_QUEUE_DEPTH);
+  fprintf(f, "  \"fixture_units\": %d,\n", BENCH_FIXTURE);
+  fprintf(f, "  \"fixture_contention\": %d\n", BENCH_CONTENTION);
+  fprintf(f, "}\n");
+  if (fclose(f) == EOF) {
+    perror(path);
+    return errno;
+  }
+  printf("Results written to %s\n", path);
+  return 0;
+}
@@ -22,93 +22,73 @@
  * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#define _GNU_SOURCE	/* for nftw() */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <ftw.h>
 #include <ftdi.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifndef USE_LIBFTDI1
+#include <libusb.h>	/* ftdi.h only pulls this in for libftdi1 */
+#endif
 
-#define MYVERSION	"0.4"
+#include "ftxprog.h"
 
-#define CBUS_COUNT	7
+#define MYVERSION	"0.4"
 
-static struct ftdi_context ftdi;
 static int verbose = 0;
 static int erase_eeprom = 0;
 static int ignore_crc_error = 0;
 static bool use_8b_strings = false;
 static const char *save_path = NULL, *restore_path = NULL;
-
-/* ------------ Bit Definitions for EEPROM Decoding ------------ */
-
-enum cbus_mode {
-  cbus_tristate	=  0,
-  cbus_rxled	=  1,
-  cbus_txled	=  2,
-  cbus_txrxled	=  3,
-  cbus_pwren	=  4,
-  cbus_sleep	=  5,
-  cbus_drive0	=  6,
-  cbus_drive1	=  7,
-  cbus_gpio	=  8,
-  cbus_txden	=  9,
-  cbus_clk24	= 10,
-  cbus_clk12	= 11,
-  cbus_clk6	= 12,
-  cbus_bcd_det	= 13,
-  cbus_bcd_det_i	= 14,
-  cbus_i2c_txe	= 15,
-  cbus_i2c_rxf	= 16,
-  cbus_vbus_sense	= 17,
-  cbus_bitbang_wr	= 18,
-  cbus_bitbang_rd	= 19,
-  cbus_timestamp	= 20,
-  cbus_keep_awake	= 21,
-  _cbus_mode_end
-};
-enum misc_config {
-  bcd_enable		= 0x01,
-  force_power_enable	= 0x02,
-  deactivate_sleep	= 0x04,
-  rs485_echo_suppress	= 0x08,
-  ext_osc			= 0x10,
-  ext_osc_feedback_en	= 0x20,
-  vbus_sense_alloc	= 0x40,
-  load_vcp		= 0x80,
-};
-enum power_config {
-  remote_wakeup		= 0x20,
-  self_powered		= 0x40,
-};
-enum dbus_cbus_config {
-  dbus_drive_strength	= 0x03,
-  dbus_slow_slew		= 0x04,
-  dbus_schmitt		= 0x08,
-  cbus_drive_strength	= 0x30,
-  cbus_slow_slew		= 0x40,
-  cbus_schmitt		= 0x80,
-};
-enum peripheral_config {
-  suspend_pull_down	= 0x04,
-  serial_number_avail	= 0x08,
-  ft1248_cpol		= 0x10,
-  ft1248_bord		= 0x20,
-  ft1248_flow_control	= 0x40,
-  disable_i2c_schmitt	= 0x80,
-  invert_txd		= 0x01,
-  invert_rxd		= 0x02,
-  invert_rts		= 0x04,
-  invert_cts		= 0x08,
-  invert_dtr		= 0x10,
-  invert_dsr		= 0x20,
-  invert_dcd		= 0x40,
-  invert_ri		= 0x80,
-};
+static bool batch_mode = false;
+static int batch_jobs = 8;
+static int hub_jobs = 0, bus_jobs = 0;	/* most per hub and controller */
+static int queue_depth = 16;	/* transfers kept in flight at once */
+static int verify_retries = 3;
+static bool hotplug_mode = false;
+static const char *serial_template = NULL, *serial_counter_path = NULL;
+static const char *audit_path = NULL;
+static const char *bench_path = NULL;
+static const char *daemon_path = NULL;
+static const char *user_read_path = NULL, *user_write_path = NULL;
+static const char *archive_path = NULL, *archive_restore_serial = NULL;
+static bool archive_save = false, archive_list = false;
+static bool inventory_mode = false;
+static int inventory_timeout = 2000;	/* ms per device */
+static bool old_id_given = false;	/* --old-vid or --old-pid */
+static bool timing_enabled = false;
+static int sim_count = 4;	/* --transport sim devices */
+static int sim_latency_us = 0;
+static int sim_errors = 0;	/* one transfer in this many fails */
+static int sim_contention = 0;	/* rounds a simulated hub carries at once */
+static int transfer_retries = 3;
+static int retry_backoff_ms = 10;
+static int reenum_timeout = 0;	/* ms, 0 to just reset and go */
+static const char *ledger_path = NULL;
+static int ledger_sync_ms = 1000;	/* how often the ledger is fsynced */
+static int ledger_report_minutes = -1;	/* window to summarise, 0 for all */
+static int record_fd = 1;	/* where --format json records go */
+static struct ee_options options;	/* for libftxprog, from the above */
 
 /* ------------ Command Line Arguments ------------ */
 
@@ -120,32 +100,48 @@ enum arg_type {
   arg_restore,
   arg_8b_strings,
   arg_cbus,
-  arg_manufacturer,
-  arg_product,
   arg_old_serno,
-  arg_new_serno,
-  arg_max_bus_power,
-  arg_suspend_pull_down,
-  arg_load_vcp,
-  arg_remote_wakeup,
-  arg_ft1248_cpol,
-  arg_ft1248_bord,
-  arg_ft1248_flow_control,
-  arg_i2c_schmitt,
-  arg_i2c_slave_address,
-  arg_i2c_device_id,
-  arg_rs485_echo_suppression,
-
   arg_old_vid,
   arg_old_pid,
-  arg_new_vid,
-  arg_new_pid,
   arg_invert,
-  arg_self_powered,
   arg_ignore_crc_error,
   arg_erase_eeprom,
   arg_dbus_config,
-  arg_cbus_config
+  arg_cbus_config,
+  arg_all,
+  arg_jobs,
+  arg_hotplug,
+  arg_queue_depth,
+  arg_verify_retries,
+  arg_serial_template,
+  arg_serial_counter,
+  arg_audit,
+  arg_format,
+  arg_inventory,
+  arg_timeout,
+  arg_timing,
+  arg_transport,
+  arg_sim_devices,
+  arg_sim_latency,
+  arg_wait_reenum,
+  arg_daemon,
+  arg_user_read,
+  arg_user_write,
+  arg_archive,
+  arg_archive_save,
+  arg_archive_restore,
+  arg_archive_list,
+  arg_precheck,
+  arg_retries,
+  arg_retry_backoff,
+  arg_sim_errors,
+  arg_ledger,
+  arg_ledger_sync,
+  arg_ledger_report,
+  arg_hub_jobs,
+  arg_bus_jobs,
+  arg_sim_contention,
+  arg_bench,
 };
 
 struct args_required_t
@@ -163,31 +159,48 @@ const struct args_required_t req_info[] =
   {arg_restore, 1},
   {arg_8b_strings, 0},
   {arg_cbus, 2},
-  {arg_manufacturer, 1},
-  {arg_product, 1},
   {arg_old_serno, 1},
-  {arg_new_serno, 1},
-  {arg_max_bus_power, 1},
-  {arg_suspend_pull_down, 1},
-  {arg_load_vcp, 1},
-  {arg_remote_wakeup, 1},
-  {arg_ft1248_cpol, 1},
-  {arg_ft1248_bord, 1},
-  {arg_ft1248_flow_control, 1},
-  {arg_i2c_schmitt, 1},
-  {arg_i2c_slave_address, 1},
-  {arg_i2c_device_id, 1},
-  {arg_rs485_echo_suppression, 1},
-
   {arg_old_vid, 1},
   {arg_old_pid, 1},
-  {arg_new_vid, 1},
-  {arg_new_pid, 1},
   {arg_invert, 1},
-  {arg_self_powered, 1},
   {arg_ignore_crc_error, 0},
   {arg_erase_eeprom, 0},
-  {arg_cbus_config,1},
+  {arg_dbus_config, 1},
+  {arg_cbus_config, 1},
+  {arg_all, 0},
+  {arg_jobs, 1},
+  {arg_hotplug, 0},
+  {arg_queue_depth, 1},
+  {arg_verify_retries, 1},
+  {arg_serial_template, 1},
+  {arg_serial_counter, 1},
+  {arg_audit, 1},
+  {arg_format, 1},
+  {arg_inventory, 0},
+  {arg_timeout, 1},
+  {arg_timing, 0},
+  {arg_transport, 1},
+  {arg_sim_devices, 1},
+  {arg_sim_latency, 1},
+  {arg_wait_reenum, 1},
+  {arg_daemon, 1},
+  {arg_user_read, 1},
+  {arg_user_write, 1},
+  {arg_archive, 1},
+  {arg_archive_save, 0},
+  {arg_archive_restore, 1},
+  {arg_archive_list, 0},
+  {arg_precheck, 1},
+  {arg_retries, 1},
+  {arg_retry_backoff, 1},
+  {arg_sim_errors, 1},
+  {arg_ledger, 1},
+  {arg_ledger_sync, 1},
+  {arg_ledger_report, 1},
+  {arg_hub_jobs, 1},
+  {arg_bus_jobs, 1},
+  {arg_sim_contention, 1},
+  {arg_bench, 1},
 };
 
 
@@ -202,31 +215,48 @@ static const char* arg_type_strings[] = {
   "--restore",
   "--8bit-strings",
   "--cbus",
-  "--manufacturer",
-  "--product",
   "--old-serial-number",
-  "--new-serial-number",
-  "--max-bus-power",
-  "--suspend-pull-down",
-  "--load-vcp",
-  "--remote-wakeup",
-  "--ft1248-cpol",
-  "--ft1248-bord",
-  "--ft1248-flow-control",
-  "--i2c-schmitt",
-  "--i2c-slave-address",
-  "--i2c-device-id",
-  "--rs485-echo-supp",
   "--old-vid",
   "--old-pid",
-  "--new-vid",
-  "--new-pid",
   "--invert",
-  "--self-powered",
   "--ignore-crc-error",
   "--erase-eeprom",
   "--dbus-config",
   "--cbus-config",
+  "--all",
+  "--jobs",
+  "--hotplug",
+  "--queue-depth",
+  "--verify-retries",
+  "--serial-template",
+  "--serial-counter",
+  "--audit",
+  "--format",
+  "--inventory",
+  "--timeout",
+  "--timing",
+  "--transport",
+  "--sim-devices",
+  "--sim-latency",
+  "--wait-reenum",
+  "--daemon",
+  "--user-read",
+  "--user-write",
+  "--archive",
+  "--archive-save",
+  "--archive-restore",
+  "--archive-list",
+  "--precheck",
+  "--retries",
+  "--retry-backoff",
+  "--sim-errors",
+  "--ledger",
+  "--ledger-sync",
+  "--ledger-report",
+  "--hub-jobs",
+  "--bus-jobs",
+  "--sim-contention",
+  "--bench",
   NULL
 };
 static const char* rs232_strings[] = {
@@ -287,6 +317,45 @@ static const char *d_cbus_config_strings [] = {
   NULL
 };
 
+enum output_format {
+  format_text,
+  format_json,
+  format_ndjson,
+};
+static enum output_format output_format = format_text;
+
+enum transport_type {
+  transport_libftdi,
+  transport_libusb,
+  transport_sim,
+};
+static enum transport_type transport = transport_libftdi;
+static const char *transport_strings[] = {
+  "libftdi",
+  "libusb",
+  "sim",
+  NULL
+};
+
+enum precheck_mode {
+  precheck_off,
+  precheck_crc,		/* the CRC and key words match */
+  precheck_full,	/* and then every word does */
+};
+static enum precheck_mode precheck = precheck_off;
+static const char *precheck_strings[] = {
+  "off",
+  "crc",
+  "full",
+  NULL
+};
+static const char *format_strings[] = {
+  "text",
+  "json",
+  "ndjson",
+  NULL
+};
+
 static const char *arg_type_help[] = {
   "   				    # (show this help text)",
   "				    # (dump eeprom settings to stdout)",
@@ -295,32 +364,48 @@ static const char *arg_type_help[] = {
   "			 <file>     # (restore initial eeprom contents from file)",
   "                      # (byte strings)",
   "[cbus]",
-  "		 <string>   # (new USB manufacturer string)",
-  "			 <string>   # (new USB product name string)",
   "	 <string>   # (current serial number of device to be reprogrammed)",
-  "	 <string>   # (new USB serial number string)",
-  "		 <number>   # (max bus current in milli-amperes)",
-  "	 [on|off]   # (force I/O pins into logic low state on suspend)",
-  "		 [on|off]   # (controls if the VCP drivers are loaded)",
-  "		 [on|off]   # (allows the interface to be woken up by something other than USB)",
-  "		 [high|low] # (set the clock polarity on the FT1248 interface to active high or active low)",
-  "		 [msb|lsb]  # (set the bit order on the FT1248 interface to msb first or lsb first)",
-  "	 [on|off]   # (flow control for FT1248 interface)",
-  "		 [on|off]   # (schmitt trigger on I2C interface)",
-  "	 <number>   # (I2C slave address)",
-  "		 <number>   # (I2C device ID)",
-  "		 [on|off]   # (enable echo supression on the RS485 bus)",
   "			 <number>   # (current vendor id of device to be reprogrammed, eg. 0x0403)",
   "			 <number>   # (current product id of device to be reprogrammed, eg. 0x6001)",
-  "			 <number>   # (new/custom vendor id to be programmed)",
-  "			 <number>   # (new/custom product id be programmed)",
   "[invert]",
-  "		 [on|off]   # (specify if chip is bus-powered or self-powered)",
   "   				    # Ignore CRC errors and continue ",
   "   				    # Erase the EEPROM and exit",
   "dbus_cfg",
   "cbus_cfg",
-
+  "				    # (program every device matching --old-vid/--old-pid)",
+  "			 <number>   # (number of devices to program at once with --all)",
+  "				    # (program each matching device as it is plugged in)",
+  "		 <number>   # (eeprom transfers kept in flight at once, libftdi1 and sim)",
+  "	 <number>   # (times to rewrite words that differ on readback)",
+  "	 <format>   # (allocate new serial numbers, eg. ABC%06u)",
+  "	 <file>     # (counter file that --serial-template allocates from)",
+  "			 <dir>      # (check every --save file under dir, no device needed)",
+  "[format]",
+  "			 # (read every matching device, never write, and report)",
+  "<milliseconds>    # (per-device deadline for --inventory, default 2000)",
+  "			 # (time each phase and every eeprom transfer)",
+  "[transport]",
+  "<number>          # (how many devices --transport sim has, default 4)",
+  "<microseconds>    # (time each simulated transfer takes, default 0)",
+  "<milliseconds>    # (reset the port after writing and wait for the device to come back as programmed)",
+  "			 <socket>   # (serve requests on a unix socket until interrupted)",
+  "		 <file>     # (save the user area to file, leaving the settings alone)",
+  "		 <file>     # (write file to the user area, only the words that differ)",
+  "			 <dir>      # (archive of saved images for the options below)",
+  "		    # (add each device's original image to the archive)",
+  "	 <serial|-> # (restore the latest image archived for a serial number)",
+  "		    # (list everything in the archive)",
+  "[precheck]",
+  "		 <number>   # (times to retry a transfer that failed transiently, default 3)",
+  "<milliseconds>    # (wait before the first retry, doubling each time, default 10)",
+  "		 <number>   # (make one in this many simulated transfers fail)",
+  "			 <file>     # (append a record of every device programmed to file)",
+  "<milliseconds>    # (how often the ledger is written and synced, default 1000)",
+  "	 <minutes>  # (summarise the ledger over the last minutes, 0 for all, and exit)",
+  "		 <number>   # (most devices programmed at once on one hub with --all, adapting to latency)",
+  "		 <number>   # (most devices programmed at once on one root controller with --all)",
+  "	 <number>   # (rounds of transfers a simulated hub carries before slowing down)",
+  "			 <file>     # (time the dumps and --all on simulated devices, results to file)",
 };
 
 static const char *bool_strings[] = {
@@ -346,88 +431,6 @@ static const char *bool_strings[] = {
   "lsb",
 };
 
-struct eeprom_fields {
-  /* Misc Config */
-  unsigned char bcd_enable;
-  unsigned char force_power_enable;
-  unsigned char deactivate_sleep;
-  unsigned char rs485_echo_suppress;
-  unsigned char ext_osc;
-  unsigned char ext_osc_feedback_en;
-  unsigned char vbus_sense_alloc;
-  unsigned char load_vcp;
-
-  /* USB VID/PID */
-  unsigned short usb_vid;
-  unsigned short usb_pid;
-
-  /* USB Release Number */
-  unsigned short usb_release_major;
-  unsigned short usb_release_minor;
-
-  /* Max Power and Config */
-  unsigned char remote_wakeup;
-  unsigned char self_powered;
-  unsigned char max_power; /* Units of 2mA */
-
-  /* Device and perhiperal control */
-  unsigned char suspend_pull_down;
-  unsigned char serial_number_avail;
-  unsigned char ft1248_cpol;
-  unsigned char ft1248_bord;
-  unsigned char ft1248_flow_control;
-  unsigned char disable_i2c_schmitt;
-  unsigned char invert_txd;
-  unsigned char invert_rxd;
-  unsigned char invert_rts;
-  unsigned char invert_cts;
-  unsigned char invert_dtr;
-  unsigned char invert_dsr;
-  unsigned char invert_dcd;
-  unsigned char invert_ri;
-
-  /* DBUS & CBUS Control */
-  unsigned char dbus_drive_strength;
-  unsigned char dbus_slow_slew;
-  unsigned char dbus_schmitt;
-  unsigned char cbus_drive_strength;
-  unsigned char cbus_slow_slew;
-  unsigned char cbus_schmitt;
-
-  /* Manufacturer, Product and Serial Number string */
-  char* manufacturer_string;
-  char* product_string;
-  char* serial_string;
-
-  /* I2C */
-  unsigned short i2c_slave_addr;
-  unsigned int i2c_device_id;
-
-  /* CBUS */
-  enum cbus_mode cbus[CBUS_COUNT];
-
-  /* Other memory areas */
-  unsigned char user_mem[92];			/* user memory space */
-  unsigned char factory_config[32];	/* factory configuration values */
-
-  /* These are not actually eeprom values; here for convenience */
-  unsigned short		old_vid;
-  unsigned short		old_pid;
-  const char		*old_serno;
-};
-
-/* ------------ libftdi helpers ------------ */
-
-static void do_deinit (void)
-{
-  ftdi_deinit(&ftdi);
-}
-
-static void do_close (void)
-{
-  ftdi_usb_close(&ftdi);
-}
-
 /* ------------ Printing ------------ */
 
 /**
@@ -462,420 +465,245 @@ const char* print_bool(char value)
   if (value) return bool_strings[1];
   return bool_strings[0];
 }
+/* A number as it is shown and given, eg. in mA */
+static unsigned int field_shown (struct eeprom_fields *ee,
+                                 const struct ee_field *f)
+{
+  return ee_field_get(ee, f) * (f->scale ? f->scale : 1) + f->bias;
+}
 /**
- * Prints out the current FT-X EEPROM Configuration
+ * Returns a field the way ee_dump() shows it, formatted into buf if
+ * it isn't a fixed string
  */
-static void ee_dump (struct eeprom_fields *ee)
+static const char *field_show (char *buf, size_t size,
+                               struct eeprom_fields *ee,
+                               const struct ee_field *f)
 {
-  unsigned int c;
-
-  /* Misc Config */
-  printf("	Battery Charge Detect (BCD) Enabled = %s\n",
-         print_bool(ee->bcd_enable));
-  printf("	Force Power Enable Signal on CBUS = %s\n",
-         print_bool(ee->force_power_enable));
-  printf("	Deactivate Sleep in Battery Charge Mode = %s\n",
-         print_bool(ee->deactivate_sleep));
-
-  printf("	External Oscillator Enabled = %s\n", print_bool(ee->ext_osc));
-  printf("	External Oscillator Feedback Resistor Enabled = %s\n",
-         print_bool(ee->ext_osc_feedback_en));
-  printf("	CBUS pin allocated to VBUS Sense Mode = %s\n",
-         print_bool(ee->vbus_sense_alloc));
-  printf("	Load Virtual COM Port (VCP) Drivers = %s\n",
-         print_bool(ee->load_vcp));
-
-  /* USB VID/PID */
-  printf("	Vendor ID (VID) = 0x%04x\n", ee->usb_vid);
-  printf("	Product ID (PID) = 0x%04x\n", ee->usb_pid);
-
-  /* USB Release Number */
-  printf("	USB Version = USB%d.%d\n", ee->usb_release_major,
-         ee->usb_release_minor);
-
-  /* Max Power and Config */
-  printf("	Remote Wakeup by something other than USB = %s\n",
-         print_bool(ee->remote_wakeup));
-  printf("	Self Powered = %s\n", print_bool(ee->self_powered));
-  printf("	Maximum Current Supported from USB = %dmA\n",
-         2 * ee->max_power); /* units of 2mA */
-
-  /* Device and perhiperal control */
-  printf("	Pins Pulled Down on USB Suspend = %s\n",
-         print_bool(ee->suspend_pull_down));
-  printf("	Indicate USB Serial Number Available = %s\n",
-         print_bool(ee->serial_number_avail));
-
-  printf(" FT1248\n");
-  printf("-------\n");
-  printf("	FT1248 Clock Polarity = %s\n",
-         ee->ft1248_cpol ? "Active High":"Active Low");
-  printf("	FT1248 Bit Order = %s\n",
-         ee->ft1248_bord ? "LSB to MSB":"MSB to LSB");
-  printf("	FT1248 Flow Control Enabled = %s\n",
-         print_bool(ee->ft1248_flow_control));
-
-  printf(" RS232\n");
-  printf("-------\n");
-  printf("	Invert TXD = %s\n", print_bool(ee->invert_txd));
-  printf("	Invert RXD = %s\n", print_bool(ee->invert_rxd));
-  printf("	Invert RTS = %s\n", print_bool(ee->invert_rts));
-  printf("	Invert CTS = %s\n", print_bool(ee->invert_cts));
-  printf("	Invert DTR = %s\n", print_bool(ee->invert_dtr));
-  printf("	Invert DSR = %s\n", print_bool(ee->invert_dsr));
-  printf("	Invert DCD = %s\n", print_bool(ee->invert_dcd));
-  printf("	Invert RI = %s\n", print_bool(ee->invert_ri));
-
-  printf(" RS485\n");
-  printf("-------\n");
-  printf("	RS485 Echo Suppression Enabled = %s\n",
-         print_bool(ee->rs485_echo_suppress));
-
-  /* DBUS & CBUS Control */
-  printf("	DBUS Drive Strength = %dmA\n", 4 * (ee->dbus_drive_strength+1));
-  printf("	DBUS Slow Slew Mode = %u\n", ee->dbus_slow_slew);
-  printf("	DBUS Schmitt Trigger = %u\n", ee->dbus_schmitt);
-  printf("	CBUS Drive Strength = %dmA\n", 4 * (ee->cbus_drive_strength+1));
-  printf("	CBUS Slow Slew Mode = %u\n", ee->cbus_slow_slew);
-  printf("	CBUS Schmitt Trigger = %u\n", ee->cbus_schmitt);
-
-  /* Manufacturer, Product and Serial Number string */
-  printf("	Manufacturer = %s\n", ee->manufacturer_string);
-  printf("	Product = %s\n", ee->product_string);
-  printf("	Serial Number = %s\n", ee->serial_string);
-
-  /* I2C */
-  printf("  I2C\n");
-  printf("-------\n");
-  printf("	I2C Slave Address = %d \n", ee->i2c_slave_addr);
-  printf("	I2C Device ID = %d \n", ee->i2c_device_id);
-  printf("	I2C Schmitt Triggers Disabled = %s\n",
-         print_bool(ee->disable_i2c_schmitt));
-
-  /* CBUS */
-  printf("  CBUS\n");
-  printf("-------\n");
-  for (c = 0; c < CBUS_COUNT; ++c) {
+  unsigned int v;
+
+  switch (f->format) {
+  case ee_format_string:
+    return *(char **)ee_field_ptr(ee, f);
+  case ee_format_bool:
+    if (ee_field_get(ee, f))
+      return f->on ? f->on : print_bool(1);
+    return f->off ? f->off : print_bool(0);
+  case ee_format_cbus:
     /* Check this is a valid cbus mode */
-      if (ee->cbus[c] < _cbus_mode_end) {
-        printf("	CBUS%u = %s\n", c, cbus_mode_strings[ee->cbus[c]]);
-      } else {
-        printf("	CBUS%u = %d\n", c, ee->cbus[c]);
-      }
+    if ((v = ee_field_get(ee, f)) < _cbus_mode_end)
+      return cbus_mode_strings[v];
+    snprintf(buf, size, "%d", v);
+    return buf;
+  default:
+    snprintf(buf, size, f->shown ? f->shown : "%u", field_shown(ee, f));
+    return buf;
   }
 }
-
-/* ------------ Cyclic Redundancy Check ------------ */
-
-static unsigned short calc_crc_ftx (void *addr)
+/**
+ * Prints out the current FT-X EEPROM Configuration
+ */
+static void ee_dump (struct eeprom_fields *ee)
 {
-  unsigned int i;
-  unsigned short crc = 0xaaaa;
-  unsigned char* d8 = addr;
-
-  /* Word Addresses 0x0 - 0x11 inclusive */
-  for (i = 0; i < 0x12*2; i += 2) {
-    crc ^= d8[i] | (d8[i+1] << 8);
-    crc  = (crc << 1) | (crc >> 15);
+  const struct ee_field *f, *end = ee_fields + ee_field_count;
+  char val[32];
+
+  flockfile(stdout);
+  for (f = ee_fields; f < end; f++) {
+    /* A field with an empty label runs on from the one before */
+    bool runs_on = f + 1 < end && f[1].label && !*f[1].label;
+
+    if (!f->label)
+      continue;
+    if (f->section)
+      printf("%s\n-------\n", f->section);
+    /* Put together without printf, which takes twice as long */
+    if (*f->label) {
+      putchar('\t');
+      fputs(f->label, stdout);
+      fputs(" = ", stdout);
+    }
+    fputs(field_show(val, sizeof(val), ee, f), stdout);
+    if (!runs_on)
+      putchar('\n');
   }
+  funlockfile(stdout);
+}
 
-  /* Word Addresses 0x12 - 0x39 are ignored */
+/* ------------ Machine-readable Output ------------ */
 
-  /* Word Addresses 0x40 - 0x7E inclusive */
-  for (i = 0x40*2; i < 0x7F*2; i += 2) {
-    crc ^= d8[i] | (d8[i+1] << 8);
-    crc  = (crc << 1) | (crc >> 15);
-  }
+#define JSON_BUF_SIZE	8192
 
-  /* Word Address 0x7E is ignored */
-  /* Word Address 0x7F is the checksum */
+/* A record is built up in one buffer so that it goes out in one write */
+struct json_buf {
+  char buf[JSON_BUF_SIZE];
+  size_t len;
+  bool pretty;
+  bool first;
+};
 
-  return crc;
+static void json_raw (struct json_buf *j, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (j->len >= sizeof(j->buf))
+    return;
+  va_start(ap, fmt);
+  j->len += vsnprintf(j->buf + j->len, sizeof(j->buf) - j->len, fmt, ap);
+  va_end(ap);
+  if (j->len > sizeof(j->buf))
+    j->len = sizeof(j->buf);
 }
-static unsigned short verify_crc (void *addr, int len)
+static void json_key (struct json_buf *j, const char *key)
 {
-  unsigned short crc    = calc_crc_ftx(addr);
-  unsigned char *d8     = addr;
-  unsigned short actual = d8[len-2] | (d8[len-1] << 8);
-
-  if (crc != actual) {
-    fprintf(stderr, "Bad CRC: crc=0x%04x, actual=0x%04x\n", crc, actual);
-    if (ignore_crc_error == 0) {
-      exit(EINVAL);
+  json_raw(j, "%s\"%s\":%s", j->first ? "" : (j->pretty ? ",\n  " : ","),
+           key, j->pretty ? " " : "");
+  j->first = false;
+}
+static void json_string (struct json_buf *j, const char *key, const char *str)
+{
+  json_key(j, key);
+  json_raw(j, "\"");
+  for (; str && *str; str++) {
+    unsigned char c = *str;
+
+    if (c == '"' || c == '\\') {
+      json_raw(j, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      json_raw(j, "\\u%04x", c);
     } else {
-      fprintf(stderr, "Ignoring CRC error\n");
+      json_raw(j, "%c", c);
     }
   }
-  if (verbose) { printf("CRC: Okay (0x%04x)\n", crc); }
-  return crc;
+  json_raw(j, "\"");
+}
+static void json_uint (struct json_buf *j, const char *key, unsigned int val)
+{
+  json_key(j, key);
+  json_raw(j, "%u", val);
+}
+static void json_bool (struct json_buf *j, const char *key, int val)
+{
+  json_key(j, key);
+  json_raw(j, val ? "true" : "false");
 }
-static unsigned short update_crc (void *addr, int len)
+static void json_hex (struct json_buf *j, const char *key,
+                      const unsigned char *data, int len)
 {
-  unsigned short crc = calc_crc_ftx(addr);
-  unsigned char *d8  = addr;
+  int i;
 
-  d8[len-2] = crc;
-  d8[len-1] = crc >> 8;
-  return crc;
+  json_key(j, key);
+  json_raw(j, "\"");
+  for (i = 0; i < len; i++) {
+    json_raw(j, "%02x", data[i]);
+  }
+  json_raw(j, "\"");
 }
+static int fd_write (int fd, const char *buf, size_t len)
+{
+  size_t done = 0;
 
-/* ------------ EEPROM Encoding and Decoding ------------ */
+  while (done < len) {
+    ssize_t n = write(fd, buf + done, len - done);
 
+    if (n < 0 && errno != EINTR)
+      return -errno;
+    if (n > 0)
+      done += n;
+  }
+  return 0;
+}
+static int record_write (const char *buf, size_t len)
+{
+  return fd_write(record_fd, buf, len);
+}
+static void json_begin (struct json_buf *j, bool pretty)
+{
+  j->len = 0;
+  j->pretty = pretty;
+  j->first = true;
+  json_raw(j, j->pretty ? "{\n  " : "{");
+}
 /**
- * Checks that the strings aren't too big to fit in the string
- * descriptors memory.
+ * Finishes a record and writes it out in one go, so that records from
+ * several devices never interleave.
  */
-static int ee_check_strings(char* man, char* prod, char* ser)
+static int json_end (struct json_buf *j)
 {
-  /* if the strings are too long */
-  if (strlen(man) + strlen(prod) + strlen(ser) > 96)	return 1;
-  return 0;
+  json_raw(j, j->pretty ? "\n}\n" : "}\n");
+  return record_write(j->buf, j->len);
 }
 /**
- * Inserts a string into a buffer to be written out to the eeprom
+ * Adds every field of an eeprom image to a record
  */
-static void ee_encode_string(char* str, unsigned char *ptr_field,
-                             unsigned char* len_field, unsigned char* eeprom,
-                             unsigned char* string_addr)
+static void json_eeprom (struct json_buf *j, unsigned char *eeprom, int len)
 {
-  int original_length = strlen(str), length;
+  struct eeprom_fields ee;
+  const struct ee_field *f;
+  unsigned short crc;
 
-  if (use_8b_strings) {
-    length = original_length;
-  } else {
-    length = strlen(str)*2 + 2;
-    char* ftstr = malloc(length);
-
-    /* Encode a FT Prog compatible string */
-    ftstr[0] = length;
-    ftstr[1] = 3;
-
-    int in, out;
-    for (in = 0, out = 2; out < length; in++, out += 2) {
-      ftstr[out] = str[in];
-      ftstr[out+1] = 0;
-    }
-
-    str = ftstr;
-  }
-
-  /* Copy the strings to the string area */
-  memcpy(eeprom + *string_addr, str, length);
-
-  /* Write the the two metadata fields */
-  *ptr_field = *string_addr;
-  *len_field = length;
-  /* Move the string area address forward */
-  *string_addr += *len_field;
-}
-/**
- * Encodes an eeprom_fields object into a buffer ready to be written
- * out to the eeprom.
- */
-static unsigned short ee_encode (unsigned char *eeprom, int len,
-                                 struct eeprom_fields *ee)
-{
-  int c; unsigned char string_desc_addr = 0xA0;
-
-  memset(eeprom, 0, len);
-
-  /* Misc Config */
-  if (ee->bcd_enable)			eeprom[0x00] |= bcd_enable;
-  if (ee->force_power_enable)		eeprom[0x00] |= force_power_enable;
-  if (ee->deactivate_sleep)		eeprom[0x00] |= deactivate_sleep;
-  if (ee->rs485_echo_suppress)		eeprom[0x00] |= rs485_echo_suppress;
-  if (ee->ext_osc)				eeprom[0x00] |= ext_osc;
-  if (ee->ext_osc_feedback_en)		eeprom[0x00] |= ext_osc_feedback_en;
-  if (ee->vbus_sense_alloc)		eeprom[0x00] |= vbus_sense_alloc;
-  if (ee->load_vcp)			eeprom[0x00] |= load_vcp;
-
-  /* USB VID/PID */
-  eeprom[0x02] = ee->usb_vid & 0xFF;
-  eeprom[0x03] = (ee->usb_vid >> 8) & 0xFF;
-  eeprom[0x04] = ee->usb_pid & 0xFF;
-  eeprom[0x05] = (ee->usb_pid >> 8) & 0xFF;
-
-  /* USB Release Number */
-  eeprom[0x07] = ee->usb_release_major;
-  eeprom[0x06] = ee->usb_release_minor;
-
-  /* Max Power and Config */
-  if (ee->remote_wakeup)			eeprom[0x08] |= remote_wakeup;
-  if (ee->self_powered)			eeprom[0x08] |= self_powered;
-  eeprom[0x08] |= 0x80;	/* This is a reserved bit! */
-  eeprom[0x09] = ee->max_power; /* Units of 2mA */
-
-  /* Device and perhiperal control */
-  if (ee->suspend_pull_down)		eeprom[0x0A] |= suspend_pull_down;
-  if (ee->serial_number_avail)		eeprom[0x0A] |= serial_number_avail;
-  if (ee->ft1248_cpol)			eeprom[0x0A] |= ft1248_cpol;
-  if (ee->ft1248_bord)			eeprom[0x0A] |= ft1248_bord;
-  if (ee->ft1248_flow_control)		eeprom[0x0A] |= ft1248_flow_control;
-  if (ee->disable_i2c_schmitt)		eeprom[0x0A] |= disable_i2c_schmitt;
-  if (ee->invert_txd)			eeprom[0x0B] |= invert_txd;
-  if (ee->invert_rxd)			eeprom[0x0B] |= invert_rxd;
-  if (ee->invert_rts)			eeprom[0x0B] |= invert_rts;
-  if (ee->invert_cts)			eeprom[0x0B] |= invert_cts;
-  if (ee->invert_dtr)			eeprom[0x0B] |= invert_dtr;
-  if (ee->invert_dsr)			eeprom[0x0B] |= invert_dsr;
-  if (ee->invert_dcd)			eeprom[0x0B] |= invert_dcd;
-  if (ee->invert_ri)			eeprom[0x0B] |= invert_ri;
-
-  /* DBUS & CBUS Control */
-  eeprom[0x0C] |= (ee->dbus_drive_strength & dbus_drive_strength);
-  if (ee->dbus_slow_slew)			eeprom[0x0C] |= dbus_slow_slew;
-  if (ee->dbus_schmitt)			eeprom[0x0C] |= dbus_schmitt;
-  eeprom[0x0C] |= (ee->cbus_drive_strength << 4) & cbus_drive_strength;
-  if (ee->cbus_slow_slew)			eeprom[0x0C] |= cbus_slow_slew;
-  if (ee->cbus_schmitt)			eeprom[0x0C] |= cbus_schmitt;
-
-  /* eeprom[0x0D] is unused */
-
-  /* Manufacturer, Product and Serial Number string */
-  if (ee_check_strings(ee->manufacturer_string, ee->product_string,
-                       ee->serial_string)) {
-    fprintf(stderr,
-            "Failed to encode, strings too long to fit in string memory area!\n");
-    exit(EINVAL);
-  }
-  ee_encode_string(ee->manufacturer_string, &eeprom[0x0E], &eeprom[0x0F],
-                   eeprom, &string_desc_addr);
-  ee_encode_string(ee->product_string, &eeprom[0x10], &eeprom[0x11],
-                   eeprom, &string_desc_addr);
-  ee_encode_string(ee->serial_string, &eeprom[0x12], &eeprom[0x13],
-                   eeprom, &string_desc_addr);
+  memset(&ee, 0, sizeof(ee));
+  ee_decode(&options, eeprom, len, &ee);
 
-  /* I2C */
-  eeprom[0x14] = ee->i2c_slave_addr & 0xFF;
-  eeprom[0x15] = (ee->i2c_slave_addr >> 8) & 0xFF;
-  eeprom[0x16] = ee->i2c_device_id & 0xFF;
-  eeprom[0x17] = (ee->i2c_device_id >> 8) & 0xFF;
-  eeprom[0x18] = (ee->i2c_device_id >> 16) & 0xFF;
+  for (f = ee_fields; f < ee_fields + ee_field_count; f++) {
+    unsigned int v;
 
-  /* CBUS */
-  for (c = 0; c < CBUS_COUNT; c++) {
-    eeprom[0x1A + c] = ee->cbus[c];
+    switch (f->format) {
+    case ee_format_bool:
+      json_bool(j, f->name, ee_field_get(&ee, f));
+      break;
+    case ee_format_cbus:
+      /* By name where the mode is known */
+      if ((v = ee_field_get(&ee, f)) < _cbus_mode_end) {
+        json_string(j, f->name, cbus_mode_strings[v]);
+      } else {
+        json_uint(j, f->name, v);
+      }
+      break;
+    case ee_format_string:
+      json_string(j, f->name, *(char **)ee_field_ptr(&ee, f));
+      break;
+    case ee_format_bytes:
+      json_hex(j, f->name, ee_field_ptr(&ee, f), f->width);
+      break;
+    default:
+      json_uint(j, f->name, field_shown(&ee, f));
+    }
   }
 
-  /* User Memory Space */
-  memcpy(&eeprom[0x24], ee->user_mem, 92);
-  /* Factory Configuration Values */
-  memcpy(&eeprom[0x80], ee->factory_config, 32);
+  crc = eeprom[len-2] | (eeprom[len-1] << 8);
+  json_uint(j, "crc", crc);
+  json_bool(j, "crc_ok", calc_crc_ftx(eeprom) == crc);
+  json_hex(j, "image", eeprom, len);
 
-  return update_crc(eeprom, len);
+  free(ee.manufacturer_string);
+  free(ee.product_string);
+  free(ee.serial_string);
 }
 /**
- * Extracts a string from the a buffer read from eeprom
+ * Writes a --format json/ndjson record for a device's eeprom image
  */
-static char* ee_decode_string(unsigned char *eeprom, unsigned char* ptr,
-                              unsigned char len)
+static int ee_dump_json (const char *device, unsigned char *eeprom, int len)
 {
-  char* str = malloc(len+1);
-
-  if (str != NULL) {
-    /* Copy the string from the EEPROM memory */
-    memcpy(str, ptr, len);
+  struct json_buf j;
 
-    /* Decode strings written by FT Prog correctly */
-    if (use_8b_strings) {
-      str[len] = '\0';
-    } else {
-
-      /* Pick the actual ASCII characters out of the FT Prog encoded string */
-      int in, out;
-      for (in = 2, out = 0; in < len; in += 2, out++) {
-        str[out] = str[in];
-      }
-
-      str[out] = '\0';
-    }
-  }
-
-  return str;
-}
-/*
- * Populates an eeprom_fields object from a buffer read from eeprom
- */
-static void ee_decode (unsigned char *eeprom, int len, struct eeprom_fields *ee)
-{
-  int c;
-
-  /* Misc Config */
-  ee->bcd_enable = (eeprom[0x00] & bcd_enable);
-  ee->force_power_enable = (eeprom[0x00] & force_power_enable);
-  ee->deactivate_sleep = (eeprom[0x00] & deactivate_sleep);
-  ee->rs485_echo_suppress = (eeprom[0x00] & rs485_echo_suppress);
-  ee->ext_osc = (eeprom[0x00] & ext_osc);
-  ee->ext_osc_feedback_en = (eeprom[0x00] & ext_osc_feedback_en);
-  ee->vbus_sense_alloc = (eeprom[0x00] & vbus_sense_alloc);
-  ee->load_vcp = (eeprom[0x00] & load_vcp);
-
-  /* USB VID/PID */
-  ee->usb_vid = eeprom[0x02] | (eeprom[0x03] << 8);
-  ee->usb_pid = eeprom[0x04] | (eeprom[0x05] << 8);
-
-  /* USB Release Number */
-  ee->usb_release_major = eeprom[0x07];
-  ee->usb_release_minor = eeprom[0x06];
-
-  /* Max Power and Config */
-  ee->remote_wakeup = (eeprom[0x08] & remote_wakeup);
-  ee->self_powered = (eeprom[0x08] & self_powered);
-  ee->max_power = eeprom[0x09]; /* Units of 2mA */
-
-  /* Device and perhiperal control */
-  ee->suspend_pull_down = (eeprom[0x0A] & suspend_pull_down);
-  ee->serial_number_avail = (eeprom[0x0A] & serial_number_avail);
-  ee->ft1248_cpol = (eeprom[0x0A] & ft1248_cpol);
-  ee->ft1248_bord = (eeprom[0x0A] & ft1248_bord);
-  ee->ft1248_flow_control = (eeprom[0x0A] & ft1248_flow_control);
-  ee->disable_i2c_schmitt = (eeprom[0x0A] & disable_i2c_schmitt);
-  ee->invert_txd = (eeprom[0x0B] & invert_txd);
-  ee->invert_rxd = (eeprom[0x0B] & invert_rxd);
-  ee->invert_rts = (eeprom[0x0B] & invert_rts);
-  ee->invert_cts = (eeprom[0x0B] & invert_cts);
-  ee->invert_dtr = (eeprom[0x0B] & invert_dtr);
-  ee->invert_dsr = (eeprom[0x0B] & invert_dsr);
-  ee->invert_dcd = (eeprom[0x0B] & invert_dcd);
-  ee->invert_ri = (eeprom[0x0B] & invert_ri);
-
-  /* DBUS & CBUS Control */
-  ee->dbus_drive_strength = (eeprom[0x0C] & dbus_drive_strength);
-  ee->dbus_slow_slew = (eeprom[0x0C] & dbus_slow_slew);
-  ee->dbus_schmitt = (eeprom[0x0C] & dbus_schmitt);
-  ee->cbus_drive_strength = (eeprom[0x0C] & cbus_drive_strength) >> 4;
-  ee->cbus_slow_slew = (eeprom[0x0C] & cbus_slow_slew);
-  ee->cbus_schmitt = (eeprom[0x0C] & cbus_schmitt);
-
-  /* eeprom[0x0D] is unused */
-
-  /* Manufacturer, Product and Serial Number string */
-  ee->manufacturer_string = ee_decode_string(eeprom,
-                                             eeprom+eeprom[0x0E], eeprom[0x0F]);
-  ee->product_string = ee_decode_string(eeprom,
-                                        eeprom+eeprom[0x10], eeprom[0x11]);
-  ee->serial_string = ee_decode_string(eeprom,
-                                       eeprom+eeprom[0x12], eeprom[0x13]);
-
-  /* I2C */
-  ee->i2c_slave_addr = eeprom[0x14] | (eeprom[0x15] << 8);
-  ee->i2c_device_id = eeprom[0x16] | (eeprom[0x17] << 8) | (eeprom[0x18] << 16);
-
-  /* CBUS */
-  for (c = 0; c < CBUS_COUNT; c++) {
-    ee->cbus[c] = eeprom[0x1A + c];
-  }
-
-  /* User Memory Space */
-  memcpy(ee->user_mem, &eeprom[0x24], 92);
-  /* Factory Configuration Values */
-  memcpy(ee->factory_config, &eeprom[0x80], 32);
+  json_begin(&j, output_format == format_json);
+  json_string(&j, "device", device);
+  json_eeprom(&j, eeprom, len);
+  return json_end(&j);
 }
 
 /* ------------ Help ------------ */
 
 static const char *myname;
 
+static void show_banner (FILE *fp)
+{
+  fprintf(fp, "\n%s: version %s\n", myname, MYVERSION);
+  fprintf(fp, "Modified for the FT-X series by Richard Meadows\n\n");
+  fprintf(fp, "Based upon:\n");
+  fprintf(fp, "ft232r_prog: version 1.23, by Mark Lord.\n");
+}
+
 /**
  * Prints a human-readable expression showing all the possibilities
  * for an option.
@@ -918,88 +746,439 @@ static void show_help (FILE *fp)
         print_options(fp, d_cbus_config_strings);
       } else if (strcmp(val, "cbus_cfg") == 0) {
         print_options(fp, d_cbus_config_strings);
+      } else if (strcmp(val, "[transport]") == 0) {
+        print_options(fp, transport_strings);
+        fprintf(fp, " # (how to reach devices, sim is in memory)");
+      } else if (strcmp(val, "[precheck]") == 0) {
+        print_options(fp, precheck_strings);
+        fprintf(fp, " # (with --all, skip devices already holding their image)");
+      } else if (strcmp(val, "[format]") == 0) {
+        print_options(fp, format_strings);
+        fprintf(fp, " # (how to print settings, json/ndjson go alone on stdout)");
       } else {
         fprintf(fp, "  %s", val);
       }
     }
     fputc('\n', fp);
   }
+  /* Then the options that set one eeprom field each */
+  for (i = 0; i < ee_field_count; i++) {
+    if (ee_fields[i].arg)
+      fprintf(fp, "    %s  %s\n", ee_fields[i].arg, ee_fields[i].help);
+  }
   fputc('\n', fp);
 }
 
-/* ------------ EEPROM Reading and Writing ------------ */
+/* ------------ Timing ------------ */
+
+enum timing_phase {
+  phase_enumerate,
+  phase_open,
+  phase_read,
+  phase_build,
+  phase_prepare,
+  phase_write,
+  phase_verify,
+  phase_reset,
+  phase_reenumerate,
+  _phase_end
+};
+static const char *phase_strings[] = {
+  "enumerate",
+  "open",
+  "read",
+  "build",
+  "prepare",
+  "write",
+  "verify",
+  "reset",
+  "reenumerate",
+  NULL
+};
+
+/* Transfer latencies go in power of two microsecond buckets, bucket
+ * b holding [2^(b-1), 2^b) us and the last one everything slower */
+#define TIMING_BUCKETS	24
+
+struct timing_latency {
+  unsigned long count;
+  uint64_t total_ns, max_ns;
+  unsigned long buckets[TIMING_BUCKETS];
+};
 
-#ifdef USE_LIBFTDI1
-static int ee_write(unsigned char *eeprom, int len)
+static struct timing_stats {
+  struct timing_phase_stats {
+    unsigned long count;
+    uint64_t total_ns, max_ns;
+  } phase[_phase_end];
+  struct timing_latency xfer[2];	/* reads, writes */
+} timing;
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Where this thread's phases are also charged, for the --ledger */
+static __thread uint64_t *run_phase_ns;
+
+static long monotonic_ms (void)
 {
-  if (ftdi_set_eeprom_buf(&ftdi, eeprom, len) != 0)
-    exit(EIO);
+  struct timespec ts;
 
-  if (ftdi_write_eeprom(&ftdi) != 0)
-    exit(EIO);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+static uint64_t timing_now (void)
+{
+  struct timespec ts;
 
-  return 0;
+  if (!timing_enabled && !ledger_path)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/**
+ * Charges the time since *since to a phase, and starts the next phase
+ * from now
+ */
+static void timing_phase (enum timing_phase p, uint64_t *since)
+{
+  struct timing_phase_stats *ps = &timing.phase[p];
+  uint64_t now, ns;
+
+  if (!timing_enabled && !ledger_path)
+    return;
+  now = timing_now();
+  ns = now - *since;
+  *since = now;
+
+  if (run_phase_ns)
+    run_phase_ns[p] += ns;
+  if (!timing_enabled)
+    return;
+  pthread_mutex_lock(&timing_lock);
+  ps->count++;
+  ps->total_ns += ns;
+  if (ns > ps->max_ns) ps->max_ns = ns;
+  pthread_mutex_unlock(&timing_lock);
+}
+/**
+ * Records the latency of one eeprom word transfer that started at
+ * start
+ */
+static void timing_xfer (bool write, uint64_t start)
+{
+  struct timing_latency *l = &timing.xfer[write];
+  uint64_t ns, us;
+  int b;
+
+  if (!timing_enabled)
+    return;
+  ns = timing_now() - start;
+  for (us = ns / 1000, b = 0; us && b < TIMING_BUCKETS - 1; us >>= 1, b++);
+
+  pthread_mutex_lock(&timing_lock);
+  l->count++;
+  l->total_ns += ns;
+  if (ns > l->max_ns) l->max_ns = ns;
+  l->buckets[b]++;
+  pthread_mutex_unlock(&timing_lock);
 }
-#else
-static int ee_prepare_write(void)
+static void timing_print_latency (const char *name, struct timing_latency *l)
 {
-  unsigned short status;
-  int ret;
+  unsigned long most = 0;
+  char range[32];
+  int b;
+
+  if (l->count == 0)
+    return;
+  printf("\neeprom %s latency: %lu transfers, mean %.1fus, max %.1fus\n",
+         name, l->count, l->total_ns / 1e3 / l->count, l->max_ns / 1e3);
+  for (b = 0; b < TIMING_BUCKETS; b++) {
+    if (l->buckets[b] > most) most = l->buckets[b];
+  }
+  for (b = 0; b < TIMING_BUCKETS; b++) {
+    int bar;
+
+    if (l->buckets[b] == 0)
+      continue;
+    bar = (l->buckets[b] * 40 + most - 1) / most;
+    if (b == TIMING_BUCKETS - 1) {
+      snprintf(range, sizeof(range), ">=%luus", 1UL << (b-1));
+    } else {
+      snprintf(range, sizeof(range), "%lu-%luus", b ? 1UL << (b-1) : 0,
+               1UL << b);
+    }
+    printf("  %18s %8lu %.*s\n", range, l->buckets[b], bar,
+           "########################################");
+  }
+}
+static void timing_json_latency (struct json_buf *j, const char *key,
+                                 struct timing_latency *l)
+{
+  int b, last;
+
+  for (last = TIMING_BUCKETS - 1; last > 0 && !l->buckets[last]; last--);
+  json_key(j, key);
+  json_raw(j, "{\"count\":%lu,\"mean_us\":%.1f,\"max_us\":%.1f,"
+           "\"buckets_log2_us\":[", l->count,
+           l->count ? l->total_ns / 1e3 / l->count : 0.0, l->max_ns / 1e3);
+  for (b = 0; b <= last; b++) {
+    json_raw(j, "%s%lu", b ? "," : "", l->buckets[b]);
+  }
+  json_raw(j, "]}");
+}
+/**
+ * Prints what --timing measured, as text or as a json record. Runs
+ * at exit so that every way out of main() reports.
+ */
+static void timing_report (void)
+{
+  struct json_buf j;
+  int p;
+
+  pthread_mutex_lock(&timing_lock);
+  if (output_format != format_text) {
+    json_begin(&j, output_format == format_json);
+    json_string(&j, "record", "timing");
+    for (p = 0; p < _phase_end; p++) {
+      struct timing_phase_stats *ps = &timing.phase[p];
+
+      json_key(&j, phase_strings[p]);
+      json_raw(&j, "{\"count\":%lu,\"total_ms\":%.3f,\"max_ms\":%.3f}",
+               ps->count, ps->total_ns / 1e6, ps->max_ns / 1e6);
+    }
+    timing_json_latency(&j, "read_latency", &timing.xfer[0]);
+    timing_json_latency(&j, "write_latency", &timing.xfer[1]);
+    json_end(&j);
+  } else {
+    printf("\nTiming:\n  %-12s %7s %12s %10s %10s\n",
+           "phase", "count", "total ms", "mean ms", "max ms");
+    for (p = 0; p < _phase_end; p++) {
+      struct timing_phase_stats *ps = &timing.phase[p];
+
+      if (ps->count == 0)
+        continue;
+      printf("  %-12s %7lu %12.3f %10.3f %10.3f\n", phase_strings[p],
+             ps->count, ps->total_ns / 1e6, ps->total_ns / 1e6 / ps->count,
+             ps->max_ns / 1e6);
+    }
+    timing_print_latency("read", &timing.xfer[0]);
+    timing_print_latency("write", &timing.xfer[1]);
+    fflush(stdout);
+  }
+  pthread_mutex_unlock(&timing_lock);
+}
 
-  /* These commands were traced while running MProg */
-  if ((ret = ftdi_usb_reset(&ftdi)) != 0) { return ret; }
-  if ((ret = ftdi_poll_modem_status(&ftdi, &status)) != 0) { return ret; }
-  if ((ret = ftdi_set_latency_timer(&ftdi, 0x77)) != 0) { return ret; }
+/* ------------ EEPROM Reading and Writing ------------ */
 
-  return 0;
+/* The outcome of programming one device */
+struct device_run {
+  char path[64];		/* open string, eg. "d:001/004" or "s:2/005" */
+  char serial[64];		/* serial number it was programmed with */
+  int result;			/* 0 or a negative errno */
+  int words_written;
+  bool prechecked;		/* found to hold its image already */
+  long reenum_ms;		/* time taken to come back, for --wait-reenum */
+  bool reset;			/* reset and left to re-enumerate */
+  struct ee_identity *reset_as;	/* if set, filled in with what it was
+				   reset with */
+  unsigned short old_crc, new_crc;
+  uint64_t phase_ns[_phase_end];	/* time spent in each phase */
+  bool started;			/* taken by a batch worker */
+  struct sched_group *hub, *bus;	/* what it shares, for --hub-jobs */
+  uint64_t xfer_ns;		/* latency of its transfers, summed */
+  int xfers, xfer_errors;
+};
+
+/* The device this thread is programming, to charge transfers to */
+static __thread struct device_run *xfer_run;
+
+static void sched_xfer (struct device_run *run);
+static void sched_error (struct device_run *run);
+
+static struct ee_sim *sim_bus;	/* lives as long as the process */
+
+static int retries_seen;	/* transfers retried, across all devices */
+static pthread_mutex_t retries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void note_retry (void *arg, unsigned short addr, int status,
+                        int attempt)
+{
+  pthread_mutex_lock(&retries_lock);
+  retries_seen++;
+  pthread_mutex_unlock(&retries_lock);
+  if (xfer_run) {
+    xfer_run->xfer_errors++;
+    sched_error(xfer_run);
+  }
+  if (verbose)
+    fprintf(stderr, "word 0x%02x: %s, retry %d\n", addr,
+            libusb_error_name(status), attempt);
 }
-static int ee_write(unsigned char *eeprom, int len)
+static void note_xfer (void *arg, bool write, uint64_t start)
 {
-  int i;
-
-  if (ee_prepare_write()) {
-    fprintf(stderr, "ee_prepare_write() failed: %s\n",
-            ftdi_get_error_string(&ftdi));
-    exit(EIO);
+  timing_xfer(write, start);
+  if (xfer_run) {
+    xfer_run->xfer_ns += ee_now_ns() - start;
+    xfer_run->xfers++;
+    sched_xfer(xfer_run);
+  }
+}
+static void timing_on_phase (void *arg, enum ee_phase phase, uint64_t start)
+{
+  timing_phase(phase == ee_phase_prepare ? phase_prepare : phase_write,
+               &start);
+}
+/**
+ * Fills in options from the command line, creating the simulated
+ * devices the first time they are needed
+ */
+static int options_init (void)
+{
+  static const struct ee_transport *transports[] = {
+    &ee_libftdi_transport,
+    &ee_libusb_transport,
+    &ee_sim_transport,
+  };
+
+  memset(&options, 0, sizeof(options));
+  options.transport = transports[transport];
+  options.use_8b_strings = use_8b_strings;
+  options.queue_depth = queue_depth;
+  options.verify_retries = verify_retries;
+  options.retries = transfer_retries;
+  options.retry_backoff_us = retry_backoff_ms * 1000;
+  options.on_retry = note_retry;
+  if (timing_enabled || hub_jobs || bus_jobs)
+    options.on_xfer = note_xfer;
+  if (timing_enabled || ledger_path)
+    options.on_phase = timing_on_phase;
+  if (transport == transport_sim && !sim_bus &&
+      !(sim_bus = ee_sim_new(sim_count, sim_latency_us)))
+    return -ENOMEM;
+  if (sim_bus) {
+    ee_sim_set_errors(sim_bus, sim_errors);
+    ee_sim_set_contention(sim_bus, sim_contention);
   }
+  options.sim = sim_bus;
+
+  return 0;
+}
+
+/**
+ * Checks the CRC at the end of an eeprom image. Returns the CRC, or
+ * -EINVAL if it is bad and CRC errors are not being ignored.
+ */
+static int verify_crc (void *addr, int len)
+{
+  unsigned short crc    = calc_crc_ftx(addr);
+  unsigned char *d8     = addr;
+  unsigned short actual = d8[len-2] | (d8[len-1] << 8);
 
-  for (i = 0; i < len/2; i++) {
-    if (ftdi_write_eeprom_location(&ftdi, i,
-                                   eeprom[i*2] | (eeprom[(i*2)+1] << 8))) {
-      fprintf(stderr, "ftdi_write_eeprom_location() failed: %s\n",
-              ftdi_get_error_string(&ftdi));
-      exit(EIO);
+  if (crc != actual) {
+    fprintf(stderr, "Bad CRC: crc=0x%04x, actual=0x%04x\n", crc, actual);
+    if (ignore_crc_error == 0) {
+      return -EINVAL;
+    } else {
+      fprintf(stderr, "Ignoring CRC error\n");
     }
   }
+  if (verbose) { printf("CRC: Okay (0x%04x)\n", crc); }
+  return crc;
+}
+/**
+ * Reads the eeprom image from the device. Returns its CRC, or a
+ * negative errno if it could not be read or the CRC is bad.
+ */
+static int ee_read_and_verify (struct ee_device *dev,
+                               unsigned char *eeprom, int len)
+{
+  if (ee_read(dev, eeprom, len) < 0) {
+    fprintf(stderr, "%s\n", ee_error(dev));
+    return -EIO;
+  }
 
-  return 0;
+  return verify_crc(eeprom, len);
 }
-#endif
 
-static unsigned short ee_read_and_verify (unsigned char *eeprom, int len)
+/* ------------ Serial Number Allocation ------------ */
+
+/**
+ * Checks a --serial-template has exactly one numeric conversion, so it
+ * is safe to hand to snprintf() along with the counter.
+ */
+static int serial_check_template (const char *fmt)
+{
+  int conversions = 0;
+
+  for (; *fmt; fmt++) {
+    if (*fmt != '%') continue;
+    if (*++fmt == '%') continue;
+    while (*fmt >= '0' && *fmt <= '9') fmt++;
+    if (*fmt != 'u' && *fmt != 'x' && *fmt != 'X') return -1;
+    conversions++;
+  }
+  return conversions == 1 ? 0 : -1;
+}
+/**
+ * Reserves count consecutive numbers from the counter file, which
+ * holds the next number to hand out. The file is locked while it is
+ * updated, so other processes and threads never get the same numbers.
+ * Returns the first number reserved, or a negative errno.
+ */
+static long serial_reserve (int count)
 {
-#ifdef USE_LIBFTDI1
-  if (ftdi_read_eeprom(&ftdi) != 0)
-    exit(EIO);
+  char buf[32];
+  unsigned long first;
+  int fd, n, err = 0;
+
+  fd = open(serial_counter_path, O_RDWR|O_CREAT, 0644);
+  if (fd == -1) {
+    err = errno;
+    perror(serial_counter_path);
+    return -err;
+  }
+  /* flock() rather than fcntl(), whose locks don't exclude threads */
+  if (flock(fd, LOCK_EX) == -1) {
+    err = errno;
+    perror(serial_counter_path);
+    close(fd);
+    return -err;
+  }
 
-  if (ftdi_get_eeprom_buf(&ftdi, eeprom, len) != 0)
-    exit(EIO);
+  n = read(fd, buf, sizeof(buf) - 1);
+  buf[n > 0 ? n : 0] = '\0';
+  first = n > 0 ? strtoul(buf, NULL, 0) : 1;
 
-  if (ftdi_eeprom_build(&ftdi) < 0)
-    exit(EIO);
-#else
+  n = snprintf(buf, sizeof(buf), "%lu\n", first + count);
+  if (lseek(fd, 0, SEEK_SET) == -1 || ftruncate(fd, 0) == -1 ||
+      write(fd, buf, n) != n || fsync(fd) == -1) {
+    err = errno ? errno : EIO;
+    perror(serial_counter_path);
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+  return err ? -err : (long)first;
+}
+/**
+ * Allocates a serial number from --serial-template for each run.
+ * Returns 0 or a negative errno.
+ */
+static int serial_assign (struct device_run *runs, int count)
+{
+  long first;
   int i;
 
-  for (i = 0; i < len/2; i++) {
-    if (ftdi_read_eeprom_location(&ftdi, i, (void*)(eeprom + (i*2)))) {
-      fprintf(stderr, "ftdi_read_eeprom_location() failed: %s\n",
-              ftdi_get_error_string(&ftdi));
-      exit(EIO);
-    }
+  if (!serial_counter_path) {
+    fprintf(stderr, "--serial-template needs a --serial-counter file\n");
+    return -EINVAL;
   }
-#endif
+  if ((first = serial_reserve(count)) < 0)
+    return first;
 
-  return verify_crc(eeprom, len);
+  for (i = 0; i < count; i++) {
+    snprintf(runs[i].serial, sizeof(runs[i].serial), serial_template,
+             (unsigned int)(first + i));
+  }
+  return 0;
 }
 
 /* ------------ Parsing Command Line ------------ */
@@ -1031,17 +1210,57 @@ static unsigned long unsigned_val (const char *arg, unsigned long max)
 
 
 
+static const struct ee_field *field_for_arg (const char *arg)
+{
+  int i;
+
+  for (i = 0; i < ee_field_count; i++) {
+    if (ee_fields[i].arg && 0 == strcasecmp(ee_fields[i].arg, arg))
+      return &ee_fields[i];
+  }
+  return NULL;
+}
+/**
+ * Sets a field from the value given to its option. A number is given
+ * as it is shown, so --max-bus-power is in mA.
+ */
+static void field_parse (struct eeprom_fields *ee, const struct ee_field *f,
+                         char *val)
+{
+  unsigned int scale = f->scale ? f->scale : 1, v;
+
+  switch (f->format) {
+  case ee_format_bool:
+    v = match_arg(val, bool_strings) & 1;
+    ee_field_set(ee, f, f->arg_inverted ? !v : v);
+    break;
+  case ee_format_string:
+    *(char **)ee_field_ptr(ee, f) = val;
+    if (f->member == offsetof(struct eeprom_fields, serial_string))
+      ee->serial_number_avail = strlen(val) > 0;
+    break;
+  default:
+    v = unsigned_val(val, (f->mask >> f->shift) * scale + scale - 1 + f->bias);
+    ee_field_set(ee, f, v < f->bias ? 0 : (v - f->bias) / scale);
+  }
+}
+
 static int process_args (int argc, char *argv[], struct eeprom_fields *ee)
 {
   int i; int c;
   int j;
 
   for (i = 1; i < argc;) {
-    int arg;
-    arg = match_arg(argv[i++], arg_type_strings);
+    int arg = -1;
+    /* Options setting one eeprom field come from the field schema */
+    const struct ee_field *f = field_for_arg(argv[i]);
+
+    if (!f)
+      arg = match_arg(argv[i], arg_type_strings);
+    i++;
 
     /* detect missing arguments and handle errors */
-    int expected_args = 0;
+    int expected_args = f ? 1 : 0;
     for (j = 0; j < (sizeof(req_info) / sizeof(req_info[0])); j++) {
       if (req_info[j].t == arg) expected_args = req_info[j].number;
     }
@@ -1055,8 +1274,13 @@ static int process_args (int argc, char *argv[], struct eeprom_fields *ee)
       return -1;
     }
 
+    if (f) {
+      field_parse(ee, f, argv[i++]);
+      continue;
+    }
     switch (arg) {
     case arg_help:
+      show_banner(stdout);
       show_help(stdout);
       exit(1);
     case arg_dump:
@@ -1070,118 +1294,176 @@ static int process_args (int argc, char *argv[], struct eeprom_fields *ee)
     case arg_verbose:
       verbose = 1;
       break;
-      /* File operations */
-    case arg_save:
-      save_path = argv[i++];
+    case arg_all:
+      batch_mode = true;
       break;
-    case arg_restore:
-      restore_path = argv[i++];
+    case arg_hotplug:
+      /* Like --all, each device is programmed without asking */
+      hotplug_mode = true;
+      batch_mode = true;
       break;
-    case arg_8b_strings:
-      use_8b_strings = true;
+    case arg_queue_depth:
+      queue_depth = unsigned_val(argv[i++], EE_MAX_QUEUE_DEPTH);
+      if (queue_depth < 1) queue_depth = 1;
       break;
-    case arg_cbus:
-      c = match_arg(argv[i++], cbus_strings);
-      ee->cbus[c] = match_arg(argv[i++], cbus_mode_strings);
+    case arg_verify_retries:
+      verify_retries = unsigned_val(argv[i++], 100);
       break;
-    case arg_cbus_config:
-      c = match_arg(argv[i++], d_cbus_config_strings);
-      if(c < 4) {
-        ee->cbus_drive_strength = c;
-      } else if (4 == c) {
-        ee->cbus_slow_slew = 1;
-      } else if(6 == c) {
-        ee->cbus_schmitt = 1;
+    case arg_serial_template:
+      serial_template = argv[i++];
+      if (serial_check_template(serial_template)) {
+        fprintf(stderr, "%s: needs exactly one %%u, %%x or %%X conversion\n",
+                serial_template);
+        exit(EINVAL);
       }
       break;
-    case arg_dbus_config:
-      c = match_arg(argv[i++], d_cbus_config_strings);
-      if( c < 4)
-        ee->dbus_drive_strength = c;
-      else if( 4 == c){
-        ee->dbus_slow_slew=1;
-      }	else if( 6 == c)
-        ee->dbus_schmitt=1;
+    case arg_serial_counter:
+      serial_counter_path = argv[i++];
       break;
-    case arg_invert:
-      switch(match_arg(argv[i++], rs232_strings)) {
-      case 0:	ee->invert_txd = !ee->invert_txd; break;
-      case 1:	ee->invert_rxd = !ee->invert_rxd; break;
-      case 2:	ee->invert_rts = !ee->invert_rts; break;
-      case 3:	ee->invert_cts = !ee->invert_cts; break;
-      case 4:	ee->invert_dtr = !ee->invert_dtr; break;
-      case 5:	ee->invert_dsr = !ee->invert_dsr; break;
-      case 6:	ee->invert_dcd = !ee->invert_dcd; break;
-      case 7:	ee->invert_ri = !ee->invert_ri; break;
-      }
+    case arg_transport:
+      transport = match_arg(argv[i++], transport_strings);
       break;
-      /* Strings */
-    case arg_manufacturer:
-      ee->manufacturer_string = argv[i++];
+    case arg_sim_devices:
+      sim_count = unsigned_val(argv[i++], 100000);
       break;
-    case arg_product:
-      ee->product_string = argv[i++];
+    case arg_sim_latency:
+      sim_latency_us = unsigned_val(argv[i++], 10000000);
       break;
-    case arg_new_serno:
-      ee->serial_string = argv[i++];
-      ee->serial_number_avail = strlen(ee->serial_string) > 0;
+    case arg_wait_reenum:
+      reenum_timeout = unsigned_val(argv[i++], 600000);
       break;
-    case arg_max_bus_power:
-      ee->max_power = unsigned_val(argv[i++], 0x1ff) / 2;
+    case arg_daemon:
+      daemon_path = argv[i++];
       break;
-    case arg_self_powered:
-      ee->self_powered = match_arg(argv[i++], bool_strings) & 1;
+    case arg_user_read:
+      user_read_path = argv[i++];
       break;
-    case arg_suspend_pull_down:
-      ee->suspend_pull_down = match_arg(argv[i++], bool_strings) & 1;
+    case arg_user_write:
+      user_write_path = argv[i++];
       break;
-    case arg_load_vcp:
-      ee->load_vcp = match_arg(argv[i++], bool_strings) & 1;
+    case arg_archive:
+      archive_path = argv[i++];
       break;
-    case arg_remote_wakeup:
-      ee->remote_wakeup = match_arg(argv[i++], bool_strings) & 1;
+    case arg_archive_save:
+      archive_save = true;
       break;
-      /* FT1248 */
-    case arg_ft1248_cpol:
-      ee->ft1248_cpol = match_arg(argv[i++], bool_strings) & 1;
+    case arg_archive_restore:
+      archive_restore_serial = argv[i++];
       break;
-    case arg_ft1248_bord:
-      ee->ft1248_bord = match_arg(argv[i++], bool_strings) & 1;
+    case arg_archive_list:
+      archive_list = true;
       break;
-    case arg_ft1248_flow_control:
-      ee->ft1248_flow_control = match_arg(argv[i++], bool_strings) & 1;
+    case arg_precheck:
+      precheck = match_arg(argv[i++], precheck_strings);
       break;
-    case arg_i2c_schmitt:
-      /* The command line arg is enabled +ve, the eeprom is disabled +ve */
-      ee->disable_i2c_schmitt = !(match_arg(argv[i++], bool_strings) & 1);
+    case arg_retries:
+      transfer_retries = unsigned_val(argv[i++], 100);
       break;
-      /* I2C */
-    case arg_i2c_slave_address:
-      ee->i2c_slave_addr = unsigned_val(argv[i++], 0xffff);
+    case arg_retry_backoff:
+      retry_backoff_ms = unsigned_val(argv[i++], 60000);
       break;
-    case arg_i2c_device_id:
-      ee->i2c_device_id = unsigned_val(argv[i++], 0xffff);
+    case arg_sim_errors:
+      sim_errors = unsigned_val(argv[i++], 1000000000);
       break;
-      /* RS485 */
-    case arg_rs485_echo_suppression:
-      ee->rs485_echo_suppress = match_arg(argv[i++], bool_strings) & 1;
+    case arg_ledger:
+      ledger_path = argv[i++];
       break;
-      /* VID, PID, Ser No. */
-    case arg_old_vid:
-      ee->old_vid = unsigned_val(argv[i++], 0xffff);
+    case arg_ledger_sync:
+      ledger_sync_ms = unsigned_val(argv[i++], 3600000);
       break;
-    case arg_old_pid:
+    case arg_ledger_report:
+      ledger_report_minutes = unsigned_val(argv[i++], 5256000);
+      break;
+    case arg_hub_jobs:
+      hub_jobs = unsigned_val(argv[i++], 256);
+      break;
+    case arg_bus_jobs:
+      bus_jobs = unsigned_val(argv[i++], 256);
+      break;
+    case arg_sim_contention:
+      sim_contention = unsigned_val(argv[i++], 1000);
+      break;
+    case arg_bench:
+      bench_path = argv[i++];
+      break;
+    case arg_timing:
+      timing_enabled = true;
+      break;
+    case arg_inventory:
+      inventory_mode = true;
+      break;
+    case arg_timeout:
+      inventory_timeout = unsigned_val(argv[i++], 600000);
+      if (inventory_timeout < 1) inventory_timeout = 1;
+      break;
+    case arg_format:
+      output_format = match_arg(argv[i++], format_strings);
+      break;
+    case arg_audit:
+      audit_path = argv[i++];
+      break;
+    case arg_jobs:
+      batch_jobs = unsigned_val(argv[i++], 256);
+      if (batch_jobs < 1) batch_jobs = 1;
+      break;
+      /* File operations */
+    case arg_save:
+      save_path = argv[i++];
+      break;
+    case arg_restore:
+      restore_path = argv[i++];
+      break;
+    case arg_8b_strings:
+      use_8b_strings = true;
+      break;
+    case arg_cbus:
+      c = match_arg(argv[i++], cbus_strings);
+      ee->cbus[c] = match_arg(argv[i++], cbus_mode_strings);
+      break;
+    case arg_cbus_config:
+      c = match_arg(argv[i++], d_cbus_config_strings);
+      if (c < 4) {
+        ee->cbus_drive_strength = c;
+      } else if (c < 6) {
+        ee->cbus_slow_slew = (4 == c);
+      } else {
+        ee->cbus_schmitt = (7 == c);
+      }
+      break;
+    case arg_dbus_config:
+      c = match_arg(argv[i++], d_cbus_config_strings);
+      if (c < 4) {
+        ee->dbus_drive_strength = c;
+      } else if (c < 6) {
+        ee->dbus_slow_slew = (4 == c);
+      } else {
+        ee->dbus_schmitt = (7 == c);
+      }
+      break;
+    case arg_invert:
+      switch(match_arg(argv[i++], rs232_strings)) {
+      case 0:	ee->invert_txd = !ee->invert_txd; break;
+      case 1:	ee->invert_rxd = !ee->invert_rxd; break;
+      case 2:	ee->invert_rts = !ee->invert_rts; break;
+      case 3:	ee->invert_cts = !ee->invert_cts; break;
+      case 4:	ee->invert_dtr = !ee->invert_dtr; break;
+      case 5:	ee->invert_dsr = !ee->invert_dsr; break;
+      case 6:	ee->invert_dcd = !ee->invert_dcd; break;
+      case 7:	ee->invert_ri = !ee->invert_ri; break;
+      }
+      break;
+      /* Old VID, PID and Ser No. to match */
+    case arg_old_vid:
+      ee->old_vid = unsigned_val(argv[i++], 0xffff);
+      old_id_given = true;
+      break;
+    case arg_old_pid:
       ee->old_pid = unsigned_val(argv[i++], 0xffff);
+      old_id_given = true;
       break;
     case arg_old_serno:
       ee->old_serno = argv[i++];
       break;
-    case arg_new_vid:
-      ee->usb_vid = unsigned_val(argv[i++], 0xffff);
-      break;
-    case arg_new_pid:
-      ee->usb_pid = unsigned_val(argv[i++], 0xffff);
-      break;
     }
   }
 
@@ -1190,155 +1472,3247 @@ static int process_args (int argc, char *argv[], struct eeprom_fields *ee)
 
 /* ------------ File Save / Restore ------------ */
 
-static void save_eeprom_to_file (const char *path, void *eeprom, int len)
+static int save_eeprom_to_file (const char *path, void *eeprom, int len)
 {
   int count, fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0644);
 
   if (fd == -1) {
     int err = errno;
     perror(path);
-    exit(err);
+    return -err;
   }
   count = write(fd, eeprom, len);
   if (count < 0) {
     int err = errno;
     perror(path);
-    exit(err);
+    close(fd);
+    return -err;
   }
   close(fd);
   if (count != len) {
     fprintf(stderr, "%s: wrong size, wrote %d/%d bytes\n", path, count, len);
-    exit(EINVAL);
+    return -EINVAL;
   }
   printf("%s: wrote %d bytes\n", path, count);
+  return 0;
 }
 
-static void restore_eeprom_from_file (const char *path, void *eeprom, int len,
-                                      int max)
+static int restore_eeprom_from_file (const char *path, void *eeprom, int len,
+                                     int max)
 {
   int count, fd = open(path, O_RDONLY);
 
   if (fd == -1) {
     int err = errno;
     perror(path);
-    exit(err);
+    return -err;
   }
   count = read(fd, eeprom, max);
   if (count < 0) {
     int err = errno;
     perror(path);
-    exit(err);
+    close(fd);
+    return -err;
   }
   close(fd);
   if (count != len ) {
     fprintf(stderr, "%s: wrong size, read %d/%d bytes\n", path, count, len);
-    exit(EINVAL);
+    return -EINVAL;
   }
-  printf("%s: read %d bytes\n", path, count);
-  verify_crc(eeprom, len);
+  if (!batch_mode) printf("%s: read %d bytes\n", path, count);
+  return verify_crc(eeprom, len) < 0 ? -EINVAL : 0;
 }
 
-/* ------------ Main ------------ */
+/* ------------ User Area ------------ */
 
-int main (int argc, char *argv[])
+/*
+ * The MTP carries on past the 256 bytes of settings, and the rest is
+ * free for the user. It is streamed to and from files EE_AREA_MAX
+ * bytes at a time, and only the words that differ are written.
+ */
+
+static void user_progress (const char *path, int done, int total)
 {
-  const char *slash;
-  unsigned char old[0x100] = {0,}, new[0x100] = {0,};
-  unsigned short new_crc;
-  struct eeprom_fields ee;
-  /* We only deal with the first 256 bytes and ignore the user memory space */
-  unsigned int len = 0x100;
+  fprintf(stderr, "\r%s: %d/%d bytes", path, done, total);
+  if (done == total)
+    fputc('\n', stderr);
+}
 
-  myname = argv[0];
-  slash = strrchr(myname, '/');
-  if (slash)
-    myname = slash + 1;
+/**
+ * Saves the whole user area of an open device to a file
+ */
+static int user_area_read (struct ee_device *dev, const char *path)
+{
+  unsigned char buf[EE_AREA_MAX];
+  int addr, fd, ret = 0, total = EE_MTP_SIZE - EE_USER_AREA;
 
-  printf("\n%s: version %s\n", myname, MYVERSION);
-  printf("Modified for the FT-X series by Richard Meadows\n\n");
-  printf("Based upon:\n");
-  printf("ft232r_prog: version 1.23, by Mark Lord.\n");
-  if (argc < 2) {
-    show_help(stdout);
-    exit(0);
+  fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+  if (fd == -1) {
+    int err = errno;
+    perror(path);
+    return -err;
   }
+  for (addr = EE_USER_AREA; addr < EE_MTP_SIZE; addr += sizeof(buf)) {
+    if ((ret = ee_read_area(dev, addr, buf, sizeof(buf))) < 0) {
+      fprintf(stderr, "\n%s\n", ee_error(dev));
+      break;
+    }
+    if ((ret = fd_write(fd, (char *)buf, sizeof(buf))) < 0) {
+      fprintf(stderr, "\n%s: %s\n", path, strerror(-ret));
+      break;
+    }
+    user_progress(path, addr + sizeof(buf) - EE_USER_AREA, total);
+  }
+  close(fd);
 
-  ftdi_init(&ftdi);
-  atexit(&do_deinit);
+  return ret;
+}
 
-  memset(&ee, 0, sizeof(ee));
-  ee.old_vid = 0x0403;	/* default; override with --old_vid arg */
-  ee.old_pid = 0x6015;	/* default; override with --old_pid arg */
-  if (process_args(argc, argv, &ee)) { /* handle --help and --old-* args */
-    return -1;
+/**
+ * Writes a file to the start of the user area of an open device. Each
+ * chunk is read from the device first so that only the words that
+ * differ are written, and read back afterwards if anything was.
+ */
+static int user_area_write (struct ee_device *dev, const char *path)
+{
+  unsigned char old[EE_AREA_MAX], new[EE_AREA_MAX], check[EE_AREA_MAX];
+  struct ee_write_result wr;
+  struct stat st;
+  int fd, addr, done, ret, written = 0, skipped = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    int err = errno;
+    perror(path);
+    if (fd != -1) close(fd);
+    return -err;
+  }
+  if (st.st_size > EE_MTP_SIZE - EE_USER_AREA) {
+    fprintf(stderr, "%s: %lld bytes is more than the %d byte user area\n",
+            path, (long long)st.st_size, EE_MTP_SIZE - EE_USER_AREA);
+    close(fd);
+    return -EFBIG;
+  }
+  if ((ret = ee_prepare_write(dev)) < 0) {
+    fprintf(stderr, "%s\n", ee_error(dev));
+    close(fd);
+    return ret;
   }
 
-  if (ftdi_usb_open_desc(&ftdi, ee.old_vid, ee.old_pid, NULL, ee.old_serno)) {
-    fprintf(stderr, "ftdi_usb_open() failed for %04x:%04x:%s %s\n",
-            ee.old_vid, ee.old_pid,
-            ee.old_serno ? ee.old_serno : "", ftdi_get_error_string(&ftdi));
-    exit(ENODEV);
+  for (addr = EE_USER_AREA, done = 0; done < st.st_size; ) {
+    int count = st.st_size - done < EE_AREA_MAX ? st.st_size - done
+                                                : EE_AREA_MAX;
+    int len = (count + 1) & ~1;	/* an odd last byte keeps its partner */
+
+    if ((ret = ee_read_area(dev, addr, old, len)) < 0) {
+      fprintf(stderr, "\n%s\n", ee_error(dev));
+      break;
+    }
+    memcpy(new, old, len);
+    if (read(fd, new, count) != count) {
+      ret = errno ? -errno : -EIO;
+      fprintf(stderr, "\n%s: short read\n", path);
+      break;
+    }
+    ret = ee_write_area(dev, addr, old, new, len, &wr);
+    written += wr.written;
+    skipped += wr.skipped;
+    if (ret < 0) {
+      fprintf(stderr, "\n%s\n", ee_error(dev));
+      break;
+    }
+    if (wr.written) {
+      if ((ret = ee_read_area(dev, addr, check, len)) < 0) {
+        fprintf(stderr, "\n%s\n", ee_error(dev));
+        break;
+      }
+      if (memcmp(check, new, len)) {
+        fprintf(stderr, "\nReadback of the %d bytes at 0x%03x differs\n",
+                len, addr);
+        ret = -EIO;
+        break;
+      }
+    }
+    addr += len;
+    done += count;
+    user_progress(path, done, st.st_size);
   }
-  atexit(&do_close);
+  close(fd);
 
-  /* First, read the original eeprom from the device */
-  (void) ee_read_and_verify(old, len);
-  if (verbose) dumpmem("existing eeprom", old, len);
+  if (ret == 0)
+    printf("Wrote %d words, skipped %d unchanged words\n", written, skipped);
+  return ret;
+}
 
-  /* Save old contents to a file, if requested (--save) */
-  if (save_path)
-    save_eeprom_to_file(save_path, old, len);
+/* ------------ Archive ------------ */
 
-  /* Restore contents from a file, if requested (--restore) */
-  if (restore_path) {
-    restore_eeprom_from_file(restore_path, new, len, sizeof(new));
-    if (verbose) dumpmem(restore_path, new, len);
+/*
+ * An archive is a directory holding three files:
+ *
+ *   images   256 byte images, each one stored only once
+ *   entries  one struct archive_entry for each save, never rewritten
+ *   index    a hash table over both, mapped into memory
+ *
+ * Images are stored with the serial number descriptor and the CRC word
+ * cleared, so units that differ only in their serial numbers share an
+ * image. The entry holds what was cleared, to put it back. The index
+ * can be rebuilt from the other two files at any time, and is when it
+ * is missing, too full, or behind or ahead of them. Every file is locked with
+ * flock() while it is used, so several processes can share an archive.
+ */
+
+#define ARCHIVE_NONE		0xffffffffu
+#define ARCHIVE_SERIAL_MAX	64
+#define ARCHIVE_MIN_SLOTS	1024
+
+struct archive_entry {
+  char serial[ARCHIVE_SERIAL_MAX];	/* as decoded, the lookup key */
+  uint8_t serial_raw[ARCHIVE_SERIAL_MAX];	/* the descriptor as stored */
+  uint8_t serial_ptr, serial_len;
+  uint8_t serial_cleared;		/* if the image has it cleared */
+  uint8_t unused;
+  uint16_t vid, pid;
+  uint16_t crc;				/* the CRC word as it was */
+  uint16_t unused2;
+  uint32_t image;			/* record number in images */
+  uint32_t prev;			/* the last save of the same serial */
+  int64_t time;				/* when it was saved */
+};
+
+enum archive_slot_kind {
+  slot_empty,
+  slot_image,			/* id is an image */
+  slot_serial,			/* id is the latest entry for a serial */
+};
+struct archive_slot {
+  uint64_t hash;
+  uint32_t id;
+  uint32_t kind;
+};
+struct archive_header {
+  char magic[8];
+  uint32_t slots;		/* a power of two */
+  uint32_t images, entries;	/* how many of each are in the index */
+  uint32_t used;		/* slots */
+};
+
+static struct archive {
+  int images_fd, entries_fd, index_fd;
+  struct archive_header *hdr;
+  struct archive_slot *slots;
+  size_t map_len;
+  pthread_mutex_t lock;
+} archive = { -1, -1, -1, NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static const char archive_magic[8] = "FTXAIDX1";
+
+/* FNV-1a */
+static uint64_t archive_hash (const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h = (h ^ *p++) * 0x100000001b3ULL;
+  }
+  return h;
+}
+/**
+ * Clears the parts of an image that differ from unit to unit, saving
+ * them in e, and decodes the serial number for the lookup key
+ */
+static void archive_split (unsigned char *eeprom, unsigned char *image,
+                           struct archive_entry *e)
+{
+  char serial[0x100];
+  int ptr = eeprom[0x12], len = eeprom[0x13];
+
+  memset(e, 0, sizeof(*e));
+  memcpy(image, eeprom, 0x100);
+  e->vid = ee_get_word(eeprom, 0x01);
+  e->pid = ee_get_word(eeprom, 0x02);
+  e->crc = ee_get_word(eeprom, 0x7F);
+  ee_set_word(image, 0x7F, 0);
+
+  if (ptr + len <= 0xFE && len <= ARCHIVE_SERIAL_MAX) {
+    ee_decode_str(&options, eeprom + ptr, len, serial);
+    snprintf(e->serial, sizeof(e->serial), "%.*s",
+             (int)sizeof(e->serial) - 1, serial);
+    e->serial_ptr = ptr;
+    e->serial_len = len;
+    e->serial_cleared = 1;
+    memcpy(e->serial_raw, eeprom + ptr, len);
+    memset(image + ptr, 0, len);
+    image[0x12] = image[0x13] = 0;
+  }
+}
+/**
+ * Puts back what archive_split() cleared
+ */
+static void archive_join (unsigned char *image, struct archive_entry *e,
+                          unsigned char *eeprom)
+{
+  memcpy(eeprom, image, 0x100);
+  if (e->serial_cleared) {
+    memcpy(eeprom + e->serial_ptr, e->serial_raw, e->serial_len);
+    eeprom[0x12] = e->serial_ptr;
+    eeprom[0x13] = e->serial_len;
   }
+  ee_set_word(eeprom, 0x7F, e->crc);
+}
+
+static int archive_read (int fd, uint32_t id, void *buf, size_t len)
+{
+  return pread(fd, buf, len, (off_t)id * len) == len ? 0 : -EIO;
+}
+/* How many whole records a file holds */
+static uint32_t archive_count (int fd, size_t len)
+{
+  struct stat st;
 
-  /* TODO: It'd be nice to check we can restore the EEPROM.. */
+  return fstat(fd, &st) == 0 ? st.st_size / len : 0;
+}
 
-  /* Decode eeprom contents into ee struct */
-  ee_decode(old, len, &ee);
+/* Finds the slot holding an image, or the empty slot it would go in */
+static struct archive_slot *archive_image_slot (struct archive *a,
+                                                unsigned char *image,
+                                                uint64_t hash)
+{
+  unsigned char stored[0x100];
+  uint32_t i, mask = a->hdr->slots - 1;
 
-  /* process args, and dump new settings */
-  process_args(argc, argv, &ee);	/* Handle value-change args */
-  ee_dump(&ee);
+  for (i = hash & mask; a->slots[i].kind != slot_empty; i = (i + 1) & mask) {
+    struct archive_slot *s = &a->slots[i];
 
-  /* Build new eeprom image */
-  if (erase_eeprom == 0) {
-    new_crc = ee_encode(new, len, &ee);
-  }  else {
-    memset(new, 0xff, 0x100);
-    new_crc = 0xFFFF;
+    if (s->kind == slot_image && s->hash == hash &&
+        archive_read(a->images_fd, s->id, stored, 0x100) == 0 &&
+        memcmp(stored, image, 0x100) == 0)
+      return s;
   }
+  return &a->slots[i];
+}
+/* Likewise for the latest entry for a serial number */
+static struct archive_slot *archive_serial_slot (struct archive *a,
+                                                 const char *serial,
+                                                 uint64_t hash)
+{
+  struct archive_entry e;
+  uint32_t i, mask = a->hdr->slots - 1;
 
-  /* If different from original, then write it back to the device */
-  if (0 == memcmp(old, new, len)) {
-    printf("No change from existing eeprom contents.\n");
-  } else {
-    if (verbose) { dumpmem("new eeprom", new, len); }
+  for (i = hash & mask; a->slots[i].kind != slot_empty; i = (i + 1) & mask) {
+    struct archive_slot *s = &a->slots[i];
 
-    if (erase_eeprom == 0) {
-      printf("Rewriting eeprom with new contents.\n");
-    } else {
-      printf("Erasing EEPROM\n");
-    }
+    if (s->kind == slot_serial && s->hash == hash &&
+        archive_read(a->entries_fd, s->id, &e, sizeof(e)) == 0 &&
+        strcmp(e.serial, serial) == 0)
+      return s;
+  }
+  return &a->slots[i];
+}
+static void archive_fill (struct archive_slot *s, enum archive_slot_kind kind,
+                          uint64_t hash, uint32_t id, struct archive *a)
+{
+  if (s->kind == slot_empty)
+    a->hdr->used++;
+  s->kind = kind;
+  s->hash = hash;
+  s->id = id;
+}
 
-    printf("Continue? [y|n]:");
-    if (getc(stdin) == 'y') {
-      ee_write(new, len);
+static void archive_unmap (struct archive *a)
+{
+  if (a->hdr)
+    munmap(a->hdr, a->map_len);
+  a->hdr = NULL;
+  a->slots = NULL;
+}
+static int archive_map (struct archive *a, size_t len)
+{
+  void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, a->index_fd, 0);
 
-      /* Read it back again, and check for differences */
-      if (ee_read_and_verify(new, len) != new_crc ) {
-        fprintf(stderr, "Readback test failed, results may be botched\n");
-        exit(EINVAL);
-      }
-      if (erase_eeprom == 1) { printf("Erase done\n"); }
+  if (p == MAP_FAILED)
+    return -errno;
+  a->hdr = p;
+  a->slots = (struct archive_slot *)(a->hdr + 1);
+  a->map_len = len;
+  return 0;
+}
+static int archive_catch_up (struct archive *a);
+
+/* Starts the index again from nothing, with room for at least count */
+static int archive_rebuild (struct archive *a, uint32_t count)
+{
+  uint32_t slots = ARCHIVE_MIN_SLOTS;
+  size_t len;
+  int ret;
+
+  while (slots < count * 4) {
+    slots *= 2;
+  }
+  len = sizeof(struct archive_header) + slots * sizeof(struct archive_slot);
+
+  archive_unmap(a);
+  if (ftruncate(a->index_fd, 0) == -1 || ftruncate(a->index_fd, len) == -1)
+    return -errno;
+  if ((ret = archive_map(a, len)) < 0)
+    return ret;
+  memcpy(a->hdr->magic, archive_magic, sizeof(archive_magic));
+  a->hdr->slots = slots;
+
+  return archive_catch_up(a);
+}
+/**
+ * Indexes whatever has been appended since the index was last brought
+ * up to date, by this process or another one
+ */
+static int archive_catch_up (struct archive *a)
+{
+  uint32_t images = archive_count(a->images_fd, 0x100);
+  uint32_t entries = archive_count(a->entries_fd,
+                                   sizeof(struct archive_entry));
+  unsigned char image[0x100];
+  struct archive_entry e;
+
+  /* Keep it at most half full, counting a slot for every record. An
+   * index that counts records the files don't hold was written out
+   * before them, and could point anywhere, so start it again too. */
+  if ((uint64_t)(images + entries) * 2 > a->hdr->slots ||
+      a->hdr->images > images || a->hdr->entries > entries)
+    return archive_rebuild(a, images + entries);
+
+  for (; a->hdr->images < images; a->hdr->images++) {
+    uint64_t hash;
+
+    if (archive_read(a->images_fd, a->hdr->images, image, 0x100) < 0)
+      return -EIO;
+    hash = archive_hash(image, 0x100);
+    archive_fill(archive_image_slot(a, image, hash), slot_image, hash,
+                 a->hdr->images, a);
+  }
+  for (; a->hdr->entries < entries; a->hdr->entries++) {
+    uint64_t hash;
+
+    if (archive_read(a->entries_fd, a->hdr->entries, &e, sizeof(e)) < 0)
+      return -EIO;
+    hash = archive_hash(e.serial, strlen(e.serial));
+    archive_fill(archive_serial_slot(a, e.serial, hash), slot_serial, hash,
+                 a->hdr->entries, a);
+  }
+  return 0;
+}
+/**
+ * Locks the archive and maps the index, checking it is up to date.
+ * Returns 0 or a negative errno, unlocked again if it failed.
+ */
+static int archive_lock (struct archive *a)
+{
+  struct stat st;
+  int ret = 0;
+
+  pthread_mutex_lock(&a->lock);
+  if (flock(a->index_fd, LOCK_EX) == -1) {
+    ret = -errno;
+    pthread_mutex_unlock(&a->lock);
+    return ret;
+  }
+
+  /* Another process may have rebuilt the index at a new size */
+  if (fstat(a->index_fd, &st) == -1) {
+    ret = -errno;
+  } else if (!a->hdr || st.st_size != a->map_len) {
+    archive_unmap(a);
+    if (st.st_size < sizeof(struct archive_header) ||
+        (ret = archive_map(a, st.st_size)) < 0 ||
+        memcmp(a->hdr->magic, archive_magic, sizeof(archive_magic)) ||
+        st.st_size != sizeof(struct archive_header) +
+                      a->hdr->slots * sizeof(struct archive_slot))
+      ret = archive_rebuild(a, 0);
+  }
+  if (ret == 0)
+    ret = archive_catch_up(a);
+
+  if (ret < 0) {
+    flock(a->index_fd, LOCK_UN);
+    pthread_mutex_unlock(&a->lock);
+  }
+  return ret;
+}
+static void archive_unlock (struct archive *a)
+{
+  flock(a->index_fd, LOCK_UN);
+  pthread_mutex_unlock(&a->lock);
+}
+
+static int archive_open_file (const char *dir, const char *name, int flags)
+{
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return open(path, O_RDWR|O_CREAT|flags, 0644);
+}
+/**
+ * Opens the archive in dir, creating it if need be. A record left
+ * half written by a crash is cut off, so that appends stay aligned.
+ * The index has caught up by then, so it counts just the whole
+ * records and the files never grow here.
+ */
+static int archive_open (const char *dir)
+{
+  struct archive *a = &archive;
+  int ret;
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    ret = -errno;
+    perror(dir);
+    return ret;
+  }
+  a->images_fd = archive_open_file(dir, "images", O_APPEND);
+  a->entries_fd = archive_open_file(dir, "entries", O_APPEND);
+  a->index_fd = archive_open_file(dir, "index", 0);
+  if (a->images_fd == -1 || a->entries_fd == -1 || a->index_fd == -1) {
+    ret = -errno;
+    perror(dir);
+    return ret;
+  }
+
+  if ((ret = archive_lock(a)) == 0) {
+    if (ftruncate(a->images_fd, (off_t)a->hdr->images * 0x100) == -1 ||
+        ftruncate(a->entries_fd,
+                  (off_t)a->hdr->entries * sizeof(struct archive_entry)) == -1)
+      ret = -errno;
+    archive_unlock(a);
+  }
+  if (ret < 0)
+    fprintf(stderr, "%s: %s\n", dir, strerror(-ret));
+  return ret;
+}
+/**
+ * Adds an image to the archive. Returns 0 or a negative errno.
+ */
+static int archive_add (struct device_run *run, unsigned char *eeprom)
+{
+  struct archive *a = &archive;
+  struct archive_slot *s;
+  struct archive_entry e;
+  unsigned char image[0x100];
+  uint64_t hash;
+  bool shared = true;
+  int ret;
+
+  archive_split(eeprom, image, &e);
+  e.time = time(NULL);
+  if ((ret = archive_lock(a)) < 0)
+    goto out;
+
+  hash = archive_hash(image, 0x100);
+  s = archive_image_slot(a, image, hash);
+  if (s->kind == slot_empty) {
+    /* On disk before any entry refers to it */
+    if ((ret = fd_write(a->images_fd, (char *)image, 0x100)) < 0)
+      goto unlock;
+    if (fdatasync(a->images_fd) == -1) {
+      ret = -errno;
+      goto unlock;
+    }
+    archive_fill(s, slot_image, hash, a->hdr->images++, a);
+    shared = false;
+  }
+  e.image = s->id;
+
+  hash = archive_hash(e.serial, strlen(e.serial));
+  s = archive_serial_slot(a, e.serial, hash);
+  e.prev = s->kind == slot_empty ? ARCHIVE_NONE : s->id;
+  /* And the entry before the index counts it */
+  if ((ret = fd_write(a->entries_fd, (char *)&e, sizeof(e))) < 0)
+    goto unlock;
+  if (fdatasync(a->entries_fd) == -1) {
+    ret = -errno;
+    goto unlock;
+  }
+  archive_fill(s, slot_serial, hash, a->hdr->entries++, a);
+
+  if (!batch_mode)
+    printf("%s: archived as entry %u, %s image %u\n", run->path, s->id,
+           shared ? "sharing" : "new", e.image);
+unlock:
+  archive_unlock(a);
+out:
+  if (ret < 0)
+    fprintf(stderr, "%s: archiving failed: %s\n", run->path, strerror(-ret));
+  return ret;
+}
+/**
+ * Finds the latest image saved for a serial number. With a vid and
+ * pid only images saved from a device with the same ones count.
+ * Returns 0, -ENOENT or another negative errno.
+ */
+static int archive_lookup (const char *serial, int vid, int pid,
+                           unsigned char *eeprom, struct archive_entry *e)
+{
+  struct archive *a = &archive;
+  struct archive_slot *s;
+  unsigned char image[0x100];
+  char key[ARCHIVE_SERIAL_MAX];
+  uint32_t id;
+  int ret;
+
+  snprintf(key, sizeof(key), "%s", serial);
+  if ((ret = archive_lock(a)) < 0)
+    return ret;
 
-      /* Reset the device to force it to load the new settings */
-      ftdi_usb_reset(&ftdi);
+  s = archive_serial_slot(a, key, archive_hash(key, strlen(key)));
+  ret = -ENOENT;
+  for (id = s->kind == slot_serial ? s->id : ARCHIVE_NONE;
+       id != ARCHIVE_NONE; id = e->prev) {
+    if ((ret = archive_read(a->entries_fd, id, e, sizeof(*e))) < 0)
+      break;
+    ret = -ENOENT;
+    if (vid < 0 || (e->vid == vid && e->pid == pid)) {
+      if ((ret = archive_read(a->images_fd, e->image, image, 0x100)) == 0)
+        archive_join(image, e, eeprom);
+      break;
     }
   }
 
+  archive_unlock(a);
+  return ret;
+}
+/**
+ * Fills in restored with the latest image archived for this device,
+ * by --archive-restore's serial number, or the device's own if "-".
+ * Returns 0 or a negative errno.
+ */
+static int archive_restore (struct device_run *run, unsigned char *old,
+                            unsigned char *restored)
+{
+  struct archive_entry e, self;
+  unsigned char image[0x100];
+  const char *serial = archive_restore_serial;
+  int vid = -1, pid = -1, ret;
+  char when[32];
+
+  if (strcmp(serial, "-") == 0) {
+    archive_split(old, image, &self);
+    serial = self.serial;
+    vid = self.vid;
+    pid = self.pid;
+  }
+  ret = archive_lookup(serial, vid, pid, restored, &e);
+  if (ret == -ENOENT) {
+    fprintf(stderr, "%s: nothing archived for serial number \"%s\"\n",
+            run->path, serial);
+  } else if (ret < 0) {
+    fprintf(stderr, "%s: reading the archive failed: %s\n", run->path,
+            strerror(-ret));
+  } else if (!batch_mode) {
+    time_t t = e.time;
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%s: restoring \"%s\" as archived %s\n", run->path, e.serial,
+           when);
+  }
+  return ret;
+}
+/**
+ * Lists every entry in the archive, oldest first
+ */
+static int archive_print (void)
+{
+  struct archive *a = &archive;
+  struct archive_entry e;
+  uint32_t i;
+  char when[32];
+  int ret;
+
+  if ((ret = archive_lock(a)) < 0)
+    return -ret;
+  for (i = 0; i < a->hdr->entries; i++) {
+    time_t t;
+
+    if (archive_read(a->entries_fd, i, &e, sizeof(e)) < 0)
+      break;
+    t = e.time;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%6u  %s  %04x:%04x  image %-6u  %s\n", i, when, e.vid, e.pid,
+           e.image, e.serial);
+  }
+  printf("%u entries, %u distinct images, %lu bytes\n", a->hdr->entries,
+         a->hdr->images, (unsigned long)a->hdr->images * 0x100 +
+         (unsigned long)a->hdr->entries * sizeof(e) + a->map_len);
+  archive_unlock(a);
+
   return 0;
 }
+
+/* ------------ Programming ------------ */
+
+/* process_args() also sets the globals, so only run one pass at once */
+static pthread_mutex_t args_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ------------ Image Templates ------------ */
+
+/*
+ * With --all and --hotplug most devices start out with the same image
+ * and end up with the same image, apart from their serial numbers. The
+ * first device's old and new images are kept as a template, and later
+ * devices whose old image matches apart from the serial number just
+ * get the new image with their serial number patched in, skipping the
+ * decode, the argument pass and the encode.
+ */
+enum template_serial {
+  serial_from_device,		/* each device keeps its own */
+  serial_from_args,		/* all get the one --new-serial-number */
+  serial_from_counter,		/* each gets one from --serial-template */
+};
+struct ee_template {
+  bool valid;
+  enum template_serial serial;
+  char serial_string[64];	/* for serial_from_args */
+  unsigned char source[0x100];	/* old image the template was built from */
+  unsigned char image[0x100];	/* new image built from it */
+};
+
+static struct ee_template template;
+static bool ee_templates = true;	/* off when devices get different args */
+static pthread_mutex_t template_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Says if the serial number string comes after the other strings, and
+ * so can be replaced in place with one of a different length.
+ */
+static bool ee_serial_is_last (unsigned char *eeprom)
+{
+  int slot = eeprom[0x12];
+
+  return slot >= 0xA0 && slot + eeprom[0x13] <= 0xFE &&
+    slot >= eeprom[0x0E] + eeprom[0x0F] &&
+    slot >= eeprom[0x10] + eeprom[0x11];
+}
+/**
+ * Keeps a device's old and new images as the template, if there isn't
+ * one yet and the serial number can be patched.
+ */
+static void ee_template_compile (unsigned char *old, unsigned char *new,
+                                 const char *serial, bool serial_changed)
+{
+  if (!ee_serial_is_last(old) || !ee_serial_is_last(new))
+    return;
+
+  pthread_mutex_lock(&template_lock);
+  if (!template.valid) {
+    memcpy(template.source, old, sizeof(template.source));
+    memcpy(template.image, new, sizeof(template.image));
+    if (serial_template) {
+      template.serial = serial_from_counter;
+    } else if (serial_changed) {
+      template.serial = serial_from_args;
+      snprintf(template.serial_string, sizeof(template.serial_string), "%s",
+               serial);
+    } else {
+      template.serial = serial_from_device;
+    }
+    template.valid = true;
+  }
+  pthread_mutex_unlock(&template_lock);
+}
+/**
+ * Patches a serial number into the template image. Only the serial
+ * string words and the length change, so the CRC is updated from just
+ * those. Returns the new CRC, or -EINVAL if the serial doesn't fit.
+ */
+static int ee_template_apply (unsigned char *new, const char *serial)
+{
+  unsigned char *image = template.image, str[0x100];
+  int addr, slot = image[0x12], length = ee_encode_str(&options, serial, str);
+  unsigned short crc = ee_get_word(image, 0x7F);
+
+  if (slot + length > 0xFE)
+    return -EINVAL;
+
+  memcpy(new, image, 0x100);
+  memset(new + slot, 0, 0xFE - slot);
+  memcpy(new + slot, str, length);
+  new[0x13] = length;
+
+  crc = update_crc_word(crc, 0x09, ee_get_word(image, 0x09),
+                        ee_get_word(new, 0x09));
+  for (addr = slot/2; addr < 0x7F; addr++) {
+    crc = update_crc_word(crc, addr, ee_get_word(image, addr),
+                          ee_get_word(new, addr));
+  }
+  ee_set_word(new, 0x7F, crc);
+
+  return crc;
+}
+/**
+ * Builds a device's new image from the template, if its old image
+ * matches the template's apart from the serial number. Returns the new
+ * CRC, or -1 if the template doesn't apply.
+ */
+static int ee_template_build (unsigned char *old, unsigned char *new,
+                              struct device_run *run)
+{
+  int slot = template.source[0x12];
+  bool valid;
+
+  pthread_mutex_lock(&template_lock);
+  valid = template.valid;	/* never changes once it is set */
+  pthread_mutex_unlock(&template_lock);
+
+  /* Everything before the serial string bar its length must match */
+  if (!valid || memcmp(old, template.source, 0x13) ||
+      memcmp(old + 0x14, template.source + 0x14, slot - 0x14) ||
+      slot + old[0x13] > 0xFE) {
+    return -1;
+  }
+
+  switch (template.serial) {
+  case serial_from_counter:
+    break;			/* already allocated */
+  case serial_from_args:
+    snprintf(run->serial, sizeof(run->serial), "%s", template.serial_string);
+    break;
+  case serial_from_device:
+    if (old[0x13] >= sizeof(run->serial))
+      return -1;
+    ee_decode_str(&options, old + slot, old[0x13], run->serial);
+    break;
+  }
+
+  return ee_template_apply(new, run->serial);
+}
+/**
+ * Checks if a device already holds the image the template would give
+ * it, reading just the CRC and a few key words, and the serial number
+ * if each device keeps its own, rather than the whole image. A CRC
+ * that matches by chance is caught with --precheck full, which then
+ * compares every word, stopping at the first that differs. Returns 1
+ * with the image in new if it matches, 0 if the device needs the full
+ * treatment, or a negative errno.
+ */
+static int ee_precheck (struct ee_device *dev, struct device_run *run,
+                        unsigned char *new)
+{
+  static const unsigned short key[] = {
+    0x7F, 0x00, 0x01, 0x02, 0x04, 0x05, 0x09,
+  };
+  struct ee_xfer xfers[0x80];
+  unsigned char str[0x100];
+  int i, n = sizeof(key)/sizeof(key[0]), slot, length, chunk;
+  bool valid;
+
+  pthread_mutex_lock(&template_lock);
+  valid = template.valid;
+  pthread_mutex_unlock(&template_lock);
+  if (!valid || template.serial == serial_from_counter)
+    return 0;		/* fresh serial numbers never match */
+
+  for (i = 0; i < n; i++) {
+    xfers[i].addr = key[i];
+  }
+  if (ee_read_words(dev, xfers, n) < 0)
+    goto failed;
+
+  /* The serial number starts where the template's does */
+  if (template.serial == serial_from_device) {
+    slot = xfers[6].val & 0xff;
+    length = xfers[6].val >> 8;
+    if (slot != template.image[0x12] || slot + length > 0xFE ||
+        length >= sizeof(run->serial))
+      return 0;
+    for (i = 0; i < (length + 1)/2; i++) {
+      xfers[n + i].addr = slot/2 + i;
+    }
+    if (ee_read_words(dev, xfers + n, i) < 0)
+      goto failed;
+    for (i = 0; i < (length + 1)/2; i++) {
+      ee_set_word(str, i, xfers[n + i].val);
+    }
+    ee_decode_str(&options, str, length, run->serial);
+  } else {
+    snprintf(run->serial, sizeof(run->serial), "%s", template.serial_string);
+  }
+
+  if (ee_template_apply(new, run->serial) < 0)
+    return 0;
+  for (i = 0; i < n; i++) {
+    if (xfers[i].val != ee_get_word(new, key[i]))
+      return 0;
+  }
+
+  for (chunk = 0; precheck == precheck_full && chunk < 0x80; chunk += 0x10) {
+    for (i = 0; i < 0x10; i++) {
+      xfers[i].addr = chunk + i;
+    }
+    if (ee_read_words(dev, xfers, 0x10) < 0)
+      goto failed;
+    for (i = 0; i < 0x10; i++) {
+      if (xfers[i].val != ee_get_word(new, chunk + i))
+        return 0;
+    }
+  }
+  return 1;
+
+failed:
+  fprintf(stderr, "%s: pre-check read failed: %s\n", run->path,
+          ee_error(dev));
+  return -EIO;
+}
+
+/**
+ * Works out the new image for a device from its old one, by way of
+ * a template if it can, otherwise by applying the value-change
+ * arguments to the decoded old image. With --restore or
+ * --archive-restore "old" is the restored image instead. Returns the
+ * new CRC or a negative errno.
+ */
+static int ee_build_image (struct device_run *run, int argc, char *argv[],
+                           struct eeprom_fields ee, unsigned char *old,
+                           unsigned char *new, int len)
+{
+  char *decoded[3];
+  int new_crc;
+
+  /* Devices that start out like the last one just need a new serial */
+  if (batch_mode && ee_templates && erase_eeprom == 0 &&
+      (new_crc = ee_template_build(old, new, run)) >= 0) {
+    if (verbose) printf("%s: built from template\n", run->path);
+  } else {
+    /* Decode eeprom contents into ee struct */
+    ee_decode(&options, old, len, &ee);
+    decoded[0] = ee.manufacturer_string;
+    decoded[1] = ee.product_string;
+    decoded[2] = ee.serial_string;
+
+    /* process args, and dump new settings */
+    pthread_mutex_lock(&args_lock);
+    process_args(argc, argv, &ee);	/* Handle value-change args */
+    pthread_mutex_unlock(&args_lock);
+    if (serial_template) {
+      /* The caller allocated this device a serial number */
+      ee.serial_string = run->serial;
+      ee.serial_number_avail = strlen(ee.serial_string) > 0;
+    } else if (ee.serial_string) {
+      snprintf(run->serial, sizeof(run->serial), "%s", ee.serial_string);
+    }
+    if (!batch_mode && output_format == format_text) ee_dump(&ee);
+
+    /* Build new eeprom image */
+    if (erase_eeprom == 0) {
+      new_crc = ee_encode(&options, new, len, &ee);
+      if (new_crc < 0) {
+        fprintf(stderr, "Failed to encode, strings too long to fit in"
+                " string memory area!\n");
+      }
+      if (batch_mode && ee_templates && new_crc >= 0) {
+        ee_template_compile(old, new, run->serial,
+                            ee.serial_string != decoded[2]);
+      }
+    }  else {
+      memset(new, 0xff, 0x100);
+      new_crc = 0xFFFF;
+    }
+    free(decoded[0]); free(decoded[1]); free(decoded[2]);
+  }
+
+  return new_crc;
+}
+
+/**
+ * Lists the settings a new image changes, for --verbose
+ */
+static void print_changes (struct device_run *run, unsigned char *old,
+                           unsigned char *new)
+{
+  const struct ee_field *changed[64];
+  int i, n = ee_diff(old, new, changed, 64);
+
+  if (!n)
+    return;
+  printf("%s: changing", run->path);
+  for (i = 0; i < n && i < 64; i++) {
+    printf(" %s", changed[i]->name);
+  }
+  printf("\n");
+}
+/**
+ * Resets the port, waits for the device to come back with the
+ * identity held in eeprom and reports how long that took
+ */
+static int device_reenumerate (struct ee_device *dev, struct device_run *run,
+                               unsigned char *eeprom, uint64_t *t)
+{
+  struct ee_identity expect, found;
+  long start = monotonic_ms();
+  int ret;
+
+  ee_identity_from_image(&options, eeprom, &expect);
+  ret = ee_reenumerate(dev, &expect, reenum_timeout, &found);
+  run->reenum_ms = monotonic_ms() - start;
+  timing_phase(phase_reenumerate, t);
+
+  switch (ret) {
+  case 0:
+    printf("%s: back as %04x:%04x \"%s\" \"%s\" serial \"%s\" in %ldms\n",
+           run->path, found.vid, found.pid, found.manufacturer,
+           found.product, found.serial, run->reenum_ms);
+    break;
+  case -ETIMEDOUT:
+    fprintf(stderr, "%s: did not come back as %04x:%04x within %dms\n",
+            run->path, expect.vid, expect.pid, reenum_timeout);
+    break;
+  case -EPROTO:
+    fprintf(stderr, "%s: came back as %04x:%04x \"%s\" \"%s\" serial \"%s\","
+            " expected %04x:%04x \"%s\" \"%s\" serial \"%s\"\n", run->path,
+            found.vid, found.pid, found.manufacturer, found.product,
+            found.serial, expect.vid, expect.pid, expect.manufacturer,
+            expect.product, expect.serial);
+    break;
+  default:
+    fprintf(stderr, "%s: waiting to come back failed: %s\n", run->path,
+            strerror(-ret));
+  }
+
+  return ret;
+}
+
+/**
+ * Reads, updates and rewrites the eeprom of an open device. ee holds
+ * the results of the first pass over the arguments. In batch mode
+ * nothing is dumped or asked, the caller has already confirmed.
+ * Returns 0 or a negative errno.
+ */
+static int program_device (struct ee_device *dev, struct device_run *run,
+                           int argc, char *argv[], struct eeprom_fields ee)
+{
+  unsigned char old[0x100] = {0,}, new[0x100] = {0,}, restored[0x100];
+  unsigned char *base = old;	/* what the new settings start from */
+  struct ee_write_result wr;
+  int i, new_crc, ret;
+  /* The user area after the first 256 bytes is left to --user-write */
+  unsigned int len = 0x100;
+  uint64_t t = timing_now();
+
+  /* Skip devices that already hold their image, if a few words say so */
+  if (precheck && batch_mode && ee_templates && !erase_eeprom &&
+      !restore_path && !archive_save && !archive_restore_serial) {
+    if ((ret = ee_precheck(dev, run, new)) < 0)
+      return ret;
+    timing_phase(phase_read, &t);
+    if (ret) {
+      run->prechecked = true;
+      run->old_crc = run->new_crc = new[0xfe] | new[0xff] << 8;
+      if (output_format != format_text)
+        return ee_dump_json(run->path, new, len);
+      return 0;
+    }
+  }
+
+  /* First, read the original eeprom from the device */
+  if ((ret = ee_read_and_verify(dev, old, len)) < 0)
+    return ret;
+  timing_phase(phase_read, &t);
+  run->old_crc = run->new_crc = old[0xfe] | old[0xff] << 8;
+  if (verbose && !batch_mode) dumpmem("existing eeprom", old, len);
+
+  /* Save old contents to a file, if requested (--save) */
+  if (save_path && (ret = save_eeprom_to_file(save_path, old, len)) < 0)
+    return ret;
+
+  if (archive_save && (ret = archive_add(run, old)) < 0)
+    return ret;
+
+  /* Restore contents from a file, if requested (--restore) */
+  if (restore_path) {
+    ret = restore_eeprom_from_file(restore_path, restored, len,
+                                   sizeof(restored));
+    if (ret < 0)
+      return ret;
+    if (verbose && !batch_mode) dumpmem(restore_path, restored, len);
+    base = restored;
+  }
+  if (archive_restore_serial) {
+    if ((ret = archive_restore(run, old, restored)) < 0)
+      return ret;
+    if (verbose && !batch_mode) dumpmem("archived eeprom", restored, len);
+    base = restored;
+  }
+
+  new_crc = ee_build_image(run, argc, argv, ee, base, new, len);
+  if (new_crc < 0)
+    return new_crc;
+  run->new_crc = new_crc;
+  if (output_format != format_text &&
+      (ret = ee_dump_json(run->path, new, len)) < 0)
+    return ret;
+  timing_phase(phase_build, &t);
+
+  if (verbose)
+    print_changes(run, old, new);
+
+  /* If different from original, then write it back to the device */
+  if (0 == memcmp(old, new, len)) {
+    if (!batch_mode) printf("No change from existing eeprom contents.\n");
+    return 0;
+  }
+
+  if (!batch_mode) {
+    if (verbose) { dumpmem("new eeprom", new, len); }
+
+    if (erase_eeprom == 0) {
+      printf("Rewriting eeprom with new contents.\n");
+    } else {
+      printf("Erasing EEPROM\n");
+    }
+
+    printf("Continue? [y|n]:");
+    if (getc(stdin) != 'y')
+      return 0;
+  }
+
+  ret = ee_write(dev, old, new, len, &wr);
+  run->words_written = wr.written;
+  if (ret < 0) {
+    if (wr.error_count == 0)
+      fprintf(stderr, "%s: %s\n", run->path, ee_error(dev));
+    for (i = 0; i < wr.error_count; i++) {
+      fprintf(stderr, "%s: writing word 0x%02x failed: %s\n", run->path,
+              wr.errors[i].addr, libusb_error_name(wr.errors[i].status));
+    }
+    fprintf(stderr, "%s: CRC left unwritten, the eeprom will not validate\n",
+            run->path);
+    return ret;
+  }
+  if (!batch_mode)
+    printf("Wrote %d words, skipped %d unchanged words\n",
+           wr.written, wr.skipped);
+
+  /* Read it back again, and rewrite any words that didn't stick */
+  t = timing_now();
+  if ((ret = ee_verify(dev, new, len)) < 0) {
+    fprintf(stderr, "%s: %s\n", run->path, ee_error(dev));
+    fprintf(stderr, "Readback test failed, results may be botched\n");
+    return ret;
+  }
+  timing_phase(phase_verify, &t);
+  run->words_written += ret;
+  if (ret && !batch_mode)
+    printf("Rewrote %d words that differed on readback\n", ret);
+  if (erase_eeprom == 1 && !batch_mode) { printf("Erase done\n"); }
+
+  /* Reset the device to force it to load the new settings */
+  if (reenum_timeout) {
+    return device_reenumerate(dev, run, new, &t);
+  }
+  if (run->reset_as)
+    ee_identity_from_image(&options, new, run->reset_as);
+  run->reset = true;
+  ee_reset(dev);
+  timing_phase(phase_reset, &t);
+
+  return 0;
+}
+
+/* ------------ Ledger ------------ */
+
+/* Records are gathered in memory and written out by a flusher thread
+ * every --ledger-sync ms, so programming never waits for the disk */
+static struct ledger {
+  int fd;
+  char *buf;
+  size_t len, size;
+  bool stop;
+  pthread_t flusher;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ledger = {
+  .fd = -1,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Writes out and syncs everything gathered so far. Called by the
+ * flusher with the lock held, which is dropped while the disk is busy.
+ */
+static void ledger_flush (void)
+{
+  char *buf = ledger.buf;
+  size_t len = ledger.len;
+  int ret;
+
+  if (!len)
+    return;
+  ledger.buf = NULL;
+  ledger.len = ledger.size = 0;
+  pthread_mutex_unlock(&ledger.lock);
+  if ((ret = fd_write(ledger.fd, buf, len)) == 0 && fdatasync(ledger.fd) < 0)
+    ret = -errno;
+  if (ret < 0)
+    fprintf(stderr, "Writing %s failed: %s\n", ledger_path, strerror(-ret));
+  free(buf);
+  pthread_mutex_lock(&ledger.lock);
+}
+static void *ledger_flusher (void *arg)
+{
+  struct timespec deadline;
+
+  pthread_mutex_lock(&ledger.lock);
+  while (!ledger.stop) {
+    if (ledger_sync_ms) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += ledger_sync_ms / 1000;
+      deadline.tv_nsec += (ledger_sync_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&ledger.cond, &ledger.lock, &deadline);
+    } else if (!ledger.len) {
+      pthread_cond_wait(&ledger.cond, &ledger.lock);
+    }
+    ledger_flush();
+  }
+  ledger_flush();
+  pthread_mutex_unlock(&ledger.lock);
+  return NULL;
+}
+static void ledger_close (void)
+{
+  if (ledger.fd < 0)
+    return;
+  pthread_mutex_lock(&ledger.lock);
+  ledger.stop = true;
+  pthread_cond_signal(&ledger.cond);
+  pthread_mutex_unlock(&ledger.lock);
+  pthread_join(ledger.flusher, NULL);
+  close(ledger.fd);
+  ledger.fd = -1;
+}
+/**
+ * Opens the ledger for appending and starts the flusher, which is
+ * stopped and the last records synced when the process exits
+ */
+static int ledger_open (const char *path)
+{
+  sigset_t stop_signals, old_mask;
+  int ret;
+
+  ledger.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (ledger.fd < 0) {
+    ret = -errno;
+    fprintf(stderr, "Opening %s failed: %s\n", path, strerror(-ret));
+    return ret;
+  }
+  /* Leave SIGINT and SIGTERM to the thread that --daemon and
+   * --hotplug stop from */
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+  ret = pthread_create(&ledger.flusher, NULL, ledger_flusher, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (ret) {
+    fprintf(stderr, "Starting the ledger flusher failed: %s\n", strerror(ret));
+    close(ledger.fd);
+    ledger.fd = -1;
+    return -ret;
+  }
+  atexit(&ledger_close);
+  return 0;
+}
+/**
+ * Queues a one line record of a device run, eg.
+ *
+ *   1700000000123 d:001/004 ABC000042 crc=1a2b/3c4d words=5 result=0 open=812 read=2210 ...
+ *
+ * The time is in ms since the epoch and each phase in microseconds.
+ */
+static void ledger_append (const struct device_run *run)
+{
+  char line[512], serial[sizeof(run->serial)];
+  struct timespec ts;
+  size_t n, size;
+  char *buf;
+  int i;
+
+  if (ledger.fd < 0)
+    return;
+
+  /* Keep the record to whitespace separated fields */
+  for (i = 0; run->serial[i]; i++) {
+    serial[i] = isspace((unsigned char)run->serial[i]) ? '_' : run->serial[i];
+  }
+  serial[i] = '\0';
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  n = snprintf(line, sizeof(line),
+               "%lld %s %s crc=%04x/%04x words=%d result=%d",
+               (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000,
+               run->path, i ? serial : "-", run->old_crc, run->new_crc,
+               run->words_written, run->result);
+  for (i = 0; i < _phase_end; i++) {
+    if (run->phase_ns[i])
+      n += snprintf(line + n, sizeof(line) - n, " %s=%llu", phase_strings[i],
+                    (unsigned long long)(run->phase_ns[i] / 1000));
+  }
+  n += snprintf(line + n, sizeof(line) - n, "\n");
+
+  pthread_mutex_lock(&ledger.lock);
+  if (ledger.len + n > ledger.size) {
+    for (size = ledger.size ? ledger.size : 4096; size < ledger.len + n;)
+      size *= 2;
+    if (!(buf = realloc(ledger.buf, size))) {
+      pthread_mutex_unlock(&ledger.lock);
+      fprintf(stderr, "%s: no memory for its ledger record\n", run->path);
+      return;
+    }
+    ledger.buf = buf;
+    ledger.size = size;
+  }
+  memcpy(ledger.buf + ledger.len, line, n);
+  ledger.len += n;
+  if (!ledger_sync_ms)
+    pthread_cond_signal(&ledger.cond);
+  pthread_mutex_unlock(&ledger.lock);
+}
+
+struct ledger_summary {
+  unsigned long units, failed;
+  struct { int result; unsigned long count; } causes[16];
+};
+
+static void ledger_count (struct ledger_summary *s, int result)
+{
+  int i;
+
+  s->units++;
+  if (!result)
+    return;
+  s->failed++;
+  for (i = 0; i < 16 && s->causes[i].count; i++) {
+    if (s->causes[i].result == result)
+      break;
+  }
+  if (i < 16) {
+    s->causes[i].result = result;
+    s->causes[i].count++;
+  }
+}
+static void ledger_print_hour (long long hour, struct ledger_summary *s)
+{
+  time_t t = hour * 3600;
+  char label[32];
+
+  strftime(label, sizeof(label), "%Y-%m-%d %H:00", localtime(&t));
+  printf("  %-18s %8lu %8lu %7.2f%%\n", label, s->units, s->failed,
+         100.0 * s->failed / s->units);
+}
+/**
+ * Summarises the ledger at path over the last minutes, or all of it if
+ * minutes is 0: units programmed and failed in each hour, then the
+ * overall rate, failure rate and the errors behind the failures
+ */
+static int ledger_report (const char *path, int minutes)
+{
+  struct ledger_summary all = {0,}, hour = {0,};
+  long long ms, since = 0, first = -1, last = 0, this_hour = -1;
+  char line[512], dev[64], serial[64];
+  struct timespec ts;
+  double hours;
+  int i, words, result;
+  FILE *fp;
+
+  if (!(fp = fopen(path, "r"))) {
+    fprintf(stderr, "Opening %s failed: %s\n", path, strerror(errno));
+    return -errno;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if (minutes)
+    since = (long long)ts.tv_sec * 1000 - minutes * 60000LL;
+
+  printf("  %-18s %8s %8s %8s\n", "hour", "units", "failed", "rate");
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "%lld %63s %63s crc=%*x/%*x words=%d result=%d",
+               &ms, dev, serial, &words, &result) != 5 || ms < since)
+      continue;
+    if (ms / 3600000 != this_hour) {
+      if (hour.units)
+        ledger_print_hour(this_hour, &hour);
+      memset(&hour, 0, sizeof(hour));
+      this_hour = ms / 3600000;
+    }
+    ledger_count(&hour, result);
+    ledger_count(&all, result);
+    if (first < 0)
+      first = ms;
+    last = ms;
+  }
+  fclose(fp);
+  if (hour.units)
+    ledger_print_hour(this_hour, &hour);
+
+  /* A window is measured in full, all of it from the first record */
+  hours = (minutes ? minutes * 60000.0 : (double)(last - first)) / 3600000;
+  printf("%lu units, %lu failed (%.2f%%)", all.units, all.failed,
+         all.units ? 100.0 * all.failed / all.units : 0.0);
+  if (all.units && hours >= 1.0 / 60)
+    printf(", %.1f units/hour", all.units / hours);
+  printf("\n");
+  for (i = 0; i < 16 && all.causes[i].count; i++) {
+    printf("  %6lu  %s\n", all.causes[i].count,
+           strerror(-all.causes[i].result));
+  }
+
+  return 0;
+}
+
+/* ------------ Batch Programming ------------ */
+
+struct batch_args {
+  int argc;
+  char **argv;
+  struct eeprom_fields *ee;
+};
+
+static struct device_run *batch_runs;
+static int batch_count, batch_next;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * With --hub-jobs or --bus-jobs, devices sharing a hub or a root
+ * controller are programmed only a few at a time, since their control
+ * transfers queue behind each other. Each hub or controller has a cap
+ * that starts at one. It is revisited each time the group has moved
+ * SCHED_WINDOW words per device it is allowed, by the words per second
+ * moved since the last visit. Latency is no guide, as it rises with
+ * every device added while the total may still be going up. The cap
+ * grows by one while the rate keeps up with the best seen there, and
+ * goes back to the cap that gave the best rate once it falls behind,
+ * staying there a while before trying higher again. If transfers start
+ * failing it halves.
+ */
+#define SCHED_WINDOW	32	/* words per device of cap between visits */
+#define SCHED_WORSE	10	/* % below the best rate that is contended */
+#define SCHED_ERRORS	1	/* % of transfers failing that is contended */
+#define SCHED_HOLD	8	/* windows to stay at the best cap once back */
+
+struct sched_group {
+  char name[32];		/* eg. "bus 1" or "hub 1-2.3" */
+  int cap, max;			/* devices at once, now and at most */
+  int active, devices;
+  double best_rate;		/* most words per second seen */
+  int best_cap;			/* the cap that gave it */
+  int hold;			/* windows before trying above it again */
+  /* Counted as they happen, without batch_lock */
+  unsigned long moved;		/* words transferred */
+  unsigned long failed;		/* transfers and devices that failed */
+  /* As they were when the cap was last revisited */
+  uint64_t since;
+  unsigned long moved_since, failed_since;
+  /* Over the whole batch, from finished devices */
+  uint64_t total_ns;
+  unsigned long total_xfers, total_errors;
+};
+
+static struct sched_group *sched_groups;
+static int sched_count;
+
+/**
+ * Finds the group called name, adding it with at most max devices at
+ * once if it is new. There is room for two groups per device.
+ */
+static struct sched_group *sched_group (const char *name, int max)
+{
+  struct sched_group *g;
+  int i;
+
+  for (i = 0; i < sched_count; i++) {
+    if (strcmp(sched_groups[i].name, name) == 0)
+      return &sched_groups[i];
+  }
+  g = &sched_groups[sched_count++];
+  snprintf(g->name, sizeof(g->name), "%s", name);
+  g->max = max;
+  g->cap = 1;
+
+  return g;
+}
+/**
+ * Puts a device in the groups for its root controller and the hub it
+ * is plugged into, for whichever of them are capped, if the transport
+ * knows where it is
+ */
+static void sched_place (struct device_run *run, struct ee_path *p)
+{
+  char name[32];
+  int i, len;
+
+  if (p->bus <= 0)
+    return;
+  if (bus_jobs) {
+    snprintf(name, sizeof(name), "bus %d", p->bus);
+    run->bus = sched_group(name, bus_jobs);
+    run->bus->devices++;
+  }
+
+  /* Devices on the root hub only share the controller */
+  if (!hub_jobs || p->depth < 2)
+    return;
+  len = snprintf(name, sizeof(name), "hub %d-%d", p->bus, p->ports[0]);
+  for (i = 1; i < p->depth - 1 && len < (int)sizeof(name); i++) {
+    len += snprintf(name + len, sizeof(name) - len, ".%d", p->ports[i]);
+  }
+  run->hub = sched_group(name, hub_jobs);
+  run->hub->devices++;
+}
+/* Called with batch_lock held */
+static bool sched_admit (struct device_run *run)
+{
+  return (!run->hub || run->hub->active < run->hub->cap) &&
+    (!run->bus || run->bus->active < run->bus->cap);
+}
+/**
+ * Revisits a group's cap if it has moved enough words since the last
+ * visit, waking the workers in case it grew. Called with batch_lock
+ * held.
+ */
+static void sched_revisit (struct sched_group *g)
+{
+  uint64_t now = ee_now_ns();
+  unsigned long moved, failed;
+  double rate;
+
+  moved = __atomic_load_n(&g->moved, __ATOMIC_RELAXED) - g->moved_since;
+  failed = __atomic_load_n(&g->failed, __ATOMIC_RELAXED) - g->failed_since;
+  if (moved < (unsigned long)g->cap * SCHED_WINDOW)
+    return;
+  /* Only a window run at the cap says anything about it */
+  if (g->active != g->cap)
+    goto next;
+
+  rate = moved * 1e9 / (now > g->since ? now - g->since : 1);
+  if (rate > g->best_rate) {
+    g->best_rate = rate;
+    g->best_cap = g->cap;
+  }
+  if (failed * 100 > moved * SCHED_ERRORS) {
+    g->cap = g->cap > 1 ? g->cap / 2 : 1;
+  } else if (rate * 100 < g->best_rate * (100 - SCHED_WORSE)) {
+    /* The best cap doing worse means things changed, so start over */
+    if (g->cap == g->best_cap)
+      g->best_rate = rate;
+    g->cap = g->best_cap;
+    g->hold = SCHED_HOLD;
+  } else if (g->hold) {
+    g->hold--;
+  } else if (g->cap < g->max) {
+    g->cap++;
+  }
+  if (verbose)
+    fprintf(stderr, "%s: %.0f words/s, cap now %d\n", g->name, rate,
+            g->cap);
+next:
+  g->since = now;
+  g->moved_since += moved;
+  g->failed_since += failed;
+  pthread_cond_broadcast(&batch_cond);
+}
+/* Counts a word moved, revisiting the cap every SCHED_WINDOW words */
+static void sched_moved (struct sched_group *g)
+{
+  if (!g || __atomic_add_fetch(&g->moved, 1, __ATOMIC_RELAXED) %
+      SCHED_WINDOW)
+    return;
+  pthread_mutex_lock(&batch_lock);
+  sched_revisit(g);
+  pthread_mutex_unlock(&batch_lock);
+}
+/* Counts a word moved through the device's hub and controller */
+static void sched_xfer (struct device_run *run)
+{
+  sched_moved(run->hub);
+  sched_moved(run->bus);
+}
+/* Counts a transfer that failed, for the error rate */
+static void sched_error (struct device_run *run)
+{
+  if (run->hub)
+    __atomic_add_fetch(&run->hub->failed, 1, __ATOMIC_RELAXED);
+  if (run->bus)
+    __atomic_add_fetch(&run->bus->failed, 1, __ATOMIC_RELAXED);
+}
+/**
+ * Takes a finished device off its group and adds it to the totals.
+ * Called with batch_lock held.
+ */
+static void sched_finish (struct sched_group *g, struct device_run *run)
+{
+  if (!g)
+    return;
+  g->active--;
+  if (run->result == -EIO)
+    __atomic_add_fetch(&g->failed, 1, __ATOMIC_RELAXED);
+  g->total_ns += run->xfer_ns;
+  g->total_xfers += run->xfers;
+  g->total_errors += run->xfer_errors + (run->result == -EIO);
+}
+static void sched_print (void)
+{
+  int i;
+
+  printf("Caps per hub and controller:\n");
+  for (i = 0; i < sched_count; i++) {
+    struct sched_group *g = &sched_groups[i];
+
+    printf("  %-14s %3d devices, cap %d of %d", g->name, g->devices,
+           g->cap, g->max);
+    if (g->best_rate) {
+      printf(", best %.0f words/s at cap %d", g->best_rate, g->best_cap);
+    }
+    if (g->total_xfers) {
+      printf(", %.2fms per transfer, %lu errors",
+             g->total_ns / 1e6 / g->total_xfers, g->total_errors);
+    }
+    printf("\n");
+  }
+}
+
+/**
+ * Finds every device matching the old vid, pid and serial number on
+ * the chosen transport. Returns the number found, or a negative errno.
+ */
+static int find_devices (struct eeprom_fields *ee, struct device_run **runs)
+{
+  struct ee_path *paths;
+  uint64_t t = timing_now();
+  int i, n = ee_find(&options, ee, &paths);
+
+  timing_phase(phase_enumerate, &t);
+  if (n < 0) {
+    fprintf(stderr, "Finding devices failed: %s\n", strerror(-n));
+    return n;
+  }
+  *runs = calloc(n ? n : 1, sizeof(**runs));
+  if (batch_mode && (hub_jobs || bus_jobs) && *runs) {
+    sched_count = 0;
+    free(sched_groups);
+    sched_groups = calloc(2 * n + 1, sizeof(*sched_groups));
+  }
+  for (i = 0; i < n && *runs; i++) {
+    memcpy((*runs)[i].path, paths[i].path, sizeof(paths[i].path));
+    if (sched_groups)
+      sched_place(&(*runs)[i], &paths[i]);
+  }
+  free(paths);
+
+  return *runs ? n : -ENOMEM;
+}
+/**
+ * Opens the device at run->path on a fresh device handle, programs
+ * it and closes it again, leaving the outcome in run.
+ */
+static void program_path (struct device_run *run, struct batch_args *args)
+{
+  struct ee_device dev;
+  int ret;
+  uint64_t t;
+
+  run_phase_ns = run->phase_ns;
+  xfer_run = run;
+  t = timing_now();
+  ret = ee_open(&dev, &options, run->path);
+  timing_phase(phase_open, &t);
+
+  if (ret) {
+    fprintf(stderr, "%s: opening failed: %s\n",
+            run->path, ee_error(&dev));
+    run->result = -ENODEV;
+  } else {
+    run->result = program_device(&dev, run, args->argc, args->argv,
+                                 *args->ee);
+  }
+  ee_close(&dev);
+  ledger_append(run);
+  run_phase_ns = NULL;
+  xfer_run = NULL;
+}
+
+/**
+ * Takes the first device not yet started whose hub and controller
+ * have room for it, waiting for one to finish if none do. Returns
+ * NULL once every device has been taken.
+ */
+static struct device_run *batch_take (void)
+{
+  struct device_run *run = NULL;
+  int i;
+
+  pthread_mutex_lock(&batch_lock);
+  while (!run && batch_next < batch_count) {
+    for (i = batch_next; i < batch_count && !run; i++) {
+      if (!batch_runs[i].started && sched_admit(&batch_runs[i]))
+        run = &batch_runs[i];
+    }
+    if (!run)
+      pthread_cond_wait(&batch_cond, &batch_lock);
+  }
+  if (run) {
+    run->started = true;
+    if (run->hub && !run->hub->active++ && !run->hub->since)
+      run->hub->since = ee_now_ns();
+    if (run->bus && !run->bus->active++ && !run->bus->since)
+      run->bus->since = ee_now_ns();
+    while (batch_next < batch_count && batch_runs[batch_next].started)
+      batch_next++;
+  }
+  pthread_mutex_unlock(&batch_lock);
+
+  return run;
+}
+static void *batch_worker (void *arg)
+{
+  struct device_run *run;
+
+  while ((run = batch_take())) {
+    program_path(run, arg);
+
+    pthread_mutex_lock(&batch_lock);
+    sched_finish(run->hub, run);
+    sched_finish(run->bus, run);
+    pthread_cond_broadcast(&batch_cond);
+    pthread_mutex_unlock(&batch_lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * Programs every matching device on a pool of --jobs worker threads,
+ * each with its own device handle, then prints a summary. Returns
+ * an exit status.
+ */
+static int program_all (int argc, char *argv[], struct eeprom_fields *ee)
+{
+  struct batch_args args = { argc, argv, ee };
+  pthread_t *threads;
+  int i, jobs, failed = 0;
+
+  if (save_path) {
+    fprintf(stderr, "--save cannot be used with --all\n");
+    return EINVAL;
+  }
+
+  batch_count = find_devices(ee, &batch_runs);
+  if (batch_count < 0)
+    return -batch_count;
+  if (batch_count == 0) {
+    fprintf(stderr, "No devices found for %04x:%04x\n",
+            ee->old_vid, ee->old_pid);
+    return ENODEV;
+  }
+
+  printf("Found %d devices. Program all of them? [y|n]:", batch_count);
+  if (getc(stdin) != 'y')
+    return 0;
+
+  /* Take the serial numbers for the whole batch in one go */
+  if (serial_template && (i = serial_assign(batch_runs, batch_count)) < 0)
+    return -i;
+
+  jobs = batch_jobs < batch_count ? batch_jobs : batch_count;
+  threads = calloc(jobs, sizeof(*threads));
+  if (!threads)
+    return ENOMEM;
+  for (i = 0; i < jobs; i++) {
+    if (pthread_create(&threads[i], NULL, batch_worker, &args)) {
+      jobs = i;
+      break;
+    }
+  }
+  if (jobs == 0) {
+    batch_worker(&args);
+  }
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  printf("\nBatch summary:\n");
+  for (i = 0; i < batch_count; i++) {
+    struct device_run *run = &batch_runs[i];
+
+    if (run->result == 0 && run->prechecked) {
+      printf("  %-12s PASS  %-20s already programmed\n", run->path,
+             run->serial);
+    } else if (run->result == 0 && reenum_timeout) {
+      printf("  %-12s PASS  %-20s %d words written, back in %ldms\n",
+             run->path, run->serial, run->words_written, run->reenum_ms);
+    } else if (run->result == 0) {
+      printf("  %-12s PASS  %-20s %d words written\n", run->path,
+             run->serial, run->words_written);
+    } else {
+      printf("  %-12s FAIL  %-20s %s\n", run->path, run->serial,
+             strerror(-run->result));
+      failed++;
+    }
+  }
+  printf("%d devices, %d passed, %d failed\n",
+         batch_count, batch_count - failed, failed);
+  if (retries_seen)
+    printf("%d rounds of transfers retried after transient errors\n",
+           retries_seen);
+  if (sched_count)
+    sched_print();
+  free(batch_runs);
+  free(sched_groups);
+  sched_groups = NULL;
+  sched_count = 0;
+
+  return failed ? EIO : 0;
+}
+
+/* ------------ Inventory ------------ */
+
+/* What a read-only scan learnt about one device */
+struct inventory_entry {
+  struct device_run run;
+  unsigned char eeprom[0x100];
+  bool have_eeprom;
+  bool crc_ok;
+  long elapsed_ms;
+};
+
+static struct inventory_entry *inventory;
+static int inventory_count, inventory_next;
+
+/**
+ * Opens and reads one device without writing to it, within
+ * inventory_timeout from start to finish. Each USB request times out
+ * at whatever is left of that, none is started once it has passed and
+ * none is retried, so a hung unit costs about one deadline rather than
+ * one timeout per word. A device that overran it is reported TIMEOUT,
+ * with whatever was read.
+ */
+static void inventory_device (struct inventory_entry *e)
+{
+  struct ee_device dev;
+  struct ee_options opts = options;
+  struct ee_xfer xfers[0x80];
+  long start = monotonic_ms();
+  int i, n = sizeof(e->eeprom)/2;
+  uint64_t t = timing_now();
+
+  opts.timeout = inventory_timeout;
+  opts.deadline = ee_now_ns() + inventory_timeout * 1000000ULL;
+  /* A retry would wait out the deadline again, so a hung device
+   * would hold its worker for several deadlines instead of one */
+  opts.retries = 0;
+  e->run.result = ee_open(&dev, &opts, e->run.path);
+  timing_phase(phase_open, &t);
+  if (e->run.result) {
+    if (verbose) {
+      fprintf(stderr, "%s: opening failed: %s\n",
+              e->run.path, ee_error(&dev));
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      xfers[i].addr = i;
+    }
+    if (ee_read_words(&dev, xfers, n) < 0) {
+      for (i = 0; i < n && xfers[i].status == 0; i++);
+      e->run.result = i < n && xfers[i].status == LIBUSB_ERROR_TIMEOUT ?
+        -ETIMEDOUT : -EIO;
+    } else {
+      for (i = 0; i < n; i++) {
+        ee_set_word(e->eeprom, i, xfers[i].val);
+      }
+      e->have_eeprom = true;
+      e->crc_ok = calc_crc_ftx(e->eeprom) == ee_get_word(e->eeprom, n - 1);
+      timing_phase(phase_read, &t);
+    }
+  }
+  e->elapsed_ms = monotonic_ms() - start;
+  if (e->elapsed_ms > inventory_timeout)
+    e->run.result = -ETIMEDOUT;
+  ee_close(&dev);
+}
+static void *inventory_worker (void *arg)
+{
+  for (;;) {
+    struct inventory_entry *e = NULL;
+
+    pthread_mutex_lock(&batch_lock);
+    if (inventory_next < inventory_count)
+      e = &inventory[inventory_next++];
+    pthread_mutex_unlock(&batch_lock);
+    if (!e)
+      break;
+
+    inventory_device(e);
+  }
+
+  return NULL;
+}
+static const char *inventory_status (struct inventory_entry *e)
+{
+  if (e->run.result == -ETIMEDOUT) return "TIMEOUT";
+  if (e->run.result) return "FAIL";
+  return e->crc_ok ? "OK" : "BADCRC";
+}
+static void inventory_print (struct inventory_entry *e)
+{
+  struct eeprom_fields ee;
+
+  if (!e->have_eeprom) {
+    printf("  %-12s %-7s %5ldms  %s\n", e->run.path, inventory_status(e),
+           e->elapsed_ms, strerror(-e->run.result));
+    return;
+  }
+
+  memset(&ee, 0, sizeof(ee));
+  ee_decode(&options, e->eeprom, sizeof(e->eeprom), &ee);
+  printf("  %-12s %-7s %5ldms  %04x:%04x  %-16s %-20s %s\n", e->run.path,
+         inventory_status(e), e->elapsed_ms, ee.usb_vid, ee.usb_pid,
+         ee.serial_string ? ee.serial_string : "",
+         ee.product_string ? ee.product_string : "",
+         ee.manufacturer_string ? ee.manufacturer_string : "");
+  free(ee.manufacturer_string);
+  free(ee.product_string);
+  free(ee.serial_string);
+}
+static int inventory_record (struct inventory_entry *e)
+{
+  struct json_buf j;
+
+  json_begin(&j, output_format == format_json);
+  json_string(&j, "device", e->run.path);
+  json_string(&j, "status", inventory_status(e));
+  json_uint(&j, "elapsed_ms", e->elapsed_ms);
+  if (e->have_eeprom) {
+    json_eeprom(&j, e->eeprom, sizeof(e->eeprom));
+  } else {
+    json_string(&j, "error", strerror(-e->run.result));
+  }
+  return json_end(&j);
+}
+/**
+ * Reads every matching device on a pool of --jobs threads, never
+ * writing, and prints one report once they have all finished or run
+ * out of time. Returns an exit status.
+ */
+static int inventory_scan (struct eeprom_fields *ee)
+{
+  struct device_run *runs;
+  pthread_t *threads;
+  int i, jobs, bad = 0;
+  long start = monotonic_ms();
+
+  inventory_count = find_devices(ee, &runs);
+  if (inventory_count < 0)
+    return -inventory_count;
+
+  inventory = calloc(inventory_count ? inventory_count : 1,
+                     sizeof(*inventory));
+  if (!inventory) {
+    free(runs);
+    return ENOMEM;
+  }
+  for (i = 0; i < inventory_count; i++) {
+    inventory[i].run = runs[i];
+  }
+  free(runs);
+
+  jobs = batch_jobs < inventory_count ? batch_jobs : inventory_count;
+  threads = calloc(jobs > 0 ? jobs : 1, sizeof(*threads));
+  for (i = 0; threads && i < jobs; i++) {
+    if (pthread_create(&threads[i], NULL, inventory_worker, NULL)) {
+      break;
+    }
+  }
+  jobs = threads ? i : 0;
+  inventory_worker(NULL);	/* and help out */
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  if (output_format == format_json)
+    record_write("[\n", 2);
+  else if (output_format == format_text && ee->find_any_ftx)
+    printf("\nInventory of every FT-X:\n");
+  else if (output_format == format_text)
+    printf("\nInventory of %04x:%04x:\n", ee->old_vid, ee->old_pid);
+  for (i = 0; i < inventory_count; i++) {
+    struct inventory_entry *e = &inventory[i];
+
+    if (output_format == format_text) {
+      inventory_print(e);
+    } else {
+      if (i && output_format == format_json)
+        record_write(",\n", 2);
+      inventory_record(e);
+    }
+    bad += e->run.result || !e->crc_ok;
+  }
+  if (output_format == format_json)
+    record_write("]\n", 2);
+  printf("%d devices read in %.2fs, %d with problems\n", inventory_count,
+         (monotonic_ms() - start) / 1e3, bad);
+  free(inventory);
+
+  return bad ? EIO : 0;
+}
+
+/* ------------ Hotplug Programming ------------ */
+
+#define HOTPLUG_QUEUE_LEN	64
+#define HOTPLUG_PORTS		64
+#define HOTPLUG_SETTLE_SECS	5	/* re-enumeration window after a reset */
+
+/* A physical port, identified by its bus and hub port chain */
+struct hotplug_port {
+  uint8_t bus;
+  uint8_t ports[7];
+  int depth;
+};
+struct hotplug_arrival {
+  struct hotplug_port port;
+  uint8_t addr;
+  bool check;			/* may be our own reset coming back */
+  libusb_device *dev;		/* referenced, if check */
+  struct ee_identity expect;	/* what it would come back as */
+};
+/* A port we are programming, or have recently reset */
+struct hotplug_recent {
+  struct hotplug_port port;
+  bool busy;
+  bool reenumerated;		/* came back while still busy */
+  time_t done;			/* when it was reset, or 0 */
+  struct ee_identity expect;	/* what it was reset with */
+};
+
+static struct hotplug_arrival hotplug_queue[HOTPLUG_QUEUE_LEN];
+static int hotplug_head, hotplug_tail;
+static struct hotplug_recent hotplug_recent[HOTPLUG_PORTS];
+static int hotplug_passed, hotplug_failed;
+static volatile sig_atomic_t hotplug_stop;
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cond = PTHREAD_COND_INITIALIZER;
+
+static time_t monotonic_secs (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+static bool hotplug_same_port (struct hotplug_port *a, struct hotplug_port *b)
+{
+  return a->bus == b->bus && a->depth == b->depth &&
+    memcmp(a->ports, b->ports, a->depth) == 0;
+}
+/**
+ * Claims the arrival's port for programming. Fails if the port is
+ * being programmed, in which case the arrival is the device coming
+ * back from a reset of its own. If the port was reset moments ago the
+ * arrival may be that device too, so it is claimed with the identity
+ * the device was reset with, for the worker to compare. Only one
+ * arrival per reset is treated like this. Call with hotplug_lock.
+ */
+static bool hotplug_claim_port (struct hotplug_arrival *arrival)
+{
+  struct hotplug_recent *free_slot = NULL, *oldest = NULL;
+  struct hotplug_port *port = &arrival->port;
+  time_t now = monotonic_secs();
+  int i;
+
+  for (i = 0; i < HOTPLUG_PORTS; i++) {
+    struct hotplug_recent *r = &hotplug_recent[i];
+
+    if (r->port.depth && hotplug_same_port(&r->port, port)) {
+      if (r->busy) {
+        r->reenumerated = true;
+        return false;
+      }
+      if (r->done && now - r->done < HOTPLUG_SETTLE_SECS) {
+        arrival->check = true;
+        arrival->expect = r->expect;
+      }
+      r->done = 0;
+      free_slot = r;
+      break;
+    }
+    if (!r->busy && (!oldest || r->done < oldest->done)) oldest = r;
+    if (!r->port.depth && !free_slot) free_slot = r;
+  }
+  if (!free_slot) free_slot = oldest;
+  if (!free_slot) return true;	/* every slot busy, just don't track it */
+
+  free_slot->port = *port;
+  free_slot->busy = true;
+  return true;
+}
+/**
+ * Frees a port once it has been programmed. If the device was reset
+ * as expect and has not come back yet, the next arrival on it in the
+ * next few seconds is checked against expect before being programmed.
+ */
+static void hotplug_release_port (struct hotplug_port *port,
+                                  struct ee_identity *expect)
+{
+  int i;
+
+  for (i = 0; i < HOTPLUG_PORTS; i++) {
+    struct hotplug_recent *r = &hotplug_recent[i];
+
+    if (r->busy && hotplug_same_port(&r->port, port)) {
+      r->busy = false;
+      r->done = expect && !r->reenumerated ? monotonic_secs() : 0;
+      r->reenumerated = false;
+      if (r->done)
+        r->expect = *expect;
+    }
+  }
+}
+
+/**
+ * Called from inside libusb_handle_events() when a matching device
+ * arrives. No I/O is allowed here, so just queue it for the workers.
+ */
+static int LIBUSB_CALL hotplug_arrived (libusb_context *ctx,
+                                        libusb_device *dev,
+                                        libusb_hotplug_event event,
+                                        void *user_data)
+{
+  struct hotplug_arrival arrival;
+  int depth;
+
+  memset(&arrival, 0, sizeof(arrival));
+  arrival.port.bus = libusb_get_bus_number(dev);
+  arrival.addr = libusb_get_device_address(dev);
+  depth = libusb_get_port_numbers(dev, arrival.port.ports,
+                                  sizeof(arrival.port.ports));
+  /* Root hub ports have no chain, make them distinct from empty slots */
+  arrival.port.depth = depth > 0 ? depth : 1;
+
+  pthread_mutex_lock(&hotplug_lock);
+  if ((hotplug_tail + 1) % HOTPLUG_QUEUE_LEN == hotplug_head) {
+    fprintf(stderr, "d:%03u/%03u: too many devices waiting, ignored\n",
+            arrival.port.bus, arrival.addr);
+  } else if (!hotplug_claim_port(&arrival)) {
+    if (verbose) {
+      printf("d:%03u/%03u: re-enumeration ignored\n",
+             arrival.port.bus, arrival.addr);
+    }
+  } else {
+    if (arrival.check)
+      arrival.dev = libusb_ref_device(dev);
+    hotplug_queue[hotplug_tail] = arrival;
+    hotplug_tail = (hotplug_tail + 1) % HOTPLUG_QUEUE_LEN;
+    pthread_cond_signal(&hotplug_cond);
+  }
+  pthread_mutex_unlock(&hotplug_lock);
+
+  return 0;
+}
+
+static void *hotplug_worker (void *arg)
+{
+  for (;;) {
+    struct hotplug_arrival arrival;
+    struct device_run run;
+    struct ee_identity found, reset_as;
+    bool ours;
+
+    pthread_mutex_lock(&hotplug_lock);
+    while (!hotplug_stop && hotplug_head == hotplug_tail)
+      pthread_cond_wait(&hotplug_cond, &hotplug_lock);
+    if (hotplug_stop) {
+      pthread_mutex_unlock(&hotplug_lock);
+      break;
+    }
+    arrival = hotplug_queue[hotplug_head];
+    hotplug_head = (hotplug_head + 1) % HOTPLUG_QUEUE_LEN;
+    pthread_mutex_unlock(&hotplug_lock);
+
+    memset(&run, 0, sizeof(run));
+    snprintf(run.path, sizeof(run.path), "d:%03u/%03u",
+             arrival.port.bus, arrival.addr);
+
+    /* A unit showing what its port was just reset with is that unit */
+    if (arrival.check) {
+      ours = ee_identity_read(arrival.dev, &found) == 0 &&
+        ee_identity_matches(&arrival.expect, &found);
+      libusb_unref_device(arrival.dev);
+      if (ours) {
+        if (verbose)
+          printf("%s: re-enumeration ignored\n", run.path);
+        pthread_mutex_lock(&hotplug_lock);
+        hotplug_release_port(&arrival.port, NULL);
+        pthread_mutex_unlock(&hotplug_lock);
+        continue;
+      }
+    }
+
+    run.reset_as = &reset_as;
+    if (serial_template && (run.result = serial_assign(&run, 1)) < 0) {
+      /* Nothing to program it with */
+    } else {
+      program_path(&run, arg);
+    }
+
+    if (run.result == 0 && run.prechecked) {
+      printf("%s: PASS  %s  already programmed\n", run.path, run.serial);
+    } else if (run.result == 0) {
+      printf("%s: PASS  %s  %d words written\n", run.path, run.serial,
+             run.words_written);
+    } else {
+      printf("%s: FAIL  %s  %s\n", run.path, run.serial,
+             strerror(-run.result));
+    }
+    fflush(stdout);
+
+    pthread_mutex_lock(&hotplug_lock);
+    hotplug_release_port(&arrival.port, run.reset ? &reset_as : NULL);
+    if (run.result == 0) hotplug_passed++; else hotplug_failed++;
+    pthread_mutex_unlock(&hotplug_lock);
+  }
+
+  return NULL;
+}
+
+static void hotplug_signal (int sig)
+{
+  hotplug_stop = 1;
+}
+
+/**
+ * Waits for matching devices to be plugged in and programs each one
+ * as it arrives, until interrupted. Returns an exit status.
+ */
+static int program_hotplug (int argc, char *argv[], struct eeprom_fields *ee)
+{
+  struct batch_args args = { argc, argv, ee };
+  libusb_hotplug_callback_handle handle;
+  libusb_context *ctx;
+  pthread_t *threads;
+  int i, jobs = 0, ret;
+
+  if (save_path) {
+    fprintf(stderr, "--save cannot be used with --hotplug\n");
+    return EINVAL;
+  }
+  if ((ret = libusb_init(&ctx)) != 0) {
+    fprintf(stderr, "libusb_init() failed: %s\n", libusb_error_name(ret));
+    return EIO;
+  }
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    fprintf(stderr, "This libusb does not support hotplug\n");
+    libusb_exit(ctx);
+    return ENOTSUP;
+  }
+  ret = libusb_hotplug_register_callback(ctx,
+                                         LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                         LIBUSB_HOTPLUG_ENUMERATE,
+                                         ee->old_vid, ee->old_pid,
+                                         LIBUSB_HOTPLUG_MATCH_ANY,
+                                         hotplug_arrived, NULL, &handle);
+  if (ret != 0) {
+    fprintf(stderr, "libusb_hotplug_register_callback() failed: %s\n",
+            libusb_error_name(ret));
+    libusb_exit(ctx);
+    return EIO;
+  }
+
+  signal(SIGINT, hotplug_signal);
+  signal(SIGTERM, hotplug_signal);
+
+  threads = calloc(batch_jobs, sizeof(*threads));
+  for (i = 0; threads && i < batch_jobs; i++) {
+    if (pthread_create(&threads[i], NULL, hotplug_worker, &args))
+      break;
+    jobs++;
+  }
+  if (jobs == 0) {
+    fprintf(stderr, "Failed to start worker threads\n");
+    hotplug_stop = 1;
+  }
+
+  printf("Waiting for %04x:%04x devices, press Ctrl-C to stop\n",
+         ee->old_vid, ee->old_pid);
+  fflush(stdout);
+  while (!hotplug_stop) {
+    struct timeval tv = { 1, 0 };
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  }
+
+  pthread_mutex_lock(&hotplug_lock);
+  pthread_cond_broadcast(&hotplug_cond);
+  pthread_mutex_unlock(&hotplug_lock);
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  for (; hotplug_head != hotplug_tail;
+       hotplug_head = (hotplug_head + 1) % HOTPLUG_QUEUE_LEN) {
+    if (hotplug_queue[hotplug_head].check)
+      libusb_unref_device(hotplug_queue[hotplug_head].dev);
+  }
+
+  libusb_hotplug_deregister_callback(ctx, handle);
+  libusb_exit(ctx);
+
+  printf("\n%d devices programmed, %d failed\n", hotplug_passed + hotplug_failed,
+         hotplug_failed);
+  return hotplug_failed ? EIO : 0;
+}
+
+/* ------------ Daemon ------------ */
+
+#define DAEMON_DEVICES	256
+#define DAEMON_LINE_MAX	1024
+
+/**
+ * A device the daemon has seen. Entries are only ever added, so a
+ * pointer to one stays good, and the handle is kept open between
+ * requests so that each only costs its USB transfers.
+ */
+struct daemon_device {
+  char path[64];
+  bool present;			/* in the last scan */
+  bool open;
+  struct ee_device dev;
+  pthread_mutex_t lock;		/* one request at a time */
+};
+
+/* A connection, on its own thread, listed until the thread ends */
+struct daemon_client {
+  int fd;
+  struct batch_args *args;
+  struct daemon_client *next;
+};
+
+static struct daemon_device daemon_devices[DAEMON_DEVICES];
+static int daemon_count;
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t daemon_stop;
+static struct daemon_client *daemon_clients;
+static pthread_mutex_t daemon_client_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t daemon_client_gone = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Rescans for devices, adding any new paths. Returns the number
+ * present, or a negative errno.
+ */
+static int daemon_scan (struct eeprom_fields *ee)
+{
+  struct device_run *runs;
+  int i, j, n;
+
+  if ((n = find_devices(ee, &runs)) < 0)
+    return n;
+
+  pthread_mutex_lock(&daemon_lock);
+  for (j = 0; j < daemon_count; j++) {
+    daemon_devices[j].present = false;
+  }
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < daemon_count; j++) {
+      if (strcmp(daemon_devices[j].path, runs[i].path) == 0)
+        break;
+    }
+    if (j == daemon_count) {
+      if (daemon_count == DAEMON_DEVICES)
+        continue;
+      memcpy(daemon_devices[j].path, runs[i].path, sizeof(runs[i].path));
+      pthread_mutex_init(&daemon_devices[j].lock, NULL);
+      daemon_count++;
+    }
+    daemon_devices[j].present = true;
+  }
+  pthread_mutex_unlock(&daemon_lock);
+  free(runs);
+
+  return n;
+}
+/**
+ * Finds a device by path, or the first one present for "-", scanning
+ * again if it isn't known yet. Returns it locked, or NULL.
+ */
+static struct daemon_device *daemon_get (const char *path,
+                                         struct eeprom_fields *ee)
+{
+  struct daemon_device *d = NULL;
+  int i, pass;
+
+  for (pass = 0; pass < 2 && !d; pass++) {
+    if (pass > 0 && daemon_scan(ee) < 0)
+      break;
+    pthread_mutex_lock(&daemon_lock);
+    for (i = 0; i < daemon_count && !d; i++) {
+      if (strcmp(path, "-") ? strcmp(path, daemon_devices[i].path) == 0 :
+          daemon_devices[i].present) {
+        d = &daemon_devices[i];
+      }
+    }
+    pthread_mutex_unlock(&daemon_lock);
+  }
+  if (!d)
+    return NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if (!d->open) {
+    if (ee_open(&d->dev, &options, d->path) == 0) {
+      d->open = true;
+    } else {
+      ee_close(&d->dev);
+    }
+  }
+  if (!d->open) {
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+  }
+  return d;
+}
+/**
+ * Closes a handle that failed, so that the next request opens the
+ * device afresh
+ */
+static void daemon_drop (struct daemon_device *d)
+{
+  ee_close(&d->dev);
+  d->open = false;
+}
+static void daemon_reply (int fd, int ret, const char *fmt, ...)
+{
+  char buf[DAEMON_LINE_MAX];
+  int len;
+
+  if (ret < 0) {
+    len = snprintf(buf, sizeof(buf), "ERR %d %s\n", -ret, strerror(-ret));
+  } else {
+    va_list ap;
+
+    len = snprintf(buf, sizeof(buf), "OK");
+    va_start(ap, fmt);
+    len += vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
+    va_end(ap);
+    len += snprintf(buf + len, sizeof(buf) - len, "\n");
+  }
+  fd_write(fd, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+/**
+ * Reads a device's image, retrying once on a fresh handle in case the
+ * one we kept has gone stale. A bad CRC still fills in eeprom.
+ */
+static int daemon_read (struct daemon_device *d, unsigned char *eeprom)
+{
+  int ret = ee_read_and_verify(&d->dev, eeprom, 0x100);
+
+  if (ret == -EIO) {
+    daemon_drop(d);
+    if (ee_open(&d->dev, &options, d->path) != 0) {
+      ee_close(&d->dev);
+      return -ENODEV;
+    }
+    d->open = true;
+    ret = ee_read_and_verify(&d->dev, eeprom, 0x100);
+  }
+  return ret;
+}
+
+static void daemon_dump (int fd, struct daemon_device *d)
+{
+  unsigned char eeprom[0x100];
+  struct json_buf j;
+  int ret = daemon_read(d, eeprom);
+
+  if (ret < 0 && ret != -EINVAL) {
+    daemon_reply(fd, ret, NULL);
+    return;
+  }
+  json_begin(&j, false);
+  json_string(&j, "device", d->path);
+  json_eeprom(&j, eeprom, sizeof(eeprom));
+  json_raw(&j, "}\n");
+  fd_write(fd, j.buf, j.len);
+  daemon_reply(fd, 0, "");
+}
+/**
+ * Sets up run and the arguments for building a device's image, adding
+ * the serial number from the request, if any, to the daemon's own.
+ * Returns the argument count, or a negative errno.
+ */
+static int daemon_args (struct daemon_device *d, struct batch_args *args,
+                        const char *serial, struct device_run *run,
+                        char ***argv)
+{
+  int argc = args->argc, ret;
+
+  memset(run, 0, sizeof(*run));
+  snprintf(run->path, sizeof(run->path), "%s", d->path);
+
+  if (!(*argv = calloc(argc + 3, sizeof(**argv))))
+    return -ENOMEM;
+  memcpy(*argv, args->argv, argc * sizeof(**argv));
+  if (serial) {
+    /* A serial number in the request beats --serial-template */
+    (*argv)[argc++] = "--new-serial-number";
+    (*argv)[argc++] = (char *)serial;
+    snprintf(run->serial, sizeof(run->serial), "%s", serial);
+  } else if (serial_template && (ret = serial_assign(run, 1)) < 0) {
+    free(*argv);
+    return ret;
+  }
+  return argc;
+}
+/**
+ * Checks that a device holds what PROGRAM would write to it. With
+ * --serial-template and no serial number in the request, the one the
+ * device already has is expected.
+ */
+static void daemon_verify (int fd, struct daemon_device *d,
+                           struct batch_args *args, const char *serial)
+{
+  unsigned char old[0x100], new[0x100];
+  struct device_run run;
+  struct ee_identity id;
+  char words[DAEMON_LINE_MAX] = "", **argv = NULL;
+  int i, ret, argc, len = 0;
+
+  if ((ret = daemon_read(d, old)) < 0 && ret != -EINVAL) {
+    daemon_reply(fd, ret, NULL);
+    return;
+  }
+  if (!serial && serial_template) {
+    ee_identity_from_image(&options, old, &id);
+    serial = id.strings_known ? id.serial : "";
+  }
+  if ((ret = argc = daemon_args(d, args, serial, &run, &argv)) < 0 ||
+      (ret = ee_build_image(&run, argc, argv, *args->ee,
+                            old, new, sizeof(old))) < 0) {
+    free(argv);
+    daemon_reply(fd, ret, NULL);
+    return;
+  }
+  free(argv);
+
+  for (i = 0; i < sizeof(old)/2 && len < sizeof(words) - 8; i++) {
+    if (ee_get_word(old, i) != ee_get_word(new, i) && ee_word_writable(i))
+      len += snprintf(words + len, sizeof(words) - len, " 0x%02x", i);
+  }
+  if (len) {
+    char buf[DAEMON_LINE_MAX + 32];
+
+    len = snprintf(buf, sizeof(buf), "ERR %d differs at words%s\n",
+                   EIO, words);
+    fd_write(fd, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+  } else {
+    daemon_reply(fd, 0, " %s", run.serial);
+  }
+}
+static void daemon_program (int fd, struct daemon_device *d,
+                            struct batch_args *args, const char *serial)
+{
+  struct device_run run;
+  char **argv;
+  int argc, ret;
+
+  if ((ret = argc = daemon_args(d, args, serial, &run, &argv)) >= 0) {
+    run_phase_ns = run.phase_ns;
+    ret = run.result = program_device(&d->dev, &run, argc, argv, *args->ee);
+    free(argv);
+    ledger_append(&run);
+    run_phase_ns = NULL;
+  }
+  /* The device has been reset, so it comes back under a new path */
+  daemon_drop(d);
+  d->present = false;
+  if (ret < 0) {
+    daemon_reply(fd, ret, NULL);
+  } else {
+    daemon_reply(fd, 0, " %d %s", run.words_written, run.serial);
+  }
+}
+static void daemon_save (int fd, struct daemon_device *d, const char *file)
+{
+  unsigned char eeprom[0x100];
+  int ret = daemon_read(d, eeprom);
+
+  if (ret >= 0 || ret == -EINVAL)
+    ret = save_eeprom_to_file(file, eeprom, sizeof(eeprom));
+  daemon_reply(fd, ret, "");
+}
+/**
+ * Carries out one request line, see the README for the protocol
+ */
+static void daemon_request (int fd, int n, char **tok, struct batch_args *args)
+{
+  struct daemon_device *d;
+  int i;
+
+  if (strcmp(tok[0], "LIST") == 0) {
+    if ((n = daemon_scan(args->ee)) < 0) {
+      daemon_reply(fd, n, NULL);
+      return;
+    }
+    pthread_mutex_lock(&daemon_lock);
+    for (i = 0; i < daemon_count; i++) {
+      if (daemon_devices[i].present) {
+        fd_write(fd, daemon_devices[i].path, strlen(daemon_devices[i].path));
+        fd_write(fd, "\n", 1);
+      }
+    }
+    pthread_mutex_unlock(&daemon_lock);
+    daemon_reply(fd, 0, " %d", n);
+    return;
+  }
+
+  if (strcmp(tok[0], "DUMP") && strcmp(tok[0], "VERIFY") &&
+      strcmp(tok[0], "PROGRAM") && strcmp(tok[0], "SAVE")) {
+    daemon_reply(fd, -EINVAL, NULL);
+    return;
+  }
+  if (strcmp(tok[0], "SAVE") == 0 && n < 3) {
+    daemon_reply(fd, -EINVAL, NULL);
+    return;
+  }
+  if (!(d = daemon_get(n > 1 ? tok[1] : "-", args->ee))) {
+    daemon_reply(fd, -ENODEV, NULL);
+    return;
+  }
+
+  if (strcmp(tok[0], "DUMP") == 0) {
+    daemon_dump(fd, d);
+  } else if (strcmp(tok[0], "VERIFY") == 0) {
+    daemon_verify(fd, d, args, n > 2 ? tok[2] : NULL);
+  } else if (strcmp(tok[0], "PROGRAM") == 0) {
+    daemon_program(fd, d, args, n > 2 ? tok[2] : NULL);
+  } else {
+    daemon_save(fd, d, tok[2]);
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+static void *daemon_client (void *arg)
+{
+  struct daemon_client *c = arg, **p;
+  FILE *in = fdopen(c->fd, "r");
+  char line[DAEMON_LINE_MAX];
+
+  while (in && !daemon_stop && fgets(line, sizeof(line), in)) {
+    char *tok[4], *save;
+    int n = 0;
+
+    for (tok[n] = strtok_r(line, " \t\r\n", &save); tok[n] && n < 3; )
+      tok[++n] = strtok_r(NULL, " \t\r\n", &save);
+    if (tok[n]) n++;
+    if (n == 0)
+      continue;
+    if (strcmp(tok[0], "QUIT") == 0)
+      break;
+    if (verbose) printf("request: %s %s\n", tok[0], n > 1 ? tok[1] : "");
+    daemon_request(c->fd, n, tok, c->args);
+  }
+
+  pthread_mutex_lock(&daemon_client_lock);
+  for (p = &daemon_clients; *p != c; p = &(*p)->next);
+  *p = c->next;
+  pthread_cond_broadcast(&daemon_client_gone);
+  pthread_mutex_unlock(&daemon_client_lock);
+
+  if (in) fclose(in); else close(c->fd);
+  free(c);
+  return NULL;
+}
+
+static void daemon_signal (int sig)
+{
+  daemon_stop = 1;
+}
+/**
+ * Lets each connection finish the request it is on, then waits for
+ * its thread to end. Stopping the reading side makes an idle
+ * connection see the end of its input, while replies still go out.
+ */
+static void daemon_wait_clients (void)
+{
+  struct daemon_client *c;
+
+  pthread_mutex_lock(&daemon_client_lock);
+  for (c = daemon_clients; c; c = c->next) {
+    shutdown(c->fd, SHUT_RD);
+  }
+  while (daemon_clients)
+    pthread_cond_wait(&daemon_client_gone, &daemon_client_lock);
+  pthread_mutex_unlock(&daemon_client_lock);
+}
+
+/**
+ * Serves DUMP, VERIFY, PROGRAM and SAVE requests on a Unix socket,
+ * keeping device handles open between them, until interrupted.
+ * PROGRAM and VERIFY use the value-change arguments the daemon was
+ * started with. Returns an exit status.
+ */
+static int run_daemon (const char *path, int argc, char *argv[],
+                       struct eeprom_fields *ee)
+{
+  struct batch_args args = { argc, argv, ee };
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct stat sb;
+  sigset_t stop_signals, old_mask;
+  int i, fd, n;
+
+  if (save_path || restore_path) {
+    fprintf(stderr, "--save and --restore cannot be used with --daemon\n");
+    return EINVAL;
+  }
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return ENAMETOOLONG;
+  }
+  batch_mode = true;		/* nobody to ask */
+  ee_templates = false;		/* serial numbers come per request */
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+    unlink(path);		/* left over from a daemon that died */
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 16) == -1) {
+    perror(path);
+    return errno;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = daemon_signal;	/* no SA_RESTART, to break accept() */
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  /* Only this thread takes them, so that they always break accept() */
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+
+  n = daemon_scan(ee);
+  printf("Listening on %s, %d devices found\n", path, n < 0 ? 0 : n);
+  fflush(stdout);
+
+  while (!daemon_stop) {
+    struct daemon_client *c;
+    pthread_t thread;
+    int client = accept(fd, NULL, NULL);
+
+    if (client == -1) {
+      if (errno != EINTR) perror("accept");
+      continue;
+    }
+    if (!(c = malloc(sizeof(*c)))) {
+      close(client);
+      continue;
+    }
+    c->fd = client;
+    c->args = &args;
+    pthread_mutex_lock(&daemon_client_lock);
+    c->next = daemon_clients;
+    daemon_clients = c;
+    pthread_mutex_unlock(&daemon_client_lock);
+
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+    if (pthread_create(&thread, NULL, daemon_client, c)) {
+      pthread_mutex_lock(&daemon_client_lock);
+      daemon_clients = c->next;	/* nobody else adds to the list */
+      pthread_mutex_unlock(&daemon_client_lock);
+      close(client);
+      free(c);
+    } else {
+      pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  }
+
+  close(fd);
+  unlink(path);
+  daemon_wait_clients();
+  for (i = 0; i < daemon_count; i++) {
+    pthread_mutex_lock(&daemon_devices[i].lock);
+    if (daemon_devices[i].open)
+      daemon_drop(&daemon_devices[i]);
+  }
+  return 0;
+}
+
+/* ------------ Offline Audit ------------ */
+
+#define AUDIT_CHUNK	64	/* files claimed by a worker at once */
+
+static char **audit_files;
+static int audit_count, audit_alloc, audit_next, audit_bad;
+static pthread_mutex_t audit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int audit_collect (const char *path, const struct stat *sb,
+                          int type, struct FTW *ftw)
+{
+  if (type != FTW_F)
+    return 0;
+
+  if (audit_count == audit_alloc) {
+    char **files;
+
+    audit_alloc = audit_alloc ? audit_alloc * 2 : 1024;
+    files = realloc(audit_files, audit_alloc * sizeof(*audit_files));
+    if (!files)
+      return -1;
+    audit_files = files;
+  }
+  if (!(audit_files[audit_count] = strdup(path)))
+    return -1;
+  audit_count++;
+
+  return 0;
+}
+/**
+ * Decodes a saved image the way --dump does and checks it for a bad
+ * CRC, string descriptors outside the string area and unknown CBUS
+ * modes, appending a description of any problems to msg, and the
+ * serial number if there were any. Returns the number of problems.
+ */
+static int ee_audit_image (unsigned char *eeprom, char *msg, size_t size)
+{
+  unsigned short crc = calc_crc_ftx(eeprom), actual = ee_get_word(eeprom, 0x7F);
+  struct eeprom_fields ee;
+  const struct ee_field *f;
+  size_t used = strlen(msg);
+  unsigned int v;
+  int problems = 0;
+
+#define AUDIT_MSG(...) do {						\
+    if (used < size)							\
+      used += snprintf(msg + used, size - used, __VA_ARGS__);		\
+    problems++;								\
+  } while (0)
+
+  memset(&ee, 0, sizeof(ee));
+  ee_decode(&options, eeprom, 0x100, &ee);
+
+  if (crc != actual)
+    AUDIT_MSG(" bad CRC (0x%04x, expected 0x%04x);", actual, crc);
+
+  for (f = ee_fields; f < ee_fields + ee_field_count; f++) {
+    unsigned char *p = eeprom + f->offset;
+
+    switch (f->format) {
+    case ee_format_string:
+      /* The decoder clips a stray descriptor to the image, so it is
+       * the descriptor itself that says whether it is sound */
+      if (p[1] && (p[0] < 0xA0 || p[0] + p[1] > 0xFE)) {
+        AUDIT_MSG(" %s string at 0x%02x+%d outside the string area;",
+                  f->label, p[0], p[1]);
+      }
+      break;
+    case ee_format_cbus:
+      if ((v = ee_field_get(&ee, f)) >= _cbus_mode_end)
+        AUDIT_MSG(" %s mode %u unknown;", f->label, v);
+      break;
+    default:
+      break;
+    }
+  }
+#undef AUDIT_MSG
+
+  /* Only to name the unit */
+  if (problems && ee.serial_string && ee.serial_string[0] && used < size)
+    snprintf(msg + used, size - used, " serial %s;", ee.serial_string);
+
+  free(ee.manufacturer_string);
+  free(ee.product_string);
+  free(ee.serial_string);
+
+  return problems;
+}
+static void audit_file (const char *path)
+{
+  unsigned char *eeprom;
+  struct stat sb;
+  char msg[512] = "";
+  int fd, problems;
+
+  if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+    snprintf(msg, sizeof(msg), " %s;", strerror(errno));
+    problems = 1;
+  } else if (sb.st_size != 0x100) {
+    snprintf(msg, sizeof(msg), " wrong size, %lld/%d bytes;",
+             (long long)sb.st_size, 0x100);
+    problems = 1;
+  } else if ((eeprom = mmap(NULL, 0x100, PROT_READ, MAP_PRIVATE, fd, 0))
+             == MAP_FAILED) {
+    snprintf(msg, sizeof(msg), " mmap: %s;", strerror(errno));
+    problems = 1;
+  } else {
+    problems = ee_audit_image(eeprom, msg, sizeof(msg));
+    munmap(eeprom, 0x100);
+  }
+  if (fd != -1)
+    close(fd);
+
+  if (problems) {
+    /* Unless cut short, the message ends in a ';' */
+    if (msg[strlen(msg) - 1] == ';')
+      msg[strlen(msg) - 1] = '\0';
+    pthread_mutex_lock(&audit_lock);
+    printf("%s:%s\n", path, msg);
+    audit_bad++;
+    pthread_mutex_unlock(&audit_lock);
+  }
+}
+static void *audit_worker (void *arg)
+{
+  for (;;) {
+    int i, first, last;
+
+    pthread_mutex_lock(&audit_lock);
+    first = audit_next;
+    audit_next = last = first + AUDIT_CHUNK < audit_count ?
+      first + AUDIT_CHUNK : audit_count;
+    pthread_mutex_unlock(&audit_lock);
+    if (first == last)
+      break;
+
+    for (i = first; i < last; i++) {
+      audit_file(audit_files[i]);
+      free(audit_files[i]);
+    }
+  }
+
+  return NULL;
+}
+/**
+ * Checks every file under a directory as a saved eeprom image, using
+ * a worker thread per CPU. Needs no device. Returns an exit status.
+ */
+static int audit_dumps (const char *dir)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct timespec start, end;
+  pthread_t *threads;
+  int i, jobs = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (nftw(dir, audit_collect, 64, FTW_PHYS) != 0) {
+    perror(dir);
+    return errno ? errno : ENOMEM;
+  }
+
+  threads = calloc(cpus > 0 ? cpus : 1, sizeof(*threads));
+  for (i = 0; threads && i < (cpus > 0 ? cpus : 1); i++) {
+    if (pthread_create(&threads[i], NULL, audit_worker, NULL))
+      break;
+    jobs++;
+  }
+  audit_worker(NULL);		/* and help out */
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  free(audit_files);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%d files audited in %.2fs, %d bad\n", audit_count,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         audit_bad);
+  return audit_bad ? EINVAL : 0;
+}
+
+/* ------------ Benchmarks ------------ */
+
+#define BENCH_SECONDS	1.0	/* minimum run time of each dump benchmark */
+#define BENCH_UNITS	64	/* simulated devices programmed with --all */
+#define BENCH_LATENCY	1000	/* us per transfer, about a 1ms USB frame */
+#define BENCH_FIXTURE	28	/* devices on four 7-port hubs */
+#define BENCH_CONTENTION	2	/* rounds a fixture hub carries at once */
+
+static double bench_secs (void)
+{
+  return ee_now_ns() / 1e9;
+}
+/**
+ * Formats a hex dump or a settings dump into /dev/null. Returns dumps
+ * per second.
+ */
+static double bench_dump (bool settings)
+{
+  struct eeprom_fields ee;
+  unsigned char eeprom[0x100];
+  double start, elapsed;
+  unsigned long n = 0;
+  int saved = dup(1), null = open("/dev/null", O_WRONLY);
+
+  memset(&ee, 0, sizeof(ee));
+  ee.usb_vid = 0x0403;
+  ee.usb_pid = 0x6015;
+  ee.max_power = 45;
+  ee.manufacturer_string = "FTDI";
+  ee.product_string = "FT230X Basic UART";
+  ee.serial_string = "DN00ABCD";
+  ee_encode(&options, eeprom, sizeof(eeprom), &ee);
+  fflush(stdout);
+  dup2(null, 1);
+  start = bench_secs();
+  do {
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+      if (settings) {
+        ee_dump(&ee);
+      } else {
+        dumpmem("eeprom", eeprom, sizeof(eeprom));
+      }
+    }
+    n += i;
+  } while ((elapsed = bench_secs() - start) < BENCH_SECONDS);
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+  close(null);
+
+  return n / elapsed;
+}
+/**
+ * Programs units simulated devices with a new product string the way
+ * --all does, scheduler included, on jobs threads. Returns units per
+ * minute, or 0 if any failed.
+ */
+static double bench_all (int units, int jobs)
+{
+  static char *argv[] = { "ftx_prog", "--product", "Bench Widget", NULL };
+  struct eeprom_fields ee;
+  struct batch_args args = { 3, argv, &ee };
+  pthread_t threads[256];
+  double start;
+  int i, failed = 0;
+
+  transport = transport_sim;
+  sim_count = units;
+  sim_latency_us = BENCH_LATENCY;
+  batch_mode = true;
+  ee_sim_free(sim_bus);
+  sim_bus = NULL;
+  if (options_init() < 0)
+    return 0;
+
+  memset(&ee, 0, sizeof(ee));
+  ee.old_vid = 0x0403;
+  ee.old_pid = 0x6015;
+
+  start = bench_secs();
+  batch_count = find_devices(&ee, &batch_runs);
+  batch_next = 0;
+  jobs = jobs < batch_count ? jobs : batch_count;
+  for (i = 0; i < jobs && i < 256; i++) {
+    if (pthread_create(&threads[i], NULL, batch_worker, &args))
+      break;
+  }
+  jobs = i;
+  batch_worker(&args);
+  for (i = 0; i < jobs; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  for (i = 0; i < batch_count; i++) {
+    failed += batch_runs[i].result != 0;
+  }
+  free(batch_runs);
+  free(sched_groups);
+  sched_groups = NULL;
+  sched_count = 0;
+  if (failed || batch_count != units) {
+    fprintf(stderr, "bench: %d of %d units failed\n", failed, batch_count);
+    return 0;
+  }
+
+  return batch_count * 60 / (bench_secs() - start);
+}
+/**
+ * Measures what only ftx_prog itself does: formatting the dumps and
+ * programming simulated devices with --all, first 64 units at 1ms a
+ * transfer, then a fixture of four 7-port hubs that each carry two
+ * rounds at once, without and with --hub-jobs. ftx_bench measures the
+ * library underneath. Writes the results to path as a json object and
+ * returns an exit status.
+ */
+static int bench_run (const char *path)
+{
+  struct {
+    const char *key;		/* stable name in the results file */
+    const char *unit;
+    double value;
+  } results[] = {
+    { "dumpmem_per_sec", "dumps/s" },
+    { "ee_dump_per_sec", "dumps/s" },
+    { "all_units_per_min", "units/min" },
+    { "all_fixture_units_per_min", "units/min" },
+    { "all_fixture_sched_units_per_min", "units/min" },
+  };
+  struct json_buf j;
+  int i, fd, ret;
+
+  results[0].value = bench_dump(false);
+  results[1].value = bench_dump(true);
+  results[2].value = bench_all(BENCH_UNITS, batch_jobs);
+  sim_contention = BENCH_CONTENTION;
+  /* A job for every port, so the hubs are as busy as they get */
+  results[3].value = bench_all(BENCH_FIXTURE, BENCH_FIXTURE);
+  hub_jobs = 7;		/* up to a whole hub */
+  results[4].value = bench_all(BENCH_FIXTURE, BENCH_FIXTURE);
+
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    perror(path);
+    return errno;
+  }
+  record_fd = fd;
+  json_begin(&j, true);
+  json_string(&j, "version", MYVERSION);
+  for (i = 0; i < sizeof(results)/sizeof(results[0]); i++) {
+    json_key(&j, results[i].key);
+    json_raw(&j, "%.1f", results[i].value);
+    printf("%-32s %14.1f %s\n", results[i].key, results[i].value,
+           results[i].unit);
+  }
+  json_uint(&j, "all_units", BENCH_UNITS);
+  json_uint(&j, "all_latency_us", BENCH_LATENCY);
+  json_uint(&j, "all_jobs", batch_jobs);
+  json_uint(&j, "all_queue_depth", queue_depth);
+  json_uint(&j, "fixture_units", BENCH_FIXTURE);
+  json_uint(&j, "fixture_contention", BENCH_CONTENTION);
+
+  ret = json_end(&j);
+  close(fd);
+  if (ret < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+    return -ret;
+  }
+  printf("Results written to %s\n", path);
+  return 0;
+}
+
+/* ------------ Main ------------ */
+
+static struct ee_device device;
+
+static void do_close (void)
+{
+  ee_close(&device);
+}
+
+int main (int argc, char *argv[])
+{
+  const char *slash;
+  struct device_run run;
+  struct eeprom_fields ee;
+  int ret;
+  uint64_t t;
+
+  myname = argv[0];
+  slash = strrchr(myname, '/');
+  if (slash)
+    myname = slash + 1;
+
+  if (argc < 2) {
+    show_banner(stdout);
+    show_help(stdout);
+    exit(0);
+  }
+
+  memset(&ee, 0, sizeof(ee));
+  ee.old_vid = 0x0403;	/* default; override with --old_vid arg */
+  ee.old_pid = 0x6015;	/* default; override with --old_pid arg */
+  if (process_args(argc, argv, &ee)) { /* handle --help and --old-* args */
+    return -1;
+  }
+  if ((ret = options_init()) < 0)
+    return -ret;
+
+  /* json records own stdout, so everything else goes to stderr */
+  if (output_format != format_text) {
+    fflush(stdout);
+    record_fd = dup(1);
+    dup2(2, 1);
+  }
+  show_banner(stdout);
+  if (timing_enabled)
+    atexit(&timing_report);
+  if (bench_path)
+    return bench_run(bench_path);
+
+  if (!archive_path && (archive_save || archive_restore_serial || archive_list)) {
+    fprintf(stderr, "--archive-save, --archive-restore and --archive-list"
+            " need an --archive\n");
+    return EINVAL;
+  }
+  if (archive_path && (ret = archive_open(archive_path)) < 0)
+    return -ret;
+  if (archive_list)
+    return archive_print();
+  if (ledger_report_minutes >= 0) {
+    if (!ledger_path) {
+      fprintf(stderr, "--ledger-report needs a --ledger\n");
+      return EINVAL;
+    }
+    return -ledger_report(ledger_path, ledger_report_minutes);
+  }
+  if (ledger_path && (ret = ledger_open(ledger_path)) < 0)
+    return -ret;
+  if ((user_read_path || user_write_path) &&
+      (batch_mode || daemon_path || audit_path || inventory_mode)) {
+    fprintf(stderr, "--user-read and --user-write work on one device\n");
+    return EINVAL;
+  }
+  if (daemon_path)
+    return run_daemon(daemon_path, argc, argv, &ee);
+  if (audit_path)
+    return audit_dumps(audit_path);
+  if (inventory_mode) {
+    /* A unit may have been given any VID/PID, so look for them all */
+    ee.find_any_ftx = !old_id_given;
+    return inventory_scan(&ee);
+  }
+  if (hotplug_mode && transport == transport_sim) {
+    fprintf(stderr, "--hotplug needs --transport libftdi or libusb\n");
+    return EINVAL;
+  }
+  if (hotplug_mode)
+    return program_hotplug(argc, argv, &ee);
+  if (batch_mode)
+    return program_all(argc, argv, &ee);
+
+  memset(&run, 0, sizeof(run));
+  run_phase_ns = run.phase_ns;
+  t = timing_now();
+  atexit(&do_close);
+  if (ee_open_first(&device, &options, &ee)) {
+    fprintf(stderr, "Opening %04x:%04x:%s failed: %s\n",
+            ee.old_vid, ee.old_pid,
+            ee.old_serno ? ee.old_serno : "", ee_error(&device));
+    exit(ENODEV);
+  }
+  timing_phase(phase_open, &t);
+
+  /* The user area is handled on its own, the settings are left alone */
+  if (user_read_path || user_write_path) {
+    if (user_read_path && (ret = user_area_read(&device, user_read_path)) < 0)
+      return -ret;
+    if (user_write_path && (ret = user_area_write(&device, user_write_path)) < 0)
+      return -ret;
+    return 0;
+  }
+
+  snprintf(run.path, sizeof(run.path), "%04x:%04x", ee.old_vid, ee.old_pid);
+  if (serial_template && (ret = serial_assign(&run, 1)) < 0)
+    return -ret;
+  run.result = program_device(&device, &run, argc, argv, ee);
+  ledger_append(&run);
+  return -run.result;
+}
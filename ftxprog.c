@@ -0,0 +1,2343 @@
+/*
+ * libftxprog: the FT-X eeprom codec and the transports that read and
+ * write it, split out of ftx_prog so that it can be used in-process.
+ * See ftxprog.h.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <ftdi.h>
+#ifndef USE_LIBFTDI1
+#include <libusb.h>	/* ftdi.h only pulls this in for libftdi1 */
+#endif
+
+#include "ftxprog.h"
+
+/* ------------ Cyclic Redundancy Check ------------ */
+
+unsigned short calc_crc_ftx (void *addr)
+{
+  unsigned int i;
+  unsigned short crc = 0xaaaa;
+  unsigned char* d8 = addr;
+
+  /* Word Addresses 0x0 - 0x11 inclusive */
+  for (i = 0; i < 0x12*2; i += 2) {
+    crc ^= d8[i] | (d8[i+1] << 8);
+    crc  = (crc << 1) | (crc >> 15);
+  }
+
+  /* Word Addresses 0x12 - 0x39 are ignored */
+
+  /* Word Addresses 0x40 - 0x7E inclusive */
+  for (i = 0x40*2; i < 0x7F*2; i += 2) {
+    crc ^= d8[i] | (d8[i+1] << 8);
+    crc  = (crc << 1) | (crc >> 15);
+  }
+
+  /* Word Address 0x7E is ignored */
+  /* Word Address 0x7F is the checksum */
+
+  return crc;
+}
+/**
+ * Updates a CRC from calc_crc_ftx() for one word changing value. Each
+ * word is xored in and then rotated once for itself and once for
+ * every word that follows it, so the change just rotates through.
+ */
+unsigned short update_crc_word (unsigned short crc, int addr,
+                                unsigned short old_val,
+                                unsigned short new_val)
+{
+  const int words = 0x12 + (0x7F - 0x40);
+  unsigned short diff = old_val ^ new_val;
+  int pos, rot;
+
+  if (addr < 0x12) {
+    pos = addr;
+  } else if (addr >= 0x40 && addr < 0x7F) {
+    pos = 0x12 + (addr - 0x40);
+  } else {
+    return crc;			/* not covered by the CRC */
+  }
+
+  rot = (words - pos) % 16;
+  return crc ^ (unsigned short)((diff << rot) | (diff >> ((16 - rot) % 16)));
+}
+unsigned short update_crc (void *addr, int len)
+{
+  unsigned short crc = calc_crc_ftx(addr);
+  unsigned char *d8  = addr;
+
+  d8[len-2] = crc;
+  d8[len-1] = crc >> 8;
+  return crc;
+}
+
+/* ------------ Field Schema ------------ */
+
+#define EE_MEMBER(m)	.member = offsetof(struct eeprom_fields, m), \
+			.size = sizeof(((struct eeprom_fields *)0)->m)
+/* The bit number of a one bit mask, as a constant */
+#define EE_BIT(bit)	((bit) & 0x01 ? 0 : (bit) & 0x02 ? 1 : (bit) & 0x04 ? 2 : \
+			 (bit) & 0x08 ? 3 : (bit) & 0x10 ? 4 : (bit) & 0x20 ? 5 : \
+			 (bit) & 0x40 ? 6 : 7)
+#define EE_BOOL(m, off, bit, lbl) \
+  .name = #m, .label = lbl, .format = ee_format_bool, .offset = off, \
+  .width = 1, .mask = bit, .shift = EE_BIT(bit), EE_MEMBER(m)
+#define EE_UINT(key, m, off, w, msk, shf, lbl, fmt) \
+  .name = key, .label = lbl, .format = ee_format_uint, .offset = off, \
+  .width = w, .mask = msk, .shift = shf, EE_MEMBER(m), .shown = fmt
+#define EE_STRING(m, off, lbl) \
+  .name = #m, .label = lbl, .format = ee_format_string, \
+  .offset = off, .width = 2, EE_MEMBER(m)
+#define EE_CBUS(c) \
+  .name = "cbus" #c, .label = "CBUS" #c, .format = ee_format_cbus, \
+  .offset = 0x1A + c, .width = 1, .mask = 0xff, EE_MEMBER(cbus[c])
+
+/* The codec loops over this unrolled, with at least as many copies as
+ * there are fields, so the compiler folds it into straight-line code
+ * as fast as writing each field out by hand */
+const struct ee_field ee_fields[] = {
+  /* Misc Config */
+  { EE_BOOL(bcd_enable, 0x00, bcd_enable,
+            "Battery Charge Detect (BCD) Enabled") },
+  { EE_BOOL(force_power_enable, 0x00, force_power_enable,
+            "Force Power Enable Signal on CBUS") },
+  { EE_BOOL(deactivate_sleep, 0x00, deactivate_sleep,
+            "Deactivate Sleep in Battery Charge Mode") },
+  { EE_BOOL(ext_osc, 0x00, ext_osc, "External Oscillator Enabled") },
+  { EE_BOOL(ext_osc_feedback_en, 0x00, ext_osc_feedback_en,
+            "External Oscillator Feedback Resistor Enabled") },
+  { EE_BOOL(vbus_sense_alloc, 0x00, vbus_sense_alloc,
+            "CBUS pin allocated to VBUS Sense Mode") },
+  { EE_BOOL(load_vcp, 0x00, load_vcp, "Load Virtual COM Port (VCP) Drivers"),
+    .arg = "--load-vcp",
+    .help = "		 [on|off]   # (controls if the VCP drivers are loaded)" },
+
+  /* USB VID/PID */
+  { EE_UINT("usb_vid", usb_vid, 0x02, 2, 0xffff, 0, "Vendor ID (VID)",
+            "0x%04x"),
+    .arg = "--new-vid",
+    .help = "			 <number>   # (new/custom vendor id to be programmed)" },
+  { EE_UINT("usb_pid", usb_pid, 0x04, 2, 0xffff, 0, "Product ID (PID)",
+            "0x%04x"),
+    .arg = "--new-pid",
+    .help = "			 <number>   # (new/custom product id be programmed)" },
+
+  /* USB Release Number */
+  { EE_UINT("usb_release_major", usb_release_major, 0x07, 1, 0xff, 0,
+            "USB Version", "USB%u") },
+  { EE_UINT("usb_release_minor", usb_release_minor, 0x06, 1, 0xff, 0,
+            "", ".%u") },
+
+  /* Max Power and Config */
+  { EE_BOOL(remote_wakeup, 0x08, remote_wakeup,
+            "Remote Wakeup by something other than USB"),
+    .arg = "--remote-wakeup",
+    .help = "		 [on|off]   # (allows the interface to be woken up by something other than USB)" },
+  { EE_BOOL(self_powered, 0x08, self_powered, "Self Powered"),
+    .arg = "--self-powered",
+    .help = "		 [on|off]   # (specify if chip is bus-powered or self-powered)" },
+  { EE_UINT("max_power_ma", max_power, 0x09, 1, 0xff, 0,
+            "Maximum Current Supported from USB", "%umA"), .scale = 2,
+    .arg = "--max-bus-power",
+    .help = "		 <number>   # (max bus current in milli-amperes)" },
+
+  /* Device and perhiperal control */
+  { EE_BOOL(suspend_pull_down, 0x0A, suspend_pull_down,
+            "Pins Pulled Down on USB Suspend"),
+    .arg = "--suspend-pull-down",
+    .help = "	 [on|off]   # (force I/O pins into logic low state on suspend)" },
+  { EE_BOOL(serial_number_avail, 0x0A, serial_number_avail,
+            "Indicate USB Serial Number Available") },
+
+  { EE_BOOL(ft1248_cpol, 0x0A, ft1248_cpol, "FT1248 Clock Polarity"),
+    .section = " FT1248", .on = "Active High", .off = "Active Low",
+    .arg = "--ft1248-cpol",
+    .help = "		 [high|low] # (set the clock polarity on the FT1248 interface to active high or active low)" },
+  { EE_BOOL(ft1248_bord, 0x0A, ft1248_bord, "FT1248 Bit Order"),
+    .on = "LSB to MSB", .off = "MSB to LSB",
+    .arg = "--ft1248-bord",
+    .help = "		 [msb|lsb]  # (set the bit order on the FT1248 interface to msb first or lsb first)" },
+  { EE_BOOL(ft1248_flow_control, 0x0A, ft1248_flow_control,
+            "FT1248 Flow Control Enabled"),
+    .arg = "--ft1248-flow-control",
+    .help = "	 [on|off]   # (flow control for FT1248 interface)" },
+
+  { EE_BOOL(invert_txd, 0x0B, invert_txd, "Invert TXD"), .section = " RS232" },
+  { EE_BOOL(invert_rxd, 0x0B, invert_rxd, "Invert RXD") },
+  { EE_BOOL(invert_rts, 0x0B, invert_rts, "Invert RTS") },
+  { EE_BOOL(invert_cts, 0x0B, invert_cts, "Invert CTS") },
+  { EE_BOOL(invert_dtr, 0x0B, invert_dtr, "Invert DTR") },
+  { EE_BOOL(invert_dsr, 0x0B, invert_dsr, "Invert DSR") },
+  { EE_BOOL(invert_dcd, 0x0B, invert_dcd, "Invert DCD") },
+  { EE_BOOL(invert_ri, 0x0B, invert_ri, "Invert RI") },
+
+  { EE_BOOL(rs485_echo_suppress, 0x00, rs485_echo_suppress,
+            "RS485 Echo Suppression Enabled"), .section = " RS485",
+    .arg = "--rs485-echo-supp",
+    .help = "		 [on|off]   # (enable echo supression on the RS485 bus)" },
+
+  /* DBUS & CBUS Control */
+  { EE_UINT("dbus_drive_strength_ma", dbus_drive_strength, 0x0C, 1,
+            dbus_drive_strength, 0, "DBUS Drive Strength", "%umA"),
+    .scale = 4, .bias = 4 },
+  { EE_BOOL(dbus_slow_slew, 0x0C, dbus_slow_slew, "DBUS Slow Slew Mode"),
+    .on = "1", .off = "0" },
+  { EE_BOOL(dbus_schmitt, 0x0C, dbus_schmitt, "DBUS Schmitt Trigger"),
+    .on = "1", .off = "0" },
+  { EE_UINT("cbus_drive_strength_ma", cbus_drive_strength, 0x0C, 1,
+            cbus_drive_strength, 4, "CBUS Drive Strength", "%umA"),
+    .scale = 4, .bias = 4 },
+  { EE_BOOL(cbus_slow_slew, 0x0C, cbus_slow_slew, "CBUS Slow Slew Mode"),
+    .on = "1", .off = "0" },
+  { EE_BOOL(cbus_schmitt, 0x0C, cbus_schmitt, "CBUS Schmitt Trigger"),
+    .on = "1", .off = "0" },
+
+  /* Manufacturer, Product and Serial Number string, laid out in order */
+  { EE_STRING(manufacturer_string, 0x0E, "Manufacturer"),
+    .arg = "--manufacturer",
+    .help = "		 <string>   # (new USB manufacturer string)" },
+  { EE_STRING(product_string, 0x10, "Product"),
+    .arg = "--product",
+    .help = "			 <string>   # (new USB product name string)" },
+  { EE_STRING(serial_string, 0x12, "Serial Number"),
+    .arg = "--new-serial-number",
+    .help = "	 <string>   # (new USB serial number string)" },
+
+  /* I2C */
+  { EE_UINT("i2c_slave_addr", i2c_slave_addr, 0x14, 2, 0xffff, 0,
+            "I2C Slave Address", "%u "), .section = "  I2C",
+    .arg = "--i2c-slave-address",
+    .help = "	 <number>   # (I2C slave address)" },
+  { EE_UINT("i2c_device_id", i2c_device_id, 0x16, 3, 0xffffff, 0,
+            "I2C Device ID", "%u "),
+    .arg = "--i2c-device-id",
+    .help = "		 <number>   # (I2C device ID)" },
+  { EE_BOOL(disable_i2c_schmitt, 0x0A, disable_i2c_schmitt,
+            "I2C Schmitt Triggers Disabled"),
+    /* The command line arg is enabled +ve, the eeprom is disabled +ve */
+    .arg = "--i2c-schmitt", .arg_inverted = true,
+    .help = "		 [on|off]   # (schmitt trigger on I2C interface)" },
+
+  /* CBUS */
+  { EE_CBUS(0), .section = "  CBUS" },
+  { EE_CBUS(1) },
+  { EE_CBUS(2) },
+  { EE_CBUS(3) },
+  { EE_CBUS(4) },
+  { EE_CBUS(5) },
+  { EE_CBUS(6) },
+
+  /* Other memory areas, not shown */
+  { .name = "user_mem", .format = ee_format_bytes,
+    .offset = 0x24, .width = 92, EE_MEMBER(user_mem) },
+  { .name = "factory_config", .format = ee_format_bytes,
+    .offset = 0x80, .width = 32, EE_MEMBER(factory_config) },
+};
+const int ee_field_count = sizeof(ee_fields) / sizeof(ee_fields[0]);
+
+const struct ee_field *ee_field_find (const char *name)
+{
+  int i;
+
+  for (i = 0; i < ee_field_count; i++) {
+    if (0 == strcmp(ee_fields[i].name, name))
+      return &ee_fields[i];
+  }
+  return NULL;
+}
+/* The codec's inner loop, kept inline */
+static inline unsigned int ee_member_get (const struct eeprom_fields *ee,
+                                          const struct ee_field *f)
+{
+  const void *p = (const char *)ee + f->member;
+
+  if (f->size == 1) return *(const unsigned char *)p;
+  if (f->size == 2) return *(const unsigned short *)p;
+  return *(const unsigned int *)p;
+}
+static inline void ee_member_set (struct eeprom_fields *ee,
+                                  const struct ee_field *f, unsigned int val)
+{
+  void *p = (char *)ee + f->member;
+
+  if (f->size == 1) *(unsigned char *)p = val;
+  else if (f->size == 2) *(unsigned short *)p = val;
+  else *(unsigned int *)p = val;
+}
+/* The bits of a bool, number or cbus field, still in place. These all
+ * lie in the first 0x24 bytes, so reading three is always safe. */
+static inline unsigned int ee_field_bits (const unsigned char *eeprom,
+                                          const struct ee_field *f)
+{
+  const unsigned char *p = eeprom + f->offset;
+
+  return (p[0] | p[1] << 8 | p[2] << 16) & f->mask;
+}
+
+void *ee_field_ptr (struct eeprom_fields *ee, const struct ee_field *f)
+{
+  return (char *)ee + f->member;
+}
+/**
+ * Returns a bool, number or cbus mode field as it is held in ee
+ */
+unsigned int ee_field_get (const struct eeprom_fields *ee,
+                           const struct ee_field *f)
+{
+  return ee_member_get(ee, f);
+}
+void ee_field_set (struct eeprom_fields *ee, const struct ee_field *f,
+                   unsigned int val)
+{
+  ee_member_set(ee, f, val);
+}
+/**
+ * Compares two images field by field, without decoding them, filling
+ * in changed with up to max of the fields that differ. Strings differ
+ * if their contents do, wherever they are. Returns how many differ.
+ */
+int ee_diff (const unsigned char *a, const unsigned char *b,
+             const struct ee_field **changed, int max)
+{
+  const struct ee_field *f;
+  int n = 0;
+  bool differ;
+
+#pragma GCC unroll 64
+  for (f = ee_fields; f < ee_fields + ee_field_count; f++) {
+    const unsigned char *pa = a + f->offset, *pb = b + f->offset;
+
+    switch (f->format) {
+    case ee_format_string:
+      differ = pa[1] != pb[1] || pa[0] + pa[1] > 0x100 ||
+        pb[0] + pb[1] > 0x100 || memcmp(a + pa[0], b + pb[0], pa[1]);
+      break;
+    case ee_format_bytes:
+      differ = memcmp(pa, pb, f->width);
+      break;
+    default:
+      differ = ee_field_bits(a, f) != ee_field_bits(b, f);
+    }
+    if (differ && n++ < max)
+      changed[n - 1] = f;
+  }
+  return n;
+}
+
+/* ------------ EEPROM Encoding and Decoding ------------ */
+
+/**
+ * Checks that the strings aren't too big to fit in the string
+ * descriptors memory.
+ */
+static int ee_check_strings(char* man, char* prod, char* ser)
+{
+  /* if the strings are too long */
+  if (strlen(man) + strlen(prod) + strlen(ser) > 96)	return 1;
+  return 0;
+}
+/* Strings are FT Prog's 16 bit descriptors unless asked otherwise */
+static bool ee_8b_strings (const struct ee_options *opts)
+{
+  return opts && opts->use_8b_strings;
+}
+/**
+ * Writes the eeprom form of a string to out, returning its length
+ */
+int ee_encode_str (const struct ee_options *opts, const char* str,
+                   unsigned char *out)
+{
+  int length, in;
+
+  if (ee_8b_strings(opts)) {
+    length = strlen(str);
+    memcpy(out, str, length);
+  } else {
+    length = strlen(str)*2 + 2;
+
+    /* Encode a FT Prog compatible string */
+    out[0] = length;
+    out[1] = 3;
+    for (in = 0; 2 + (in*2) < length; in++) {
+      out[2 + (in*2)] = str[in];
+      out[3 + (in*2)] = 0;
+    }
+  }
+
+  return length;
+}
+/**
+ * Inserts a string into a buffer to be written out to the eeprom
+ */
+static void ee_encode_string(const struct ee_options *opts, char* str,
+                             unsigned char *ptr_field,
+                             unsigned char* len_field, unsigned char* eeprom,
+                             unsigned char* string_addr)
+{
+  /* Copy the strings to the string area */
+  int length = ee_encode_str(opts, str, eeprom + *string_addr);
+
+  /* Write the the two metadata fields */
+  *ptr_field = *string_addr;
+  *len_field = length;
+  /* Move the string area address forward */
+  *string_addr += *len_field;
+}
+/**
+ * Encodes an eeprom_fields object into a buffer ready to be written
+ * out to the eeprom. Returns the new CRC, or -EINVAL if the strings
+ * are too long to fit in the string memory area.
+ */
+int ee_encode (const struct ee_options *opts, unsigned char *eeprom, int len,
+               struct eeprom_fields *ee)
+{
+  const struct ee_field *f;
+  unsigned char string_desc_addr = 0xA0;
+
+  memset(eeprom, 0, len);
+
+  /* Manufacturer, Product and Serial Number string */
+  if (ee_check_strings(ee->manufacturer_string, ee->product_string,
+                       ee->serial_string)) {
+    return -EINVAL;
+  }
+
+#pragma GCC unroll 64
+  for (f = ee_fields; f < ee_fields + ee_field_count; f++) {
+    unsigned char *p = eeprom + f->offset;
+    unsigned int v;
+
+    if (f->format == ee_format_string) {
+      ee_encode_string(opts, *(char **)ee_field_ptr(ee, f), &p[0], &p[1],
+                       eeprom, &string_desc_addr);
+      continue;
+    }
+    if (f->format == ee_format_bytes) {
+      memcpy(p, ee_field_ptr(ee, f), f->width);
+      continue;
+    }
+    v = ee_member_get(ee, f);
+    if (f->format == ee_format_bool)
+      v = v != 0;
+    /* Masked, so any bytes past the field's width just get zeros */
+    v = (v << f->shift) & f->mask;
+    p[0] |= v;
+    p[1] |= v >> 8;
+    p[2] |= v >> 16;
+  }
+  eeprom[0x08] |= 0x80;	/* This is a reserved bit! */
+
+  return update_crc(eeprom, len);
+}
+/**
+ * Extracts a string of len bytes at ptr into str, which must have room
+ * for len+1 bytes
+ */
+void ee_decode_str (const struct ee_options *opts, const unsigned char* ptr,
+                    unsigned char len, char* str)
+{
+  /* Decode strings written by FT Prog correctly */
+  if (ee_8b_strings(opts)) {
+    memcpy(str, ptr, len);
+    str[len] = '\0';
+  } else {
+
+    /* Pick the actual ASCII characters out of the FT Prog encoded string */
+    int in, out;
+    for (in = 2, out = 0; in < len; in += 2, out++) {
+      str[out] = ptr[in];
+    }
+
+    str[out] = '\0';
+  }
+}
+/**
+ * Extracts a string from the a buffer read from eeprom
+ */
+static char* ee_decode_string(const struct ee_options *opts,
+                              unsigned char *eeprom, unsigned char* ptr,
+                              unsigned char len)
+{
+  char* str;
+
+  /* A corrupt descriptor must not read past the image */
+  if (ptr + len > eeprom + 0x100)
+    len = eeprom + 0x100 - ptr;
+  str = malloc(len+1);
+  if (str != NULL) {
+    ee_decode_str(opts, ptr, len, str);
+  }
+
+  return str;
+}
+/*
+ * Populates an eeprom_fields object from a buffer read from eeprom
+ */
+void ee_decode (const struct ee_options *opts, unsigned char *eeprom, int len,
+                struct eeprom_fields *ee)
+{
+  const struct ee_field *f;
+
+#pragma GCC unroll 64
+  for (f = ee_fields; f < ee_fields + ee_field_count; f++) {
+    unsigned char *p = eeprom + f->offset;
+
+    if (f->format == ee_format_string) {
+      *(char **)ee_field_ptr(ee, f) = ee_decode_string(opts, eeprom,
+                                                        eeprom + p[0], p[1]);
+    } else if (f->format == ee_format_bytes) {
+      memcpy(ee_field_ptr(ee, f), p, f->width);
+    } else {
+      /* A bool's shift brings its bit down to 0 or 1 */
+      ee_member_set(ee, f, ee_field_bits(eeprom, f) >> f->shift);
+    }
+  }
+}
+
+/* ------------ EEPROM Reading and Writing ------------ */
+
+uint64_t ee_now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/* Only looks at the clock if someone is listening */
+static uint64_t ee_xfer_start (struct ee_device *dev)
+{
+  return dev->opts.on_xfer ? ee_now_ns() : 0;
+}
+static void ee_xfer_done (struct ee_device *dev, bool write, uint64_t start)
+{
+  if (dev->opts.on_xfer)
+    dev->opts.on_xfer(dev->opts.arg, write, start);
+}
+/**
+ * Cuts a transfer's timeout in ms (0 for none) to what is left before
+ * opts.deadline. Returns -1 once the deadline has passed.
+ */
+static int ee_deadline_timeout (struct ee_device *dev, int timeout)
+{
+  uint64_t now;
+  long long left;
+
+  if (!dev->opts.deadline)
+    return timeout;
+  now = ee_now_ns();
+  if (now >= dev->opts.deadline)
+    return -1;
+  left = (dev->opts.deadline - now + 999999) / 1000000;
+
+  return (timeout && timeout < left) ? timeout : (int)left;
+}
+static void ee_phase_done (struct ee_device *dev, enum ee_phase phase,
+                           uint64_t *start)
+{
+  if (dev->opts.on_phase) {
+    dev->opts.on_phase(dev->opts.arg, phase, *start);
+    *start = ee_now_ns();
+  }
+}
+/* Records what went wrong, for ee_error() */
+static void ee_set_error (struct ee_device *dev, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(dev->error, sizeof(dev->error), fmt, ap);
+  va_end(ap);
+}
+
+static const struct ee_transport *ee_transport (const struct ee_options *opts)
+{
+  return opts->transport ? opts->transport : &ee_libftdi_transport;
+}
+/**
+ * Finds every device matching the old vid, pid and serial number in
+ * ee. Returns the number found, with their paths in a newly allocated
+ * array, or a negative errno.
+ */
+int ee_find (const struct ee_options *opts, struct eeprom_fields *ee,
+             struct ee_path **paths)
+{
+  return ee_transport(opts)->find(opts, ee, paths);
+}
+static void ee_init (struct ee_device *dev, const struct ee_options *opts)
+{
+  memset(dev, 0, sizeof(*dev));
+  dev->opts = *opts;
+  if (dev->opts.queue_depth < 1)
+    dev->opts.queue_depth = 1;
+  if (dev->opts.queue_depth > EE_MAX_QUEUE_DEPTH)
+    dev->opts.queue_depth = EE_MAX_QUEUE_DEPTH;
+  dev->ops = ee_transport(opts);
+}
+/**
+ * Opens the device at a path from ee_find(). The handle must be
+ * closed with ee_close() whether or not this succeeds.
+ */
+int ee_open (struct ee_device *dev, const struct ee_options *opts,
+             const char *path)
+{
+  ee_init(dev, opts);
+  return dev->ops->open(dev, path);
+}
+int ee_open_first (struct ee_device *dev, const struct ee_options *opts,
+                   struct eeprom_fields *ee)
+{
+  ee_init(dev, opts);
+  return dev->ops->open_first(dev, ee);
+}
+void ee_close (struct ee_device *dev)
+{
+  if (dev->ops)
+    dev->ops->close(dev);
+  dev->ops = NULL;
+}
+/**
+ * Says what the last call on a handle that failed went wrong with
+ */
+const char *ee_error (struct ee_device *dev)
+{
+  if (dev->error[0] || !dev->ops)
+    return dev->error[0] ? dev->error : "not open";
+  return dev->ops->error(dev);
+}
+void ee_set_timeout (struct ee_device *dev, int ms)
+{
+  dev->ops->set_timeout(dev, ms);
+}
+/**
+ * Says if a failed transfer might work if it is tried again. A device
+ * that has gone or can't be accessed won't come back by itself.
+ */
+static bool ee_transient (int status)
+{
+  switch (status) {
+  case LIBUSB_ERROR_IO:
+  case LIBUSB_ERROR_TIMEOUT:
+  case LIBUSB_ERROR_PIPE:
+  case LIBUSB_ERROR_OVERFLOW:
+  case LIBUSB_ERROR_BUSY:
+  case LIBUSB_ERROR_INTERRUPTED:	/* not tried, after an earlier failure */
+    return true;
+  default:
+    return false;
+  }
+}
+static void ee_backoff (struct ee_device *dev, int attempt)
+{
+  long us = (long)dev->opts.retry_backoff_us << (attempt < 10 ? attempt : 10);
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+  while (us > 0 && nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+/**
+ * Runs the transfers, then retries just the ones that failed
+ * transiently, waiting twice as long each time, up to opts.retries
+ * times for each word. Reads stop at the first failure, so a retry
+ * carries on from the failed word rather than starting over, and a
+ * later word that fails gets its own retries.
+ */
+static int ee_transfer (struct ee_device *dev, struct ee_xfer *xfers,
+                        int count, bool write)
+{
+  int (*op) (struct ee_device *, struct ee_xfer *, int) =
+    write ? dev->ops->write_words : dev->ops->read_words;
+  struct ee_xfer again[0x80];
+  int i, n, nagain, attempt = 0, first = -1, ret = op(dev, xfers, count);
+
+  while (ret < 0) {
+    for (i = 0, nagain = 0; i < count && nagain < 0x80; i++) {
+      if (xfers[i].status == 0)
+        continue;
+      if (!ee_transient(xfers[i].status))
+        return ret;
+      again[nagain++] = xfers[i];
+    }
+    if (nagain == 0)
+      return ret;
+    if (again[0].addr != first) {
+      first = again[0].addr;	/* got further, so start counting again */
+      attempt = 0;
+    }
+    if (attempt >= dev->opts.retries || ee_deadline_timeout(dev, 0) < 0)
+      return ret;
+
+    if (dev->opts.on_retry)
+      dev->opts.on_retry(dev->opts.arg, first, again[0].status, attempt + 1);
+    ee_backoff(dev, attempt++);
+    ret = op(dev, again, nagain);
+
+    for (i = 0, n = 0; i < count && n < nagain; i++) {
+      if (xfers[i].status != 0)
+        xfers[i] = again[n++];
+    }
+    /* Anything past the first 0x80 failures waits for the next round */
+    for (; i < count && ret == 0; i++) {
+      if (xfers[i].status != 0)
+        ret = -EIO;
+    }
+  }
+  return ret;
+}
+int ee_read_words (struct ee_device *dev, struct ee_xfer *xfers, int count)
+{
+  return ee_transfer(dev, xfers, count, false);
+}
+int ee_write_words (struct ee_device *dev, struct ee_xfer *xfers, int count)
+{
+  return ee_transfer(dev, xfers, count, true);
+}
+/**
+ * Puts the device in the state MProg leaves it in before writing
+ */
+int ee_prepare_write (struct ee_device *dev)
+{
+  char why[sizeof(dev->error)];
+  int attempt;
+
+  /* Every step of it can safely be repeated */
+  for (attempt = 0; dev->ops->prepare_write(dev) != 0; attempt++) {
+    if (attempt >= dev->opts.retries) {
+      snprintf(why, sizeof(why), "%s", ee_error(dev));
+      ee_set_error(dev, "preparing to write failed: %s", why);
+      return -EIO;
+    }
+    ee_backoff(dev, attempt);
+  }
+  return 0;
+}
+/**
+ * Resets the device so that it loads its new settings
+ */
+int ee_reset (struct ee_device *dev)
+{
+  return dev->ops->reset(dev) ? -EIO : 0;
+}
+/**
+ * Resets the port and waits up to timeout_ms for the device to come
+ * back as expect, filling in found with what it came back as
+ */
+int ee_reenumerate (struct ee_device *dev, struct ee_identity *expect,
+                    int timeout_ms, struct ee_identity *found)
+{
+  return dev->ops->reenumerate(dev, expect, timeout_ms, found);
+}
+
+unsigned short ee_get_word (unsigned char *eeprom, int addr)
+{
+  return eeprom[addr*2] | (eeprom[(addr*2)+1] << 8);
+}
+void ee_set_word (unsigned char *eeprom, int addr, unsigned short val)
+{
+  eeprom[addr*2] = val;
+  eeprom[(addr*2)+1] = val >> 8;
+}
+/**
+ * Says if we ever write a word. ftdi_write_eeprom() never touches the
+ * reserved area on libftdi1, so we don't either.
+ */
+bool ee_word_writable (int addr)
+{
+#ifdef USE_LIBFTDI1
+  if (addr >= 0x40 && addr < 0x50) return false;
+#endif
+  return true;
+}
+
+static void ee_identity_str (const struct ee_options *opts,
+                             unsigned char *eeprom, int field, char *str)
+{
+  int ptr = eeprom[field], len = eeprom[field + 1];
+
+  str[0] = '\0';
+  if (len && ptr + len <= 0x100)
+    ee_decode_str(opts, eeprom + ptr, len, str);
+}
+/**
+ * Works out what a device holding an image will enumerate as. With a
+ * bad CRC it falls back to the defaults, strings unknown.
+ */
+void ee_identity_from_image (const struct ee_options *opts,
+                             unsigned char *eeprom, struct ee_identity *id)
+{
+  memset(id, 0, sizeof(*id));
+  if (calc_crc_ftx(eeprom) != ee_get_word(eeprom, 0x7F)) {
+    id->vid = 0x0403;
+    id->pid = 0x6015;
+    return;
+  }
+  id->vid = ee_get_word(eeprom, 0x01);
+  id->pid = ee_get_word(eeprom, 0x02);
+  id->strings_known = true;
+  ee_identity_str(opts, eeprom, 0x0E, id->manufacturer);
+  ee_identity_str(opts, eeprom, 0x10, id->product);
+  if (eeprom[0x0A] & serial_number_avail)
+    ee_identity_str(opts, eeprom, 0x12, id->serial);
+}
+bool ee_identity_matches (struct ee_identity *expect,
+                          struct ee_identity *found)
+{
+  return expect->vid == found->vid && expect->pid == found->pid &&
+    (!expect->strings_known ||
+     (strcmp(expect->manufacturer, found->manufacturer) == 0 &&
+      strcmp(expect->product, found->product) == 0 &&
+      strcmp(expect->serial, found->serial) == 0));
+}
+
+static void ee_collect_errors (struct ee_xfer *xfers, int count,
+                               struct ee_write_result *res)
+{
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (xfers[i].status == 0) {
+      res->written++;
+    } else {
+      res->errors[res->error_count].addr = xfers[i].addr;
+      res->errors[res->error_count].status = xfers[i].status;
+      res->error_count++;
+    }
+  }
+}
+/**
+ * Writes the words of eeprom that differ from old, which must hold
+ * the current contents of the device. The CRC word goes last, and
+ * only once every other word has been acknowledged, so a failed write
+ * never leaves a valid CRC over a half written image. Returns 0 or
+ * -EIO, with the details in res.
+ */
+int ee_write (struct ee_device *dev, unsigned char *old,
+              unsigned char *eeprom, int len, struct ee_write_result *res)
+{
+  struct ee_xfer xfers[0x80], crc = { 0 };
+  int i, n = 0, crc_addr = len/2 - 1;
+  bool crc_changed = false;
+  uint64_t t = dev->opts.on_phase ? ee_now_ns() : 0;
+
+  memset(res, 0, sizeof(*res));
+  dev->error[0] = '\0';
+
+  if (ee_prepare_write(dev) < 0)
+    return -EIO;
+  ee_phase_done(dev, ee_phase_prepare, &t);
+
+  for (i = 0; i < len/2; i++) {
+    unsigned short old_val = ee_get_word(old, i);
+    unsigned short new_val = ee_get_word(eeprom, i);
+
+    if (old_val == new_val || !ee_word_writable(i)) {
+      res->skipped++;
+      continue;
+    }
+
+    if (i == crc_addr) {
+      crc.addr = i;
+      crc.val = new_val;
+      crc_changed = true;
+    } else {
+      xfers[n].addr = i;
+      xfers[n].val = new_val;
+      n++;
+    }
+  }
+
+  ee_write_words(dev, xfers, n);
+  ee_collect_errors(xfers, n, res);
+
+  if (crc_changed && res->error_count == 0) {
+    ee_write_words(dev, &crc, 1);
+    ee_collect_errors(&crc, 1, res);
+  }
+  ee_phase_done(dev, ee_phase_write, &t);
+
+  if (res->error_count) {
+    ee_set_error(dev, "writing %d words failed, the first at 0x%02x: %s",
+                 res->error_count, res->errors[0].addr,
+                 libusb_error_name(res->errors[0].status));
+    return -EIO;
+  }
+  return 0;
+}
+
+static void ee_read_error (struct ee_device *dev, struct ee_xfer *xfers,
+                           int count)
+{
+  int i;
+
+  for (i = 0; i < count && xfers[i].status == 0; i++);
+  if (i < count) {
+    ee_set_error(dev, "eeprom read failed at 0x%02x: %s", xfers[i].addr,
+                 libusb_error_name(xfers[i].status));
+  }
+}
+
+/**
+ * Reads the eeprom image from the device, without checking the CRC.
+ * Returns 0 or -EIO.
+ */
+int ee_read (struct ee_device *dev, unsigned char *eeprom, int len)
+{
+  return ee_read_area(dev, 0, eeprom, len);
+}
+
+/**
+ * Reads back a freshly written image and compares every word with
+ * eeprom. Words that differ are written again, CRC last, and then
+ * just those words and the CRC are read back, up to verify_retries
+ * times. Returns the number of words rewritten, or -EIO once the
+ * retries run out, with the words that still differ in ee_error().
+ */
+int ee_verify (struct ee_device *dev, unsigned char *eeprom, int len)
+{
+  struct ee_xfer xfers[0x80], bad[0x80];
+  int i, n = len/2, nbad = 0, attempt, rewritten = 0, pos;
+  int crc_addr = n - 1;	/* the highest address, so always sorts last */
+
+  dev->error[0] = '\0';
+  for (i = 0; i < n; i++) {
+    xfers[i].addr = i;
+  }
+
+  for (attempt = 0; ; attempt++) {
+    bool crc_bad = false;
+    int nread = n;
+
+    /* First time round read everything, then only what was rewritten */
+    if (attempt > 0) {
+      for (i = 0, nread = 0; i < nbad; i++) {
+        xfers[nread++].addr = bad[i].addr;
+        crc_bad |= bad[i].addr == crc_addr;
+      }
+      if (!crc_bad) xfers[nread++].addr = crc_addr;
+    }
+    if (ee_read_words(dev, xfers, nread) < 0) {
+      ee_read_error(dev, xfers, nread);
+      return -EIO;
+    }
+
+    for (i = 0, nbad = 0; i < nread; i++) {
+      unsigned short want = ee_get_word(eeprom, xfers[i].addr);
+
+      if (xfers[i].val != want && ee_word_writable(xfers[i].addr)) {
+        bad[nbad].addr = xfers[i].addr;
+        bad[nbad].val = want;
+        nbad++;
+      }
+    }
+    if (nbad == 0 || attempt >= dev->opts.verify_retries)
+      break;
+
+    /* The CRC sorts last, so it is only rewritten if the rest stick */
+    for (i = 0; i < nbad && bad[i].addr != crc_addr; i++);
+    if (ee_write_words(dev, bad, i) == 0 && i < nbad)
+      ee_write_words(dev, &bad[i], 1);
+    rewritten += nbad;
+  }
+
+  if (nbad) {
+    pos = snprintf(dev->error, sizeof(dev->error),
+                   "readback differs at words");
+    for (i = 0; i < nbad && pos < sizeof(dev->error) - 6; i++) {
+      pos += snprintf(dev->error + pos, sizeof(dev->error) - pos,
+                      " 0x%02x", bad[i].addr);
+    }
+    return -EIO;
+  }
+
+  return rewritten;
+}
+
+/* ------------ User Area ------------ */
+
+/* Checks a span of the MTP for ee_read_area() and ee_write_area() */
+static int ee_check_area (struct ee_device *dev, int addr, int len)
+{
+  dev->error[0] = '\0';
+  if (addr < 0 || len < 0 || (addr | len) & 1 || len > EE_AREA_MAX ||
+      addr + len > EE_MTP_SIZE) {
+    ee_set_error(dev, "bad span of %d bytes at 0x%03x", len, addr);
+    return -EINVAL;
+  }
+  return 0;
+}
+/**
+ * Reads len bytes of the MTP starting at byte addr, which must both
+ * be even, with len at most EE_AREA_MAX. Returns 0, -EINVAL or -EIO.
+ */
+int ee_read_area (struct ee_device *dev, int addr, unsigned char *buf,
+                  int len)
+{
+  struct ee_xfer xfers[EE_AREA_MAX/2];
+  int i, n = len/2, ret;
+
+  if ((ret = ee_check_area(dev, addr, len)) < 0)
+    return ret;
+  for (i = 0; i < n; i++) {
+    xfers[i].addr = addr/2 + i;
+  }
+  if (ee_read_words(dev, xfers, n) < 0) {
+    ee_read_error(dev, xfers, n);
+    return -EIO;
+  }
+  for (i = 0; i < n; i++) {
+    ee_set_word(buf, i, xfers[i].val);
+  }
+
+  return 0;
+}
+/**
+ * Writes the words of buf that differ from old, which must hold what
+ * the same span of the MTP holds now, as read by ee_read_area(). The
+ * span is as for ee_read_area(). Nothing here knows about the CRC,
+ * so this is for the user area past the first 0x100 bytes, and the
+ * caller is expected to have called ee_prepare_write() once first.
+ * Returns 0, -EINVAL or -EIO, with the details in res.
+ */
+int ee_write_area (struct ee_device *dev, int addr, unsigned char *old,
+                   unsigned char *buf, int len, struct ee_write_result *res)
+{
+  struct ee_xfer xfers[EE_AREA_MAX/2];
+  int i, n = 0, ret;
+
+  memset(res, 0, sizeof(*res));
+  if ((ret = ee_check_area(dev, addr, len)) < 0)
+    return ret;
+
+  for (i = 0; i < len/2; i++) {
+    unsigned short new_val = ee_get_word(buf, i);
+
+    if (ee_get_word(old, i) == new_val || !ee_word_writable(addr/2 + i)) {
+      res->skipped++;
+      continue;
+    }
+    xfers[n].addr = addr/2 + i;
+    xfers[n].val = new_val;
+    n++;
+  }
+
+  ee_write_words(dev, xfers, n);
+  ee_collect_errors(xfers, n, res);
+
+  if (res->error_count) {
+    ee_set_error(dev, "writing %d words failed, the first at 0x%03x: %s",
+                 res->error_count, res->errors[0].addr,
+                 libusb_error_name(res->errors[0].status));
+    return -EIO;
+  }
+  return 0;
+}
+
+/* ------------ Asynchronous Transfers ------------ */
+
+/* The FTDI vendor requests, as sent by libftdi */
+#define FTDI_REQ_OUT	(LIBUSB_REQUEST_TYPE_VENDOR | \
+                         LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT)
+#define FTDI_REQ_IN	(LIBUSB_REQUEST_TYPE_VENDOR | \
+                         LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN)
+#define FTDI_SIO_RESET		0x00
+#define FTDI_SIO_POLL_MODEM_STATUS	0x05
+#define FTDI_SIO_SET_LATENCY_TIMER	0x09
+#define FTDI_SIO_READ_EEPROM	0x90
+#define FTDI_SIO_WRITE_EEPROM	0x91
+
+struct ee_async {
+  struct ee_device *dev;
+  libusb_device_handle *usb;
+  int timeout;
+  struct ee_xfer *xfers;
+  int count, next, pending, failed;
+  bool write;
+};
+struct ee_slot {
+  struct ee_async *a;
+  struct ee_xfer *x;
+  struct libusb_transfer *t;
+  uint64_t submitted;		/* for on_xfer */
+  unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 2];
+};
+
+static int ee_async_submit (struct ee_slot *slot);
+
+static int ee_transfer_error (enum libusb_transfer_status status)
+{
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:	return 0;
+  case LIBUSB_TRANSFER_TIMED_OUT:	return LIBUSB_ERROR_TIMEOUT;
+  case LIBUSB_TRANSFER_STALL:		return LIBUSB_ERROR_PIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE:	return LIBUSB_ERROR_NO_DEVICE;
+  case LIBUSB_TRANSFER_OVERFLOW:	return LIBUSB_ERROR_OVERFLOW;
+  case LIBUSB_TRANSFER_CANCELLED:	return LIBUSB_ERROR_INTERRUPTED;
+  default:				return LIBUSB_ERROR_IO;
+  }
+}
+static void LIBUSB_CALL ee_async_done (struct libusb_transfer *t)
+{
+  struct ee_slot *slot = t->user_data;
+  struct ee_async *a = slot->a;
+  struct ee_xfer *x = slot->x;
+
+  ee_xfer_done(a->dev, a->write, slot->submitted);
+  x->status = ee_transfer_error(t->status);
+  if (!x->status && !a->write) {
+    unsigned char *data = libusb_control_transfer_get_data(t);
+
+    if (t->actual_length < 2) {
+      x->status = LIBUSB_ERROR_IO;
+    } else {
+      x->val = data[0] | (data[1] << 8);
+    }
+  }
+  a->pending--;
+  if (x->status) a->failed++;
+
+  /* Reuse this slot for the next word. Reads give up at the first
+   * failure, writes carry on so that every word has a status */
+  if ((a->write || !a->failed) && a->next < a->count) {
+    slot->x = &a->xfers[a->next++];
+    ee_async_submit(slot);
+  }
+}
+static int ee_async_submit (struct ee_slot *slot)
+{
+  struct ee_async *a = slot->a;
+  int ret, timeout = ee_deadline_timeout(a->dev, a->timeout);
+
+  if (timeout < 0) {
+    slot->x->status = LIBUSB_ERROR_TIMEOUT;
+    a->failed++;
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  if (a->write) {
+    libusb_fill_control_setup(slot->buf, FTDI_REQ_OUT, FTDI_SIO_WRITE_EEPROM,
+                              slot->x->val, slot->x->addr, 0);
+  } else {
+    libusb_fill_control_setup(slot->buf, FTDI_REQ_IN, FTDI_SIO_READ_EEPROM,
+                              0, slot->x->addr, 2);
+  }
+  libusb_fill_control_transfer(slot->t, a->usb, slot->buf, ee_async_done,
+                               slot, timeout);
+
+  slot->submitted = ee_xfer_start(a->dev);
+  if ((ret = libusb_submit_transfer(slot->t)) != 0) {
+    slot->x->status = ret;
+    a->failed++;
+    return ret;
+  }
+  a->pending++;
+  return 0;
+}
+/**
+ * Runs a list of word reads or writes as vendor control transfers on
+ * an open libusb handle, keeping up to queue_depth of them in flight.
+ * Reads stop submitting after the first failure. Returns 0, or -EIO
+ * if any transfer failed, in which case the status of each transfer
+ * says which.
+ */
+static int ee_async_run (struct ee_device *dev, libusb_context *ctx,
+                         libusb_device_handle *usb, int timeout,
+                         struct ee_xfer *xfers, int count, bool write)
+{
+  struct ee_slot slots[EE_MAX_QUEUE_DEPTH];
+  struct ee_async a;
+  int i, depth = count < dev->opts.queue_depth ? count : dev->opts.queue_depth;
+
+  if (count == 0)
+    return 0;
+
+  memset(&a, 0, sizeof(a));
+  a.dev = dev;
+  a.usb = usb;
+  a.timeout = timeout;
+  a.xfers = xfers;
+  a.count = count;
+  a.write = write;
+  for (i = 0; i < count; i++) {
+    xfers[i].status = LIBUSB_ERROR_INTERRUPTED;	/* until it completes */
+  }
+
+  for (i = 0; i < depth; i++) {
+    slots[i].a = &a;
+    slots[i].t = libusb_alloc_transfer(0);
+    if (!slots[i].t) {
+      depth = i;
+      break;
+    }
+  }
+  for (i = 0; i < depth && !a.failed && a.next < count; i++) {
+    slots[i].x = &xfers[a.next++];
+    ee_async_submit(&slots[i]);
+  }
+
+  while (a.pending) {
+    int ret = libusb_handle_events(ctx);
+
+    if (ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+      /* Cancel whatever is left and wait for the cancellations */
+      a.failed++;
+      for (i = 0; i < depth; i++) {
+        libusb_cancel_transfer(slots[i].t);
+      }
+    }
+  }
+
+  for (i = 0; i < depth; i++) {
+    libusb_free_transfer(slots[i].t);
+  }
+
+  return (a.failed || depth == 0) ? -EIO : 0;
+}
+
+/* ------------ libftdi Transport ------------ */
+
+/* libftdi0 rescans the global libusb-0.1 bus list on every open */
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Records which controller and hub ports lead to d */
+static void ee_path_topology (struct ee_path *p, libusb_device *d)
+{
+  int depth = libusb_get_port_numbers(d, p->ports, sizeof(p->ports));
+
+  p->bus = libusb_get_bus_number(d);
+  p->depth = depth > 0 ? depth : 0;
+}
+/**
+ * Finds every device matching the old vid, pid and serial number and
+ * records a libftdi open string for each. Returns the number found,
+ * or a negative errno.
+ */
+#ifdef USE_LIBFTDI1
+static int lusb_find (const struct ee_options *opts,
+                      struct eeprom_fields *ee, struct ee_path **paths);
+#else
+/**
+ * Lists every FT-X on every bus, the way ftdi_usb_find_all() lists
+ * one VID/PID. Returns how many, or a negative errno; the list is
+ * freed with ftdi_list_free() either way.
+ */
+static int libftdi_find_ftx (struct ftdi_device_list **list)
+{
+  struct ftdi_device_list **tail = list;
+  struct usb_bus *bus;
+  struct usb_device *d;
+  int count = 0;
+
+  *list = NULL;
+  usb_init();
+  if (usb_find_busses() < 0 || usb_find_devices() < 0)
+    return -EIO;
+  for (bus = usb_get_busses(); bus; bus = bus->next) {
+    for (d = bus->devices; d; d = d->next) {
+      if (d->descriptor.bcdDevice != EE_FTX_BCD_DEVICE)
+        continue;
+      if (!(*tail = malloc(sizeof(**tail))))
+        return -ENOMEM;
+      (*tail)->next = NULL;
+      (*tail)->dev = d;
+      tail = &(*tail)->next;
+      count++;
+    }
+  }
+  return count;
+}
+#endif
+static int libftdi_find (const struct ee_options *opts,
+                         struct eeprom_fields *ee, struct ee_path **paths)
+{
+  struct ftdi_context ctx;
+  struct ftdi_device_list *list, *d;
+  int count, n = 0;
+
+#ifdef USE_LIBFTDI1
+  /* libftdi1 only lists one VID/PID, but its paths are libusb's */
+  if (ee->find_any_ftx)
+    return lusb_find(opts, ee, paths);
+  ftdi_init(&ctx);
+  count = ftdi_usb_find_all(&ctx, &list, ee->old_vid, ee->old_pid);
+#else
+  ftdi_init(&ctx);
+  if (ee->find_any_ftx) {
+    pthread_mutex_lock(&open_lock);
+    count = libftdi_find_ftx(&list);
+    pthread_mutex_unlock(&open_lock);
+  } else {
+    count = ftdi_usb_find_all(&ctx, &list, ee->old_vid, ee->old_pid);
+  }
+#endif
+  if (count < 0) {
+    ftdi_list_free(&list);
+    ftdi_deinit(&ctx);
+    return -EIO;
+  }
+
+  *paths = calloc(count ? count : 1, sizeof(**paths));
+  for (d = list; d && *paths; d = d->next) {
+    struct ee_path *p = &(*paths)[n];
+
+    if (ee->old_serno) {
+      char serial[64];
+
+      if (ftdi_usb_get_strings(&ctx, d->dev, NULL, 0, NULL, 0,
+                               serial, sizeof(serial)) ||
+          strcmp(serial, ee->old_serno)) {
+        continue;
+      }
+    }
+#ifdef USE_LIBFTDI1
+    snprintf(p->path, sizeof(p->path), "d:%03u/%03u",
+             libusb_get_bus_number(d->dev), libusb_get_device_address(d->dev));
+    ee_path_topology(p, d->dev);
+#else
+    /* libusb-0.1 knows the bus but not the ports */
+    snprintf(p->path, sizeof(p->path), "d:%.28s/%.28s",
+             d->dev->bus->dirname, d->dev->filename);
+    p->bus = atoi(d->dev->bus->dirname);
+#endif
+    n++;
+  }
+  ftdi_list_free(&list);
+  ftdi_deinit(&ctx);
+
+  return *paths ? n : -ENOMEM;
+}
+static void libftdi_set_timeout (struct ee_device *dev, int ms)
+{
+  dev->ftdi.usb_read_timeout = dev->ftdi.usb_write_timeout = ms;
+}
+static int libftdi_open (struct ee_device *dev, const char *path)
+{
+  int ret, timeout, ms;
+
+  ftdi_init(&dev->ftdi);
+  if (dev->opts.timeout)
+    libftdi_set_timeout(dev, dev->opts.timeout);
+  timeout = dev->ftdi.usb_write_timeout;
+  pthread_mutex_lock(&open_lock);
+  /* Opening resets the chip, which counts against the deadline too */
+  if ((ms = ee_deadline_timeout(dev, timeout)) < 0) {
+    pthread_mutex_unlock(&open_lock);
+    ee_set_error(dev, "timed out waiting to open");
+    return -ETIMEDOUT;
+  }
+  libftdi_set_timeout(dev, ms);
+  ret = ftdi_usb_open_string(&dev->ftdi, path);
+  pthread_mutex_unlock(&open_lock);
+  libftdi_set_timeout(dev, timeout);
+  dev->open = ret == 0;
+
+  return ret ? -ENODEV : 0;
+}
+static int libftdi_open_first (struct ee_device *dev, struct eeprom_fields *ee)
+{
+  int ret;
+
+  ftdi_init(&dev->ftdi);
+  pthread_mutex_lock(&open_lock);
+  ret = ftdi_usb_open_desc(&dev->ftdi, ee->old_vid, ee->old_pid, NULL,
+                           ee->old_serno);
+  pthread_mutex_unlock(&open_lock);
+  dev->open = ret == 0;
+
+  return ret ? -ENODEV : 0;
+}
+static void libftdi_close (struct ee_device *dev)
+{
+  if (dev->open)
+    ftdi_usb_close(&dev->ftdi);
+  dev->open = false;
+  ftdi_deinit(&dev->ftdi);
+}
+#ifndef USE_LIBFTDI1
+/**
+ * Works out which libusb error a failed libftdi 0.x eeprom call stands
+ * for, so that only transient failures are retried. libusb-0.1 leaves
+ * the cause in errno, and a short read leaves errno at 0.
+ */
+static int libftdi_status (struct ee_device *dev, int ret, int err)
+{
+  if (!dev->ftdi.usb_dev)
+    return LIBUSB_ERROR_NO_DEVICE;	/* "USB device unavailable" */
+  if (ret != -1)
+    return LIBUSB_ERROR_OTHER;
+  switch (err) {
+  case 0:
+  case EIO:
+  case EPROTO:
+  case EILSEQ:		return LIBUSB_ERROR_IO;
+  case ETIMEDOUT:	return LIBUSB_ERROR_TIMEOUT;
+  case EPIPE:		return LIBUSB_ERROR_PIPE;
+  case EOVERFLOW:	return LIBUSB_ERROR_OVERFLOW;
+  case EBUSY:		return LIBUSB_ERROR_BUSY;
+  case ENODEV:
+  case ENXIO:
+  case ESHUTDOWN:	return LIBUSB_ERROR_NO_DEVICE;
+  case EACCES:
+  case EPERM:		return LIBUSB_ERROR_ACCESS;
+  default:		return LIBUSB_ERROR_OTHER;
+  }
+}
+#endif
+static int libftdi_read_words (struct ee_device *dev, struct ee_xfer *xfers,
+                               int count)
+{
+#ifdef USE_LIBFTDI1
+  /* Keep many reads in flight rather than paying a round trip each */
+  return ee_async_run(dev, dev->ftdi.usb_ctx, dev->ftdi.usb_dev,
+                      dev->ftdi.usb_read_timeout, xfers, count, false);
+#else
+  int i, timeout = dev->ftdi.usb_read_timeout, failed = 0;
+
+  for (i = 0; i < count; i++) {
+    xfers[i].status = LIBUSB_ERROR_INTERRUPTED;
+  }
+  for (i = 0; i < count && !failed; i++) {
+    uint64_t start = ee_xfer_start(dev);
+    int ret, err, ms = ee_deadline_timeout(dev, timeout);
+
+    if (ms < 0) {
+      xfers[i].status = LIBUSB_ERROR_TIMEOUT;
+      failed++;
+      break;
+    }
+    dev->ftdi.usb_read_timeout = ms;
+    errno = 0;
+    ret = ftdi_read_eeprom_location(&dev->ftdi, xfers[i].addr,
+                                    &xfers[i].val);
+    err = errno;
+    ee_xfer_done(dev, false, start);
+    xfers[i].status = 0;
+    if (ret) {
+      xfers[i].status = libftdi_status(dev, ret, err);
+      failed++;
+    }
+  }
+  dev->ftdi.usb_read_timeout = timeout;
+  return failed ? -EIO : 0;
+#endif
+}
+static int libftdi_write_words (struct ee_device *dev, struct ee_xfer *xfers,
+                                int count)
+{
+#ifdef USE_LIBFTDI1
+  /* libftdi1 refuses ftdi_write_eeprom_location() below 0x80, so
+   * issue the same vendor request that ftdi_write_eeprom() uses */
+  return ee_async_run(dev, dev->ftdi.usb_ctx, dev->ftdi.usb_dev,
+                      dev->ftdi.usb_write_timeout, xfers, count, true);
+#else
+  int i, timeout = dev->ftdi.usb_write_timeout, failed = 0;
+
+  for (i = 0; i < count; i++) {
+    uint64_t start = ee_xfer_start(dev);
+    int ret, err, ms = ee_deadline_timeout(dev, timeout);
+
+    if (ms < 0) {
+      xfers[i].status = LIBUSB_ERROR_TIMEOUT;
+      failed++;
+      continue;
+    }
+    dev->ftdi.usb_write_timeout = ms;
+    errno = 0;
+    ret = ftdi_write_eeprom_location(&dev->ftdi, xfers[i].addr,
+                                     xfers[i].val);
+    err = errno;
+    ee_xfer_done(dev, true, start);
+    xfers[i].status = 0;
+    if (ret) {
+      xfers[i].status = libftdi_status(dev, ret, err);
+      failed++;
+    }
+  }
+  dev->ftdi.usb_write_timeout = timeout;
+  return failed ? -EIO : 0;
+#endif
+}
+static int libftdi_prepare_write (struct ee_device *dev)
+{
+  unsigned short status;
+  int ret;
+
+  /* These commands were traced while running MProg */
+  if ((ret = ftdi_usb_reset(&dev->ftdi)) != 0) { return ret; }
+  if ((ret = ftdi_poll_modem_status(&dev->ftdi, &status)) != 0) { return ret; }
+  if ((ret = ftdi_set_latency_timer(&dev->ftdi, 0x77)) != 0) { return ret; }
+
+  return 0;
+}
+static int libftdi_reset (struct ee_device *dev)
+{
+  return ftdi_usb_reset(&dev->ftdi);
+}
+
+#define REENUM_QUEUE_LEN	16
+
+/* Arrivals seen while waiting for a device to come back */
+struct reenum_wait {
+  libusb_device *arrived[REENUM_QUEUE_LEN];
+  int count;
+};
+
+static int LIBUSB_CALL reenum_arrived (libusb_context *ctx,
+                                       libusb_device *d,
+                                       libusb_hotplug_event event,
+                                       void *user_data)
+{
+  struct reenum_wait *w = user_data;
+
+  if (w->count < REENUM_QUEUE_LEN)
+    w->arrived[w->count++] = libusb_ref_device(d);
+  return 0;
+}
+/* Reads the strings desc points at through an open handle */
+static void ee_identity_strings (libusb_device_handle *h,
+                                 struct libusb_device_descriptor *desc,
+                                 struct ee_identity *id)
+{
+  id->strings_known = true;
+  if (desc->iManufacturer)
+    libusb_get_string_descriptor_ascii(h, desc->iManufacturer,
+                                       (unsigned char *)id->manufacturer,
+                                       sizeof(id->manufacturer));
+  if (desc->iProduct)
+    libusb_get_string_descriptor_ascii(h, desc->iProduct,
+                                       (unsigned char *)id->product,
+                                       sizeof(id->product));
+  if (desc->iSerialNumber)
+    libusb_get_string_descriptor_ascii(h, desc->iSerialNumber,
+                                       (unsigned char *)id->serial,
+                                       sizeof(id->serial));
+}
+/**
+ * Reads the VID, PID and strings a device enumerated with. Returns 0
+ * or a libusb error.
+ */
+int ee_identity_read (libusb_device *d, struct ee_identity *id)
+{
+  struct libusb_device_descriptor desc;
+  libusb_device_handle *h;
+  int ret;
+
+  memset(id, 0, sizeof(*id));
+  if ((ret = libusb_get_device_descriptor(d, &desc)) != 0)
+    return ret;
+  id->vid = desc.idVendor;
+  id->pid = desc.idProduct;
+  if ((ret = libusb_open(d, &h)) != 0)
+    return ret;
+  ee_identity_strings(h, &desc, id);
+  libusb_close(h);
+
+  return 0;
+}
+/**
+ * Reads what a device that was reset without re-enumerating now
+ * reports, through the handle it kept. Returns 0 or a libusb error.
+ */
+static int reenum_identity_kept (struct ee_device *dev,
+                                 libusb_device_handle *usb,
+                                 struct ee_identity *id)
+{
+  struct libusb_device_descriptor desc;
+  int ret;
+
+  memset(id, 0, sizeof(*id));
+  if (usb) {
+    if ((ret = libusb_get_device_descriptor(libusb_get_device(usb),
+                                            &desc)) != 0)
+      return ret;
+    id->vid = desc.idVendor;
+    id->pid = desc.idProduct;
+    ee_identity_strings(usb, &desc, id);
+    return 0;
+  }
+#ifndef USE_LIBFTDI1
+  {
+    struct usb_device *d = usb_device(dev->ftdi.usb_dev);
+
+    if (!d)
+      return LIBUSB_ERROR_NO_DEVICE;
+    id->vid = d->descriptor.idVendor;
+    id->pid = d->descriptor.idProduct;
+    id->strings_known = true;
+    if (d->descriptor.iManufacturer)
+      usb_get_string_simple(dev->ftdi.usb_dev, d->descriptor.iManufacturer,
+                            id->manufacturer, sizeof(id->manufacturer));
+    if (d->descriptor.iProduct)
+      usb_get_string_simple(dev->ftdi.usb_dev, d->descriptor.iProduct,
+                            id->product, sizeof(id->product));
+    if (d->descriptor.iSerialNumber)
+      usb_get_string_simple(dev->ftdi.usb_dev, d->descriptor.iSerialNumber,
+                            id->serial, sizeof(id->serial));
+  }
+#endif
+  return 0;
+}
+/**
+ * Resets the USB port so the device loads its new settings. If none
+ * that the host compares changed, such as only the product string or
+ * the CBUS modes, it keeps its handle and is checked through that at
+ * once. Otherwise it re-enumerates, and a hotplug arrival is waited
+ * for to see it come back. With a libusb handle the arrival must be on
+ * the same port, and anything else turning up there is an error.
+ * libusb-0.1 cannot say which port a device is on, so with libftdi0
+ * (usb NULL) only the identity is matched.
+ */
+static int reenum_wait (struct ee_device *dev, libusb_device_handle *usb,
+                        struct ee_identity *expect, int timeout_ms,
+                        struct ee_identity *found)
+{
+  libusb_context *ctx;
+  libusb_hotplug_callback_handle handle;
+  struct reenum_wait w;
+  uint8_t ports[7];
+  int i, depth = 0, bus = -1, ret;
+  long deadline = ee_now_ns() / 1000000 + timeout_ms, left;
+
+  if (libusb_init(&ctx) != 0)
+    return -EIO;
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    libusb_exit(ctx);
+    return -ENOTSUP;
+  }
+  memset(&w, 0, sizeof(w));
+  if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                       LIBUSB_HOTPLUG_NO_FLAGS,
+                                       LIBUSB_HOTPLUG_MATCH_ANY,
+                                       LIBUSB_HOTPLUG_MATCH_ANY,
+                                       LIBUSB_HOTPLUG_MATCH_ANY,
+                                       reenum_arrived, &w, &handle) != 0) {
+    libusb_exit(ctx);
+    return -EIO;
+  }
+
+  /* Only reset once we are listening, so the arrival can't be missed */
+  if (usb) {
+    libusb_device *d = libusb_get_device(usb);
+
+    bus = libusb_get_bus_number(d);
+    depth = libusb_get_port_numbers(d, ports, sizeof(ports));
+    ret = libusb_reset_device(usb);
+  } else {
+#ifdef USE_LIBFTDI1
+    ret = LIBUSB_ERROR_INVALID_PARAM;
+#else
+    /* libusb-compat says ENOENT for LIBUSB_ERROR_NOT_FOUND, and
+     * libusb-0.1 itself passes on the kernel's ENODEV */
+    ret = usb_reset(dev->ftdi.usb_dev);
+    ret = ret == 0 ? 0 : (ret == -ENOENT || ret == -ENODEV) ?
+      LIBUSB_ERROR_NOT_FOUND : LIBUSB_ERROR_IO;
+#endif
+  }
+
+  if (ret == 0) {
+    ret = reenum_identity_kept(dev, usb, found) == 0 &&
+      ee_identity_matches(expect, found) ? 0 : -EPROTO;
+  } else if (ret == LIBUSB_ERROR_NOT_FOUND) {
+    ret = -ETIMEDOUT;		/* until it comes back */
+  } else {
+    ret = -EIO;
+  }
+  while (ret == -ETIMEDOUT &&
+         (left = deadline - (long)(ee_now_ns() / 1000000)) > 0) {
+    struct timeval tv = { left / 1000, (left % 1000) * 1000 };
+
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    for (i = 0; i < w.count; i++) {
+      libusb_device *d = w.arrived[i];
+      uint8_t p[7];
+
+      if (ret != -ETIMEDOUT) {
+        /* already decided */
+      } else if (bus >= 0) {
+        if (libusb_get_bus_number(d) == bus &&
+            libusb_get_port_numbers(d, p, sizeof(p)) == depth &&
+            memcmp(p, ports, depth) == 0 &&
+            ee_identity_read(d, found) == 0) {
+          ret = ee_identity_matches(expect, found) ? 0 : -EPROTO;
+        }
+      } else if (ee_identity_read(d, found) == 0 &&
+                 ee_identity_matches(expect, found)) {
+        ret = 0;
+      }
+      libusb_unref_device(d);
+    }
+    w.count = 0;
+  }
+
+  libusb_hotplug_deregister_callback(ctx, handle);
+  libusb_exit(ctx);
+
+  return ret;
+}
+static int libftdi_reenumerate (struct ee_device *dev,
+                                struct ee_identity *expect, int timeout_ms,
+                                struct ee_identity *found)
+{
+#ifdef USE_LIBFTDI1
+  return reenum_wait(dev, dev->ftdi.usb_dev, expect, timeout_ms, found);
+#else
+  return reenum_wait(dev, NULL, expect, timeout_ms, found);
+#endif
+}
+static const char *libftdi_error (struct ee_device *dev)
+{
+  return ftdi_get_error_string(&dev->ftdi);
+}
+
+const struct ee_transport ee_libftdi_transport = {
+  .name = "libftdi",
+  .find = libftdi_find,
+  .open = libftdi_open,
+  .open_first = libftdi_open_first,
+  .close = libftdi_close,
+  .set_timeout = libftdi_set_timeout,
+  .read_words = libftdi_read_words,
+  .write_words = libftdi_write_words,
+  .prepare_write = libftdi_prepare_write,
+  .reset = libftdi_reset,
+  .reenumerate = libftdi_reenumerate,
+  .error = libftdi_error,
+};
+
+/* ------------ libusb Transport ------------ */
+
+/*
+ * Talks to the device with the FTDI vendor requests directly, the
+ * same ones libftdi sends, so the EEPROM path is the same with either
+ * version of libftdi. Paths are "d:bus/address", as with libftdi1.
+ */
+
+#define LUSB_TIMEOUT		5000	/* ms, libftdi's default */
+#define FTDI_INDEX		1	/* interface A, for the SIO requests */
+
+static bool lusb_matches (libusb_device *d, struct eeprom_fields *ee)
+{
+  struct libusb_device_descriptor desc;
+  libusb_device_handle *h;
+  char serial[64] = "";
+  int ret;
+
+  if (libusb_get_device_descriptor(d, &desc) != 0)
+    return false;
+  if (ee->find_any_ftx ? desc.bcdDevice != EE_FTX_BCD_DEVICE :
+      desc.idVendor != ee->old_vid || desc.idProduct != ee->old_pid)
+    return false;
+  if (!ee->old_serno)
+    return true;
+  if (!desc.iSerialNumber || libusb_open(d, &h) != 0)
+    return false;
+  ret = libusb_get_string_descriptor_ascii(h, desc.iSerialNumber,
+                                           (unsigned char *)serial,
+                                           sizeof(serial));
+  libusb_close(h);
+
+  return ret >= 0 && strcmp(serial, ee->old_serno) == 0;
+}
+static int lusb_find (const struct ee_options *opts,
+                      struct eeprom_fields *ee, struct ee_path **paths)
+{
+  libusb_context *ctx;
+  libusb_device **list;
+  ssize_t i, count;
+  int n = 0;
+
+  if (libusb_init(&ctx) != 0)
+    return -EIO;
+  if ((count = libusb_get_device_list(ctx, &list)) < 0) {
+    libusb_exit(ctx);
+    return -EIO;
+  }
+
+  *paths = calloc(count ? count : 1, sizeof(**paths));
+  for (i = 0; i < count && *paths; i++) {
+    if (lusb_matches(list[i], ee)) {
+      snprintf((*paths)[n].path, sizeof((*paths)->path), "d:%03u/%03u",
+               libusb_get_bus_number(list[i]),
+               libusb_get_device_address(list[i]));
+      ee_path_topology(&(*paths)[n++], list[i]);
+    }
+  }
+  libusb_free_device_list(list, 1);
+  libusb_exit(ctx);
+
+  return *paths ? n : -ENOMEM;
+}
+static void lusb_set_timeout (struct ee_device *dev, int ms)
+{
+  dev->usb_timeout = ms;
+}
+static void lusb_close (struct ee_device *dev)
+{
+  if (dev->usb) {
+    libusb_release_interface(dev->usb, 0);
+    libusb_close(dev->usb);
+  }
+  if (dev->usb_ctx)
+    libusb_exit(dev->usb_ctx);
+  dev->usb = NULL;
+  dev->usb_ctx = NULL;
+  dev->open = false;
+}
+static int lusb_open (struct ee_device *dev, const char *path)
+{
+  libusb_device **list;
+  unsigned int bus, address;
+  ssize_t i, count;
+  int ret;
+
+  dev->usb_timeout = dev->opts.timeout ? dev->opts.timeout : LUSB_TIMEOUT;
+  if (sscanf(path, "d:%u/%u", &bus, &address) != 2) {
+    ee_set_error(dev, "%s: not a libusb path", path);
+    return -EINVAL;
+  }
+  if ((ret = libusb_init(&dev->usb_ctx)) != 0) {
+    dev->usb_ctx = NULL;
+    ee_set_error(dev, "libusb_init: %s", libusb_error_name(ret));
+    return -EIO;
+  }
+  if ((count = libusb_get_device_list(dev->usb_ctx, &list)) < 0) {
+    ee_set_error(dev, "listing devices: %s", libusb_error_name(count));
+    return -EIO;
+  }
+  ret = LIBUSB_ERROR_NOT_FOUND;
+  for (i = 0; i < count; i++) {
+    if (libusb_get_bus_number(list[i]) == bus &&
+        libusb_get_device_address(list[i]) == address) {
+      ret = libusb_open(list[i], &dev->usb);
+      break;
+    }
+  }
+  libusb_free_device_list(list, 1);
+
+  /* Keep ftdi_sio off the device while it is being programmed */
+  if (ret == 0) {
+    libusb_set_auto_detach_kernel_driver(dev->usb, 1);
+    ret = libusb_claim_interface(dev->usb, 0);
+  }
+  if (ret != 0) {
+    ee_set_error(dev, "%s: %s", path, libusb_error_name(ret));
+    if (dev->usb)
+      libusb_close(dev->usb);
+    dev->usb = NULL;
+    return -ENODEV;
+  }
+  dev->open = true;
+
+  return 0;
+}
+static int lusb_open_first (struct ee_device *dev, struct eeprom_fields *ee)
+{
+  struct ee_path *paths;
+  int n, ret;
+
+  if ((n = lusb_find(&dev->opts, ee, &paths)) < 0) {
+    ee_set_error(dev, "finding devices failed");
+    return n;
+  }
+  if (n == 0) {
+    ee_set_error(dev, "device not found");
+    ret = -ENODEV;
+  } else {
+    ret = lusb_open(dev, paths[0].path);
+  }
+  free(paths);
+
+  return ret;
+}
+static int lusb_read_words (struct ee_device *dev, struct ee_xfer *xfers,
+                            int count)
+{
+  return ee_async_run(dev, dev->usb_ctx, dev->usb, dev->usb_timeout,
+                      xfers, count, false);
+}
+static int lusb_write_words (struct ee_device *dev, struct ee_xfer *xfers,
+                             int count)
+{
+  return ee_async_run(dev, dev->usb_ctx, dev->usb, dev->usb_timeout,
+                      xfers, count, true);
+}
+/* Sends a vendor request with no data stage */
+static int lusb_request (struct ee_device *dev, int request, int value)
+{
+  int ret = libusb_control_transfer(dev->usb, FTDI_REQ_OUT, request, value,
+                                    FTDI_INDEX, NULL, 0, dev->usb_timeout);
+
+  if (ret < 0) {
+    ee_set_error(dev, "request 0x%02x: %s", request, libusb_error_name(ret));
+    return -EIO;
+  }
+  return 0;
+}
+static int lusb_prepare_write (struct ee_device *dev)
+{
+  unsigned char status[2];
+  int ret;
+
+  /* The same sequence as libftdi_prepare_write() */
+  if ((ret = lusb_request(dev, FTDI_SIO_RESET, 0)) < 0)
+    return ret;
+  ret = libusb_control_transfer(dev->usb, FTDI_REQ_IN,
+                                FTDI_SIO_POLL_MODEM_STATUS, 0, FTDI_INDEX,
+                                status, sizeof(status), dev->usb_timeout);
+  if (ret != sizeof(status)) {
+    ee_set_error(dev, "polling modem status: %s",
+                 libusb_error_name(ret < 0 ? ret : LIBUSB_ERROR_IO));
+    return -EIO;
+  }
+  return lusb_request(dev, FTDI_SIO_SET_LATENCY_TIMER, 0x77);
+}
+static int lusb_reset (struct ee_device *dev)
+{
+  return lusb_request(dev, FTDI_SIO_RESET, 0);
+}
+static int lusb_reenumerate (struct ee_device *dev,
+                             struct ee_identity *expect, int timeout_ms,
+                             struct ee_identity *found)
+{
+  return reenum_wait(dev, dev->usb, expect, timeout_ms, found);
+}
+static const char *lusb_error (struct ee_device *dev)
+{
+  return "libusb request failed";
+}
+
+const struct ee_transport ee_libusb_transport = {
+  .name = "libusb",
+  .find = lusb_find,
+  .open = lusb_open,
+  .open_first = lusb_open_first,
+  .close = lusb_close,
+  .set_timeout = lusb_set_timeout,
+  .read_words = lusb_read_words,
+  .write_words = lusb_write_words,
+  .prepare_write = lusb_prepare_write,
+  .reset = lusb_reset,
+  .reenumerate = lusb_reenumerate,
+  .error = lusb_error,
+};
+
+/* ------------ Simulated Devices ------------ */
+
+/* How long a simulated device is gone for while it re-enumerates */
+#define SIM_REENUM_MS	50
+
+/**
+ * An FT-X that only exists in memory. It enumerates with whatever
+ * its MTP held at the last reset, or the factory defaults if the CRC
+ * was bad then, just like the real thing.
+ */
+struct sim_device {
+  pthread_mutex_t lock;
+  unsigned char mtp[EE_MTP_SIZE];
+  struct ee_identity id;	/* as enumerated */
+  int address;			/* changes each time it re-enumerates */
+  unsigned int seed;		/* for injected errors */
+  uint64_t gone_until;		/* ns, while re-enumerating */
+};
+
+/* Devices sit on 7-port hubs, four to a controller, like a fixture */
+#define SIM_HUB_PORTS	7
+#define SIM_BUS_HUBS	4
+
+/* A bus of simulated devices, shared by every handle opened on it */
+struct ee_sim {
+  int count;
+  int latency_us;		/* per round of transfers */
+  int error_every;		/* one transfer in this many fails, or 0 */
+  int contention;		/* rounds a hub carries at full speed, or 0 */
+  struct sim_device *devices;
+  pthread_mutex_t lock;		/* for hub_rounds */
+  int *hub_rounds;		/* rounds in flight on each hub */
+};
+
+static uint64_t sim_now (void)
+{
+  return ee_now_ns();
+}
+static void sim_sleep_us (long us)
+{
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+  while (us > 0 && nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+/* Called with sim->lock held */
+static void sim_enumerate (struct sim_device *sim)
+{
+  sim->address = sim->address % 127 + 1;
+  ee_identity_from_image(NULL, sim->mtp, &sim->id);
+}
+/**
+ * Creates a bus of count devices, each holding a valid image with
+ * serial number SIMnnnnn, whose transfers take latency_us. Returns
+ * NULL if out of memory.
+ */
+struct ee_sim *ee_sim_new (int count, int latency_us)
+{
+  struct ee_sim *bus = calloc(1, sizeof(*bus));
+  struct eeprom_fields ee;
+  char serial[16];
+  int i;
+
+  if (bus) {
+    bus->devices = calloc(count ? count : 1, sizeof(*bus->devices));
+    bus->hub_rounds = calloc(count / SIM_HUB_PORTS + 1,
+                             sizeof(*bus->hub_rounds));
+  }
+  if (!bus || !bus->devices || !bus->hub_rounds) {
+    if (bus) {
+      free(bus->devices);
+      free(bus->hub_rounds);
+    }
+    free(bus);
+    return NULL;
+  }
+  bus->count = count;
+  bus->latency_us = latency_us;
+  pthread_mutex_init(&bus->lock, NULL);
+
+  for (i = 0; i < count; i++) {
+    struct sim_device *sim = &bus->devices[i];
+
+    memset(&ee, 0, sizeof(ee));
+    ee.usb_vid = 0x0403;
+    ee.usb_pid = 0x6015;
+    ee.usb_release_major = 0x10;
+    ee.max_power = 45;
+    ee.load_vcp = 1;
+    ee.serial_number_avail = 1;
+    ee.manufacturer_string = "FTDI";
+    ee.product_string = "FT230X Basic UART";
+    snprintf(serial, sizeof(serial), "SIM%05d", i);
+    ee.serial_string = serial;
+    ee_encode(NULL, sim->mtp, 0x100, &ee);
+
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->address = i;
+    sim->seed = i + 1;
+    sim_enumerate(sim);
+  }
+
+  return bus;
+}
+/**
+ * Makes one transfer in every one_in, on average, fail as if the bus
+ * glitched. 0 turns it off.
+ */
+void ee_sim_set_errors (struct ee_sim *bus, int one_in)
+{
+  bus->error_every = one_in;
+}
+/**
+ * Makes each hub slow down once it has more than rounds of transfers
+ * in flight at once, as a real hub's transaction translator does.
+ * Beyond that every round takes longer with the square of the load,
+ * so the hub moves less in total. 0 turns it off.
+ */
+void ee_sim_set_contention (struct ee_sim *bus, int rounds)
+{
+  bus->contention = rounds;
+}
+/**
+ * Frees a bus, which nothing may have open any more
+ */
+void ee_sim_free (struct ee_sim *bus)
+{
+  int i;
+
+  if (!bus)
+    return;
+  for (i = 0; i < bus->count; i++) {
+    pthread_mutex_destroy(&bus->devices[i].lock);
+  }
+  pthread_mutex_destroy(&bus->lock);
+  free(bus->devices);
+  free(bus->hub_rounds);
+  free(bus);
+}
+static bool sim_present (struct sim_device *sim)
+{
+  return sim_now() >= sim->gone_until;
+}
+static bool sim_matches (struct sim_device *sim, struct eeprom_fields *ee)
+{
+  /* Every simulated device is an FT-X */
+  return sim_present(sim) && (ee->find_any_ftx ||
+    (sim->id.vid == ee->old_vid && sim->id.pid == ee->old_pid)) &&
+    (!ee->old_serno || strcmp(sim->id.serial, ee->old_serno) == 0);
+}
+static int sim_find (const struct ee_options *opts, struct eeprom_fields *ee,
+                     struct ee_path **paths)
+{
+  struct ee_sim *bus = opts->sim;
+  int i, n = 0;
+
+  if (!bus)
+    return -ENODEV;
+  *paths = calloc(bus->count ? bus->count : 1, sizeof(**paths));
+  if (!*paths)
+    return -ENOMEM;
+
+  for (i = 0; i < bus->count; i++) {
+    struct sim_device *sim = &bus->devices[i];
+
+    pthread_mutex_lock(&sim->lock);
+    if (sim_matches(sim, ee)) {
+      struct ee_path *p = &(*paths)[n++];
+      int hub = i / SIM_HUB_PORTS;
+
+      snprintf(p->path, sizeof(p->path), "s:%d/%03d", i, sim->address);
+      p->bus = 1 + hub / SIM_BUS_HUBS;
+      p->depth = 2;
+      p->ports[0] = 1 + hub % SIM_BUS_HUBS;
+      p->ports[1] = 1 + i % SIM_HUB_PORTS;
+    }
+    pthread_mutex_unlock(&sim->lock);
+  }
+
+  return n;
+}
+static int sim_attach (struct ee_device *dev, struct sim_device *sim)
+{
+  dev->error[0] = '\0';
+  dev->sim = sim;
+  dev->sim_address = sim->address;
+  dev->open = true;
+  return 0;
+}
+static int sim_open (struct ee_device *dev, const char *path)
+{
+  struct ee_sim *bus = dev->opts.sim;
+  int index, address, ret = -ENODEV;
+
+  ee_set_error(dev, "device not found");
+  if (!bus || sscanf(path, "s:%d/%d", &index, &address) != 2 ||
+      index < 0 || index >= bus->count)
+    return -ENODEV;
+
+  pthread_mutex_lock(&bus->devices[index].lock);
+  if (sim_present(&bus->devices[index]) &&
+      bus->devices[index].address == address) {
+    ret = sim_attach(dev, &bus->devices[index]);
+  }
+  pthread_mutex_unlock(&bus->devices[index].lock);
+
+  return ret;
+}
+static int sim_open_first (struct ee_device *dev, struct eeprom_fields *ee)
+{
+  struct ee_sim *bus = dev->opts.sim;
+  int i, ret = -ENODEV;
+
+  ee_set_error(dev, "device not found");
+  for (i = 0; bus && i < bus->count && ret; i++) {
+    pthread_mutex_lock(&bus->devices[i].lock);
+    if (sim_matches(&bus->devices[i], ee))
+      ret = sim_attach(dev, &bus->devices[i]);
+    pthread_mutex_unlock(&bus->devices[i].lock);
+  }
+
+  return ret;
+}
+static void sim_close (struct ee_device *dev)
+{
+  dev->open = false;
+  dev->sim = NULL;
+}
+static void sim_set_timeout (struct ee_device *dev, int ms)
+{
+}
+/**
+ * Starts a round of transfers on the device's hub and returns how
+ * long it takes, given what else the hub is carrying. *hub is left
+ * for sim_round_end(), -1 if the round wasn't counted.
+ */
+static long sim_round_begin (struct ee_device *dev, int *hub)
+{
+  struct ee_sim *bus = dev->opts.sim;
+  long us = bus->latency_us, load;
+
+  *hub = -1;
+  if (!bus->contention)
+    return us;
+  *hub = (dev->sim - bus->devices) / SIM_HUB_PORTS;
+  pthread_mutex_lock(&bus->lock);
+  load = ++bus->hub_rounds[*hub];
+  pthread_mutex_unlock(&bus->lock);
+  if (load > bus->contention)
+    us = us * load * load / ((long)bus->contention * bus->contention);
+
+  return us;
+}
+static void sim_round_end (struct ee_device *dev, int hub)
+{
+  struct ee_sim *bus = dev->opts.sim;
+
+  if (hub < 0)
+    return;
+  pthread_mutex_lock(&bus->lock);
+  bus->hub_rounds[hub]--;
+  pthread_mutex_unlock(&bus->lock);
+}
+/**
+ * Runs a list of word transfers against the MTP. Transfers go in
+ * rounds of up to queue_depth, each round taking the bus latency,
+ * which is roughly how the async libftdi1 engine overlaps them.
+ */
+static int sim_transfer (struct ee_device *dev, struct ee_xfer *xfers,
+                         int count, bool write)
+{
+  struct sim_device *sim = dev->sim;
+  int i, done, failed = 0;
+
+  for (i = 0; i < count; i++) {
+    xfers[i].status = LIBUSB_ERROR_INTERRUPTED;
+  }
+  for (done = 0; done < count && (write || !failed); ) {
+    int depth = dev->opts.queue_depth;
+    int round = count - done < depth ? count - done : depth, hub;
+    uint64_t start = ee_xfer_start(dev);
+    long us = sim_round_begin(dev, &hub);
+    int ms = ee_deadline_timeout(dev, 0);
+    bool late = ms < 0 || (dev->opts.deadline && us > ms * 1000L);
+
+    /* A round that would outlast the deadline times out at it */
+    sim_sleep_us(!late ? us : ms > 0 ? ms * 1000L : 0);
+    sim_round_end(dev, hub);
+    pthread_mutex_lock(&sim->lock);
+    for (i = done; i < done + round; i++) {
+      struct ee_xfer *x = &xfers[i];
+
+      ee_xfer_done(dev, write, start);
+      if (late) {
+        x->status = LIBUSB_ERROR_TIMEOUT;
+      } else if (!sim_present(sim) || sim->address != dev->sim_address) {
+        x->status = LIBUSB_ERROR_NO_DEVICE;
+      } else if (x->addr >= sizeof(sim->mtp)/2) {
+        x->status = LIBUSB_ERROR_PIPE;
+      } else if (dev->opts.sim->error_every &&
+                 rand_r(&sim->seed) % dev->opts.sim->error_every == 0) {
+        /* A glitch: the transfer times out or the endpoint stalls */
+        x->status = sim->seed & 1 ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_PIPE;
+      } else if (write) {
+        ee_set_word(sim->mtp, x->addr, x->val);
+        x->status = 0;
+      } else {
+        x->val = ee_get_word(sim->mtp, x->addr);
+        x->status = 0;
+      }
+      if (x->status) {
+        failed++;
+        if (!write) break;
+      }
+    }
+    pthread_mutex_unlock(&sim->lock);
+    done += round;
+  }
+  if (failed)
+    ee_set_error(dev, "transfer failed");
+
+  return failed ? -EIO : 0;
+}
+static int sim_read_words (struct ee_device *dev, struct ee_xfer *xfers,
+                           int count)
+{
+  return sim_transfer(dev, xfers, count, false);
+}
+static int sim_write_words (struct ee_device *dev, struct ee_xfer *xfers,
+                            int count)
+{
+  return sim_transfer(dev, xfers, count, true);
+}
+static int sim_prepare_write (struct ee_device *dev)
+{
+  struct sim_device *sim = dev->sim;
+  int ret = 0;
+
+  pthread_mutex_lock(&sim->lock);
+  if (!sim_present(sim) || sim->address != dev->sim_address) {
+    ee_set_error(dev, "device gone");
+    ret = -ENODEV;
+  }
+  pthread_mutex_unlock(&sim->lock);
+
+  return ret;
+}
+/**
+ * Drops off the bus and comes back SIM_REENUM_MS later at a new
+ * address, enumerating with the new contents of the MTP
+ */
+static int sim_reset (struct ee_device *dev)
+{
+  struct sim_device *sim = dev->sim;
+
+  pthread_mutex_lock(&sim->lock);
+  sim_enumerate(sim);
+  sim->gone_until = sim_now() + SIM_REENUM_MS * 1000000ULL;
+  pthread_mutex_unlock(&sim->lock);
+
+  return 0;
+}
+static int sim_reenumerate (struct ee_device *dev, struct ee_identity *expect,
+                            int timeout_ms, struct ee_identity *found)
+{
+  struct sim_device *sim = dev->sim;
+  long wait_us;
+
+  sim_reset(dev);
+  pthread_mutex_lock(&sim->lock);
+  wait_us = (sim->gone_until - sim_now()) / 1000;
+  pthread_mutex_unlock(&sim->lock);
+  if (wait_us > timeout_ms * 1000L) {
+    sim_sleep_us(timeout_ms * 1000L);
+    return -ETIMEDOUT;
+  }
+  sim_sleep_us(wait_us);
+
+  pthread_mutex_lock(&sim->lock);
+  *found = sim->id;
+  pthread_mutex_unlock(&sim->lock);
+  return ee_identity_matches(expect, found) ? 0 : -EPROTO;
+}
+static const char *sim_error (struct ee_device *dev)
+{
+  return "no error";
+}
+
+const struct ee_transport ee_sim_transport = {
+  .name = "sim",
+  .find = sim_find,
+  .open = sim_open,
+  .open_first = sim_open_first,
+  .close = sim_close,
+  .set_timeout = sim_set_timeout,
+  .read_words = sim_read_words,
+  .write_words = sim_write_words,
+  .prepare_write = sim_prepare_write,
+  .reset = sim_reset,
+  .reenumerate = sim_reenumerate,
+  .error = sim_error,
+};
@@ -0,0 +1,400 @@
+/*
+ * libftxprog: reading, writing, encoding and decoding the MTP memory
+ * of FTDI's FT-X series.
+ *
+ * All state lives in the ee_device handle and the ee_options it was
+ * opened with, so separate handles can be used from separate threads
+ * at once. Nothing here prints or exits; functions return 0 or a
+ * negative errno, and ee_error() says what went wrong on a handle.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE.txt.  If not, write to
+ * the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef FTXPROG_H
+#define FTXPROG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <ftdi.h>
+
+#define CBUS_COUNT	7
+#define EE_MAX_QUEUE_DEPTH	128
+#define EE_MTP_SIZE	0x800	/* bytes, the settings then the user area */
+#define EE_USER_AREA	0x100	/* where the user area starts */
+#define EE_AREA_MAX	0x100	/* bytes per ee_read_area()/ee_write_area() */
+#define EE_FTX_BCD_DEVICE	0x1000	/* bcdDevice of every FT-X, any VID/PID */
+
+/* ------------ Bit Definitions for EEPROM Decoding ------------ */
+
+enum cbus_mode {
+  cbus_tristate	=  0,
+  cbus_rxled	=  1,
+  cbus_txled	=  2,
+  cbus_txrxled	=  3,
+  cbus_pwren	=  4,
+  cbus_sleep	=  5,
+  cbus_drive0	=  6,
+  cbus_drive1	=  7,
+  cbus_gpio	=  8,
+  cbus_txden	=  9,
+  cbus_clk24	= 10,
+  cbus_clk12	= 11,
+  cbus_clk6	= 12,
+  cbus_bcd_det	= 13,
+  cbus_bcd_det_i	= 14,
+  cbus_i2c_txe	= 15,
+  cbus_i2c_rxf	= 16,
+  cbus_vbus_sense	= 17,
+  cbus_bitbang_wr	= 18,
+  cbus_bitbang_rd	= 19,
+  cbus_timestamp	= 20,
+  cbus_keep_awake	= 21,
+  _cbus_mode_end
+};
+enum misc_config {
+  bcd_enable		= 0x01,
+  force_power_enable	= 0x02,
+  deactivate_sleep	= 0x04,
+  rs485_echo_suppress	= 0x08,
+  ext_osc			= 0x10,
+  ext_osc_feedback_en	= 0x20,
+  vbus_sense_alloc	= 0x40,
+  load_vcp		= 0x80,
+};
+enum power_config {
+  remote_wakeup		= 0x20,
+  self_powered		= 0x40,
+};
+enum dbus_cbus_config {
+  dbus_drive_strength	= 0x03,
+  dbus_slow_slew		= 0x04,
+  dbus_schmitt		= 0x08,
+  cbus_drive_strength	= 0x30,
+  cbus_slow_slew		= 0x40,
+  cbus_schmitt		= 0x80,
+};
+enum peripheral_config {
+  suspend_pull_down	= 0x04,
+  serial_number_avail	= 0x08,
+  ft1248_cpol		= 0x10,
+  ft1248_bord		= 0x20,
+  ft1248_flow_control	= 0x40,
+  disable_i2c_schmitt	= 0x80,
+  invert_txd		= 0x01,
+  invert_rxd		= 0x02,
+  invert_rts		= 0x04,
+  invert_cts		= 0x08,
+  invert_dtr		= 0x10,
+  invert_dsr		= 0x20,
+  invert_dcd		= 0x40,
+  invert_ri		= 0x80,
+};
+
+struct eeprom_fields {
+  /* Misc Config */
+  unsigned char bcd_enable;
+  unsigned char force_power_enable;
+  unsigned char deactivate_sleep;
+  unsigned char rs485_echo_suppress;
+  unsigned char ext_osc;
+  unsigned char ext_osc_feedback_en;
+  unsigned char vbus_sense_alloc;
+  unsigned char load_vcp;
+
+  /* USB VID/PID */
+  unsigned short usb_vid;
+  unsigned short usb_pid;
+
+  /* USB Release Number */
+  unsigned short usb_release_major;
+  unsigned short usb_release_minor;
+
+  /* Max Power and Config */
+  unsigned char remote_wakeup;
+  unsigned char self_powered;
+  unsigned char max_power; /* Units of 2mA */
+
+  /* Device and perhiperal control */
+  unsigned char suspend_pull_down;
+  unsigned char serial_number_avail;
+  unsigned char ft1248_cpol;
+  unsigned char ft1248_bord;
+  unsigned char ft1248_flow_control;
+  unsigned char disable_i2c_schmitt;
+  unsigned char invert_txd;
+  unsigned char invert_rxd;
+  unsigned char invert_rts;
+  unsigned char invert_cts;
+  unsigned char invert_dtr;
+  unsigned char invert_dsr;
+  unsigned char invert_dcd;
+  unsigned char invert_ri;
+
+  /* DBUS & CBUS Control */
+  unsigned char dbus_drive_strength;
+  unsigned char dbus_slow_slew;
+  unsigned char dbus_schmitt;
+  unsigned char cbus_drive_strength;
+  unsigned char cbus_slow_slew;
+  unsigned char cbus_schmitt;
+
+  /* Manufacturer, Product and Serial Number string */
+  char* manufacturer_string;
+  char* product_string;
+  char* serial_string;
+
+  /* I2C */
+  unsigned short i2c_slave_addr;
+  unsigned int i2c_device_id;
+
+  /* CBUS */
+  enum cbus_mode cbus[CBUS_COUNT];
+
+  /* Other memory areas */
+  unsigned char user_mem[92];			/* user memory space */
+  unsigned char factory_config[32];	/* factory configuration values */
+
+  /* These are not actually eeprom values; here for convenience */
+  unsigned short		old_vid;
+  unsigned short		old_pid;
+  const char		*old_serno;
+  bool			find_any_ftx;	/* any VID/PID, by bcdDevice */
+};
+
+/* ------------ Field Schema ------------ */
+
+/* How a field is held, shown and set */
+enum ee_field_format {
+  ee_format_bool,		/* one bit, the mask */
+  ee_format_uint,		/* a little-endian number */
+  ee_format_cbus,		/* a cbus_mode byte */
+  ee_format_string,		/* a descriptor's pointer byte, then length */
+  ee_format_bytes,		/* a block copied as it is */
+};
+
+/**
+ * Where one setting lives in the image and in struct eeprom_fields,
+ * and how it is shown and set. A number or cbus mode is the little
+ * endian value of the width bytes at offset, masked and shifted down.
+ * ee_fields[] lists them in the order they are shown.
+ */
+struct ee_field {
+  /* What the codec looks at comes first, to share a cache line */
+  enum ee_field_format format;
+  unsigned int mask;		/* in place, before the shift */
+  unsigned char offset, width;	/* in bytes */
+  unsigned char shift;
+  unsigned char size;		/* of the member */
+  unsigned short member;	/* offsetof() in struct eeprom_fields */
+  unsigned char scale, bias;	/* a number is shown as value*scale+bias */
+  const char *name;		/* json key */
+  const char *label;		/* shown as, "" to run on, NULL if not */
+  const char *section;		/* heading shown before it, or NULL */
+  const char *arg;		/* option setting it, or NULL */
+  const char *help;		/* what the option takes */
+  const char *shown;		/* printf format for a number */
+  const char *on, *off;		/* for a bool, if not True and False */
+  bool arg_inverted;		/* the option means the opposite */
+};
+
+extern const struct ee_field ee_fields[];
+extern const int ee_field_count;
+
+/* ------------ Devices ------------ */
+
+/* One word transfer */
+struct ee_xfer {
+  unsigned short addr;
+  unsigned short val;		/* value to write, or the value read */
+  int status;			/* 0, or a libusb error code */
+};
+
+#define EE_MAX_PORTS	7	/* tiers of hubs below a root hub */
+
+/* Where a device was found, to pass to ee_open() */
+struct ee_path {
+  char path[64];		/* eg. "d:001/004" or "s:2/005" */
+  /* Where it sits on the bus, to tell which devices share a hub */
+  int bus;			/* root controller, 0 if not known */
+  int depth;			/* ports known, 0 if none */
+  unsigned char ports[EE_MAX_PORTS];	/* from the root hub down */
+};
+
+/* What a device enumerates as */
+struct ee_identity {
+  unsigned short vid, pid;
+  bool strings_known;		/* false if only the vid and pid matter */
+  char manufacturer[0x100], product[0x100], serial[0x100];
+};
+
+/* The outcome of writing an image, word by word */
+struct ee_write_result {
+  int written;			/* words acknowledged by the device */
+  int skipped;			/* words already holding the new value */
+  int error_count;
+  struct ee_word_error {
+    unsigned short addr;
+    int status;			/* libusb error code */
+  } errors[0x80];
+};
+
+/* Steps of ee_write() reported to on_phase */
+enum ee_phase {
+  ee_phase_prepare,
+  ee_phase_write,
+};
+
+struct ee_device;
+struct ee_options;
+struct ee_sim;
+struct libusb_context;
+struct libusb_device;
+struct libusb_device_handle;
+
+/**
+ * The ways of reaching a device. Paths come from find() and are only
+ * meaningful to the transport that made them.
+ */
+struct ee_transport {
+  const char *name;
+  /* Lists the devices matching the old vid, pid and serial number */
+  int (*find) (const struct ee_options *opts, struct eeprom_fields *ee,
+               struct ee_path **paths);
+  int (*open) (struct ee_device *dev, const char *path);
+  /* Opens the first device matching the old vid, pid and serial number */
+  int (*open_first) (struct ee_device *dev, struct eeprom_fields *ee);
+  /* Safe to call whether or not the open succeeded */
+  void (*close) (struct ee_device *dev);
+  void (*set_timeout) (struct ee_device *dev, int ms);
+  /* Stops at the first failure. Returns 0 or -EIO */
+  int (*read_words) (struct ee_device *dev, struct ee_xfer *xfers, int count);
+  /* Carries on past failures. Returns 0 or -EIO */
+  int (*write_words) (struct ee_device *dev, struct ee_xfer *xfers, int count);
+  int (*prepare_write) (struct ee_device *dev);
+  int (*reset) (struct ee_device *dev);
+  /* Resets the port and waits for the device to come back. Returns 0,
+   * -ETIMEDOUT, or -EPROTO if it came back as something else */
+  int (*reenumerate) (struct ee_device *dev, struct ee_identity *expect,
+                      int timeout_ms, struct ee_identity *found);
+  const char *(*error) (struct ee_device *dev);
+};
+
+extern const struct ee_transport ee_libftdi_transport;
+extern const struct ee_transport ee_libusb_transport;
+extern const struct ee_transport ee_sim_transport;
+
+/* How a device is reached and handled. A handle keeps its own copy. */
+struct ee_options {
+  const struct ee_transport *transport;	/* ee_libftdi_transport if NULL */
+  struct ee_sim *sim;		/* devices for ee_sim_transport */
+  bool use_8b_strings;		/* strings are plain bytes, not FT Prog's */
+  int queue_depth;		/* transfers kept in flight at once */
+  int verify_retries;		/* times ee_verify() rewrites */
+  int timeout;			/* ms for each request, 0 for the default */
+  int retries;			/* times a transient failure is retried */
+  int retry_backoff_us;		/* before the first retry, doubling */
+  uint64_t deadline;		/* ee_now_ns() by which transfers must be
+				 * done, or 0; later ones time out */
+
+  /* Called, if set, as each transfer or step of ee_write() finishes
+   * with when it started by ee_now_ns(), and before each retry with
+   * the first word being retried. Must be thread-safe. */
+  void (*on_xfer) (void *arg, bool write, uint64_t start_ns);
+  void (*on_phase) (void *arg, enum ee_phase phase, uint64_t start_ns);
+  void (*on_retry) (void *arg, unsigned short addr, int status, int attempt);
+  void *arg;
+};
+
+/* An open device, on whichever transport. The fields are private. */
+struct ee_device {
+  const struct ee_transport *ops;
+  struct ee_options opts;
+  bool open;
+  struct ftdi_context ftdi;	/* libftdi */
+  struct libusb_context *usb_ctx;	/* libusb */
+  struct libusb_device_handle *usb;
+  int usb_timeout;
+  struct sim_device *sim;	/* sim */
+  int sim_address;
+  char error[128];
+};
+
+/* ------------ Functions ------------ */
+
+unsigned short calc_crc_ftx (void *addr);
+unsigned short update_crc_word (unsigned short crc, int addr,
+                                unsigned short old_val,
+                                unsigned short new_val);
+unsigned short update_crc (void *addr, int len);
+
+/* opts may be NULL in these for the defaults */
+int ee_encode (const struct ee_options *opts, unsigned char *eeprom, int len,
+               struct eeprom_fields *ee);
+void ee_decode (const struct ee_options *opts, unsigned char *eeprom, int len,
+                struct eeprom_fields *ee);
+int ee_diff (const unsigned char *a, const unsigned char *b,
+             const struct ee_field **changed, int max);
+const struct ee_field *ee_field_find (const char *name);
+void *ee_field_ptr (struct eeprom_fields *ee, const struct ee_field *f);
+unsigned int ee_field_get (const struct eeprom_fields *ee,
+                           const struct ee_field *f);
+void ee_field_set (struct eeprom_fields *ee, const struct ee_field *f,
+                   unsigned int val);
+int ee_encode_str (const struct ee_options *opts, const char *str,
+                   unsigned char *out);
+void ee_decode_str (const struct ee_options *opts, const unsigned char *ptr,
+                    unsigned char len, char *str);
+void ee_identity_from_image (const struct ee_options *opts,
+                             unsigned char *eeprom, struct ee_identity *id);
+bool ee_identity_matches (struct ee_identity *expect,
+                          struct ee_identity *found);
+int ee_identity_read (struct libusb_device *d, struct ee_identity *id);
+
+unsigned short ee_get_word (unsigned char *eeprom, int addr);
+void ee_set_word (unsigned char *eeprom, int addr, unsigned short val);
+bool ee_word_writable (int addr);
+
+uint64_t ee_now_ns (void);
+
+int ee_find (const struct ee_options *opts, struct eeprom_fields *ee,
+             struct ee_path **paths);
+int ee_open (struct ee_device *dev, const struct ee_options *opts,
+             const char *path);
+int ee_open_first (struct ee_device *dev, const struct ee_options *opts,
+                   struct eeprom_fields *ee);
+void ee_close (struct ee_device *dev);
+const char *ee_error (struct ee_device *dev);
+void ee_set_timeout (struct ee_device *dev, int ms);
+int ee_read_words (struct ee_device *dev, struct ee_xfer *xfers, int count);
+int ee_write_words (struct ee_device *dev, struct ee_xfer *xfers, int count);
+int ee_read (struct ee_device *dev, unsigned char *eeprom, int len);
+int ee_write (struct ee_device *dev, unsigned char *old,
+              unsigned char *eeprom, int len, struct ee_write_result *res);
+int ee_verify (struct ee_device *dev, unsigned char *eeprom, int len);
+int ee_prepare_write (struct ee_device *dev);
+int ee_read_area (struct ee_device *dev, int addr, unsigned char *buf,
+                  int len);
+int ee_write_area (struct ee_device *dev, int addr, unsigned char *old,
+                   unsigned char *buf, int len, struct ee_write_result *res);
+int ee_reset (struct ee_device *dev);
+int ee_reenumerate (struct ee_device *dev, struct ee_identity *expect,
+                    int timeout_ms, struct ee_identity *found);
+
+struct ee_sim *ee_sim_new (int count, int latency_us);
+void ee_sim_set_errors (struct ee_sim *sim, int one_in);
+void ee_sim_set_contention (struct ee_sim *sim, int rounds);
+void ee_sim_free (struct ee_sim *sim);
+
+#endif /* FTXPROG_H */